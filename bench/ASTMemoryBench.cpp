@@ -0,0 +1,261 @@
+// Allocation count and peak heap use of the arena AST against the previous
+// unique_ptr/std::string/vtable layout, plus JSON dump time of a deep
+// expression with the streaming printer and with recursive concatenation.
+//
+// The legacy tree is built from the already parsed arena AST, so its numbers
+// leave out parser overhead and are, if anything, flattering to it.
+#include "../src/AST.hpp"
+#include "../src/CompilerSession.hpp"
+#include "../src/Parser.hpp"
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <malloc.h>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+static size_t allocationCount = 0;
+static size_t liveBytes = 0;
+static size_t peakBytes = 0;
+
+static void *countedAlloc(size_t size, size_t align) {
+  void *p = align > alignof(std::max_align_t)
+                ? aligned_alloc(align, (size + align - 1) / align * align)
+                : malloc(size ? size : 1);
+  if (!p) {
+    throw std::bad_alloc();
+  }
+  allocationCount++;
+  liveBytes += malloc_usable_size(p);
+  if (liveBytes > peakBytes) {
+    peakBytes = liveBytes;
+  }
+  return p;
+}
+
+static void countedFree(void *p) {
+  if (p) {
+    liveBytes -= malloc_usable_size(p);
+    free(p);
+  }
+}
+
+void *operator new(size_t size) { return countedAlloc(size, 0); }
+void *operator new[](size_t size) { return countedAlloc(size, 0); }
+void *operator new(size_t size, std::align_val_t align) {
+  return countedAlloc(size, size_t(align));
+}
+void operator delete(void *p) noexcept { countedFree(p); }
+void operator delete[](void *p) noexcept { countedFree(p); }
+void operator delete(void *p, size_t) noexcept { countedFree(p); }
+void operator delete[](void *p, size_t) noexcept { countedFree(p); }
+void operator delete(void *p, std::align_val_t) noexcept { countedFree(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+  countedFree(p);
+}
+
+namespace legacy {
+// The node layout AST.hpp used before the arena.
+class ExpressAST {
+public:
+  virtual ~ExpressAST() {}
+  virtual std::string getText() = 0;
+};
+
+class NumberExpressionAST : public ExpressAST {
+public:
+  NumberExpressionAST(double Val) : value(Val) {}
+  double value;
+  std::string getText() override {
+    return "{\"type\":\"Number expression\", \"value\": " +
+           std::to_string(value) + "}";
+  }
+};
+
+class VariableExprAST : public ExpressAST {
+  std::string Name;
+
+public:
+  VariableExprAST(const std::string &Name) : Name(Name) {}
+  std::string getText() override {
+    return "{\"type\":\"variable expression\", \"name\": \"" + Name + "\"}";
+  }
+};
+
+class BinaryExprAST : public ExpressAST {
+  char Op;
+  std::unique_ptr<ExpressAST> LHS, RHS;
+
+public:
+  BinaryExprAST(char op, std::unique_ptr<ExpressAST> LHS,
+                std::unique_ptr<ExpressAST> RHS)
+      : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  std::string getText() override {
+    return "{\"type\":\"binary expression\", \"LHS\": " + LHS->getText() +
+           ", \"op\": \"" + Op + "\", \"RHS\": " + RHS->getText() + "}";
+  }
+};
+
+class CallExprAST : public ExpressAST {
+  std::string Callee;
+  std::vector<std::unique_ptr<ExpressAST>> Args;
+
+public:
+  CallExprAST(const std::string &Callee,
+              std::vector<std::unique_ptr<ExpressAST>> Args)
+      : Callee(Callee), Args(std::move(Args)) {}
+  std::string getText() override {
+    return "{\"type\":\"call expression\", \"callee\": \"" + Callee +
+           "\", \"argsSize\":" + std::to_string(Args.size()) + "}";
+  }
+};
+
+class PrototypeAST {
+  std::string Name;
+  std::vector<std::string> Args;
+
+public:
+  PrototypeAST(const std::string &name, std::vector<std::string> Args)
+      : Name(name), Args(std::move(Args)) {}
+};
+
+class FunctionAST {
+  std::unique_ptr<PrototypeAST> Proto;
+  std::unique_ptr<ExpressAST> Body;
+
+public:
+  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
+              std::unique_ptr<ExpressAST> Body)
+      : Proto(std::move(Proto)), Body(std::move(Body)) {}
+};
+
+static std::unique_ptr<ExpressAST> convert(const ::ExpressAST *e) {
+  if (auto *number = llvm::dyn_cast<::NumberExpressionAST>(e)) {
+    return std::make_unique<NumberExpressionAST>(number->value);
+  }
+  if (auto *variable = llvm::dyn_cast<::VariableExprAST>(e)) {
+    return std::make_unique<VariableExprAST>(variable->getName().str());
+  }
+  if (auto *binary = llvm::dyn_cast<::BinaryExprAST>(e)) {
+    return std::make_unique<BinaryExprAST>(binary->getOp(),
+                                           convert(binary->getLHS()),
+                                           convert(binary->getRHS()));
+  }
+  auto *call = llvm::cast<::CallExprAST>(e);
+  std::vector<std::unique_ptr<ExpressAST>> args;
+  for (auto *arg : call->getArgs()) {
+    args.push_back(convert(arg));
+  }
+  return std::make_unique<CallExprAST>(call->getCallee().str(),
+                                       std::move(args));
+}
+
+static std::unique_ptr<FunctionAST> convert(const ::FunctionAST *f) {
+  std::vector<std::string> argNames;
+  for (auto name : f->getProto()->getArgs()) {
+    argNames.push_back(name.getName().str());
+  }
+  auto proto = std::make_unique<PrototypeAST>(f->getProto()->getName().str(),
+                                              std::move(argNames));
+  return std::make_unique<FunctionAST>(std::move(proto),
+                                       convert(f->getBody()));
+}
+} // namespace legacy
+
+static std::string generateCorpus(size_t functions) {
+  std::string corpus;
+  for (size_t i = 0; i < functions; i++) {
+    std::string n = std::to_string(i);
+    corpus += "def func" + n + "(alpha beta gamma delta)\n";
+    corpus += "  alpha * 3.25 + beta / (gamma - 17.5) * helper" + n +
+              "(alpha, beta + 1, delta * delta) - gamma * delta + alpha / " +
+              "beta - 42 * gamma < delta + 0.5 * alpha;\n";
+  }
+  return corpus;
+}
+
+static std::string generateChain(size_t depth) {
+  std::string chain = "x0";
+  for (size_t i = 1; i < depth; i++) {
+    chain += " + x" + std::to_string(i);
+  }
+  return chain + ";\n";
+}
+
+struct Usage {
+  size_t allocations;
+  size_t peakBytes;
+};
+
+template <typename F> static Usage measure(F &&run) {
+  size_t startAllocations = allocationCount;
+  size_t startBytes = liveBytes;
+  peakBytes = liveBytes;
+  run();
+  return {allocationCount - startAllocations, peakBytes - startBytes};
+}
+
+static std::vector<FunctionAST *> parseAll(CompilerSession &session) {
+  std::vector<FunctionAST *> functions;
+  session.getNextToken();
+  while (session.currentToken != Token::tok_eof) {
+    if (session.currentToken == ';') {
+      session.getNextToken();
+    } else if (session.currentToken == Token::tok_def) {
+      functions.push_back(parseFunction(session));
+    } else {
+      functions.push_back(parseToplevelAST(session));
+    }
+  }
+  return functions;
+}
+
+int main(int argc, char **argv) {
+  size_t functionCount = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000;
+  size_t chainDepth = argc > 2 ? std::strtoul(argv[2], nullptr, 10) : 4000;
+
+  std::string corpus = generateCorpus(functionCount);
+  CompilerSession session(corpus);
+  std::vector<FunctionAST *> functions;
+  Usage arena = measure([&]() { functions = parseAll(session); });
+  size_t nodes = session.ast->getNodeCount();
+
+  std::vector<std::unique_ptr<legacy::FunctionAST>> legacyFunctions;
+  Usage old = measure([&]() {
+    legacyFunctions.reserve(functions.size());
+    for (auto *function : functions) {
+      legacyFunctions.push_back(legacy::convert(function));
+    }
+  });
+
+  printf("corpus: %zu functions, %.1f MB, %zu arena nodes\n", functionCount,
+         double(corpus.size()) / (1 << 20), nodes);
+  printf("legacy AST: %10zu allocations, peak %8.1f MB\n", old.allocations,
+         double(old.peakBytes) / (1 << 20));
+  printf("arena AST:  %10zu allocations, peak %8.1f MB (parse included)\n",
+         arena.allocations, double(arena.peakBytes) / (1 << 20));
+
+  std::string chain = generateChain(chainDepth);
+  CompilerSession chainSession(chain);
+  auto *deep = parseAll(chainSession).front();
+  auto legacyDeep = legacy::convert(deep->getBody());
+
+  auto start = std::chrono::steady_clock::now();
+  std::string legacyText = legacyDeep->getText();
+  auto middle = std::chrono::steady_clock::now();
+  std::string streamedText;
+  llvm::raw_string_ostream os(streamedText);
+  deep->getBody()->print(os);
+  os.flush();
+  auto stop = std::chrono::steady_clock::now();
+
+  printf("dump of a %zu deep expression (%.1f MB of JSON):\n", chainDepth,
+         double(streamedText.size()) / (1 << 20));
+  printf("legacy getText:   %8.2f ms\n",
+         std::chrono::duration<double, std::milli>(middle - start).count());
+  printf("streaming print:  %8.2f ms\n",
+         std::chrono::duration<double, std::milli>(stop - middle).count());
+  return legacyText == streamedText ? 0 : 1;
+}
@@ -0,0 +1,106 @@
+// The embedding API end to end: how long an Engine takes to start, how long
+// compile() takes for a small program (median and worst of many), and the
+// cost per call of a function pointer from getFunction(), on one thread and
+// on several at once, against the same function compiled into this binary.
+#include "../src/Kaleidoscope.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+static const char *program = "def scale(x) x * 0.5 + 3;\n"
+                             "def mix(a b) scale(a) * b - a / (b + 1);\n"
+                             "def count(n:i64) if n < 1 then 0 else n;\n";
+
+static double nativeMix(double a, double b) {
+  return (a * 0.5 + 3) * b - a / (b + 1);
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+// Sum of f over `calls` arguments; the sum keeps the calls from being
+// optimized away.
+template <typename F> static double callMany(F *f, size_t calls) {
+  double sum = 0;
+  for (size_t i = 0; i < calls; i++) {
+    sum += f(double(i % 1000), double(i % 37));
+  }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  size_t calls = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 50000000;
+  unsigned threads =
+      argc > 2 ? std::atoi(argv[2])
+               : std::max(1U, std::thread::hardware_concurrency());
+  int compiles = argc > 3 ? std::atoi(argv[3]) : 100;
+
+  try {
+    auto start = std::chrono::steady_clock::now();
+    kaleidoscope::Engine engine;
+    printf("engine started in %.2f ms\n", secondsSince(start) * 1000);
+
+    std::vector<double> compileSeconds;
+    for (int i = 0; i < compiles; i++) {
+      auto start = std::chrono::steady_clock::now();
+      kaleidoscope::Program compiled = engine.compile(program);
+      compileSeconds.push_back(secondsSince(start));
+    }
+    std::sort(compileSeconds.begin(), compileSeconds.end());
+    printf("compile: %d programs, median %.3f ms, max %.3f ms\n", compiles,
+           compileSeconds[compileSeconds.size() / 2] * 1000,
+           compileSeconds.back() * 1000);
+
+    kaleidoscope::Program compiled = engine.compile(program);
+    auto *mix = compiled.getFunction<double(double, double)>("mix");
+    auto *count = compiled.getFunction<int64_t(int64_t)>("count");
+    // a signature that does not match is an error, not a bad call
+    try {
+      compiled.getFunction<double(double)>("mix");
+      fprintf(stderr, "a mismatched signature went unnoticed\n");
+      return 1;
+    } catch (const std::runtime_error &e) {
+      printf("checked: %s\n", e.what());
+    }
+
+    start = std::chrono::steady_clock::now();
+    double native = callMany(nativeMix, calls);
+    double nativeSeconds = secondsSince(start);
+    start = std::chrono::steady_clock::now();
+    double jitted = callMany(mix, calls);
+    double jittedSeconds = secondsSince(start);
+    printf("1 thread:  %.2f ns per call, %.2f ns native\n",
+           jittedSeconds / calls * 1e9, nativeSeconds / calls * 1e9);
+
+    std::vector<double> sums(threads);
+    std::vector<std::thread> workers;
+    start = std::chrono::steady_clock::now();
+    for (unsigned t = 0; t < threads; t++) {
+      workers.emplace_back([&, t]() { sums[t] = callMany(mix, calls); });
+    }
+    for (auto &worker : workers) {
+      worker.join();
+    }
+    double parallelSeconds = secondsSince(start);
+    printf("%u threads: %.1f Mcalls/s in total\n", threads,
+           double(calls) * threads / parallelSeconds / 1e6);
+
+    bool ok = jitted == native && count(5) == 5 && count(-5) == 0;
+    for (double sum : sums) {
+      ok = ok && sum == native;
+    }
+    printf("results %s\n", ok ? "match" : "differ");
+    return ok ? 0 : 1;
+  } catch (const std::exception &e) {
+    fprintf(stderr, "error: %s\n", e.what());
+    return 1;
+  }
+}
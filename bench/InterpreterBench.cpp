@@ -0,0 +1,130 @@
+// Latency of ad-hoc queries, each a small script run once in a session of
+// its own: compiled with the JIT before it runs, against run by the
+// Interpreter, which compiles a def only once it gets hot. Most queries are
+// cold; one in `hotEvery` recurses long enough to be promoted, and another
+// one in `hotEvery` calls defs through extern declarations that come before
+// them. Prints the median, 90th percentile and worst latency of either way
+// and checks that their results agree.
+#include "../src/AST.hpp"
+#include "../src/CompilerSession.hpp"
+#include "../src/Interpreter.hpp"
+#include "../src/KaleidoscopeJIT.hpp"
+#include "../src/Parser.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+static llvm::ExitOnError ExitOnErr;
+
+// distinct names, so that nothing can be reused from an earlier query
+static std::string makeQuery(int i, bool hot, bool forward) {
+  std::string n = std::to_string(i);
+  if (forward) {
+    return "extern odd" + n + "(x);\n" + "def even" + n +
+           "(x) if x < 1 then 1 else odd" + n + "(x - 1);\n" + "def odd" + n +
+           "(x) if x < 1 then 0 else even" + n + "(x - 1);\n" + "extern g" +
+           n + "(x);\n" + "def f" + n + "(x) g" + n + "(x) + 1;\n" + "def g" +
+           n + "(x) x * 2;\n" + "even" + n + "(9) + f" + n + "(3);\n";
+  }
+  if (hot) {
+    return "def fib" + n + "(x) if x < 2 then x else fib" + n +
+           "(x - 1) + fib" + n + "(x - 2);\nfib" + n + "(24);\n";
+  }
+  return "def scale" + n + "(x) x * 0.5 + " + n + ";\n" + "def sum" + n +
+         "(n) for i = 0, i < n in scale" + n + "(i);\n" + "scale" + n +
+         "(3) * 2 + sum" + n + "(10) + " + n + ";\n";
+}
+
+static double secondsSince(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                       start)
+      .count();
+}
+
+static double compileAndRun(llvm::orc::KaleidoscopeJIT &jit,
+                            const std::string &query, int i) {
+  CompilerSession session(query, "query");
+  session.TheModule->setDataLayout(jit.getDataLayout());
+  session.getNextToken();
+  while (session.currentToken != Token::tok_eof) {
+    if (session.currentToken == ';') {
+      session.getNextToken();
+    } else if (session.currentToken == Token::tok_def) {
+      parseFunction(session)->codegen(session);
+    } else if (session.currentToken == Token::tok_extern) {
+      auto ext = parseExtern(session);
+      session.FunctionProtos.set(ext->getSymbol(), ext);
+    } else {
+      parseToplevelAST(session)->codegen(session);
+    }
+  }
+  auto &dylib = ExitOnErr(jit.createJITDylib("jit:" + std::to_string(i)));
+  for (auto &module : session.takeModules()) {
+    ExitOnErr(
+        jit.addModule(std::move(module), dylib.getDefaultResourceTracker()));
+  }
+  auto expression = ExitOnErr(jit.lookup(dylib, "__anon_expr"));
+  return ((double (*)())expression.getAddress())();
+}
+
+static double interpret(llvm::orc::KaleidoscopeJIT &jit,
+                        const std::string &query, int i, uint64_t threshold,
+                        size_t &promotions) {
+  CompilerSession session(query, "query");
+  Interpreter interpreter(session, threshold, [&]() {
+    auto &dylib =
+        ExitOnErr(jit.createJITDylib("interpret:" + std::to_string(i)));
+    return Interpreter::JITTarget{&jit, &dylib};
+  });
+  double value = interpretStatements(session, interpreter);
+  promotions += interpreter.getPromotions().size();
+  return value;
+}
+
+static void report(const char *name, std::vector<double> seconds,
+                   double total) {
+  std::sort(seconds.begin(), seconds.end());
+  printf("%-12s median %8.3f ms, p90 %8.3f ms, max %8.3f ms, total %.1f ms\n",
+         name, seconds[seconds.size() / 2] * 1000,
+         seconds[seconds.size() * 9 / 10] * 1000, seconds.back() * 1000,
+         total * 1000);
+}
+
+int main(int argc, char **argv) {
+  int queries = argc > 1 ? std::atoi(argv[1]) : 200;
+  int hotEvery = argc > 2 ? std::atoi(argv[2]) : 20;
+  uint64_t threshold = argc > 3 ? std::strtoull(argv[3], nullptr, 10) : 1000;
+
+  auto jit = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
+  std::vector<double> jitSeconds, interpreterSeconds;
+  double jitTotal = 0, interpreterTotal = 0;
+  size_t promotions = 0, mismatches = 0;
+  for (int i = 0; i < queries; i++) {
+    std::string query =
+        makeQuery(i, hotEvery > 0 && i % hotEvery == 0,
+                  hotEvery > 1 && i % hotEvery == hotEvery / 2);
+
+    auto start = std::chrono::steady_clock::now();
+    double compiled = compileAndRun(*jit, query, i);
+    jitSeconds.push_back(secondsSince(start));
+    jitTotal += jitSeconds.back();
+
+    start = std::chrono::steady_clock::now();
+    double interpreted = interpret(*jit, query, i, threshold, promotions);
+    interpreterSeconds.push_back(secondsSince(start));
+    interpreterTotal += interpreterSeconds.back();
+
+    mismatches += compiled != interpreted;
+  }
+  printf("%d queries, 1 in %d hot and 1 in %d forward declared, promote "
+         "threshold %llu\n",
+         queries, hotEvery, hotEvery, (unsigned long long)threshold);
+  report("jit:", jitSeconds, jitTotal);
+  report("interpreter:", interpreterSeconds, interpreterTotal);
+  printf("promotions: %zu, mismatched results: %zu\n", promotions,
+         mismatches);
+  return mismatches == 0 ? 0 : 1;
+}
@@ -0,0 +1,330 @@
+// Per-stage benchmarks of the whole pipeline over generated corpora of
+// growing size: lexing, parsing (parseExpression/parseBinaryRHS), codegen
+// (FunctionAST::codegen including the -O pipeline), JIT materialization
+// (addModule plus the lookups that compile every function), single-symbol
+// lookup latency once compiled, and execution of JIT'd code. A recursive
+// workload, the fib of testscript/test.kl, is timed on its own, and so is
+// codegen of wide functions, whose parameters and call sites make it mostly
+// name lookups (run with -O0 to leave the optimizer out of it).
+//
+// Results are written as JSON to stdout, or to the file named by --out, so
+// runs can be diffed across commits. Every number is the best of --repeat runs.
+#include "../src/AST.hpp"
+#include "../src/CompilerSession.hpp"
+#include "../src/KaleidoscopeJIT.hpp"
+#include "../src/Lexer.hpp"
+#include "../src/Memoize.hpp"
+#include "../src/Parser.hpp"
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/FormatVariadic.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <limits>
+#include <string>
+#include <vector>
+
+static llvm::cl::list<unsigned>
+    Sizes("sizes", llvm::cl::desc("Corpus sizes in functions"),
+          llvm::cl::CommaSeparated);
+static llvm::cl::opt<unsigned>
+    Repeat("repeat", llvm::cl::desc("Runs per measurement, best one counts"),
+           llvm::cl::init(3));
+static llvm::cl::opt<unsigned>
+    OptLevel("O", llvm::cl::desc("Optimization level used by codegen"),
+             llvm::cl::Prefix, llvm::cl::init(2));
+static llvm::cl::opt<unsigned>
+    Fib("fib", llvm::cl::desc("Argument of the recursive fib workload"),
+        llvm::cl::init(40));
+static llvm::cl::opt<std::string>
+    Out("out", llvm::cl::desc("JSON results file, - for stdout"),
+        llvm::cl::init("-"));
+
+static llvm::ExitOnError ExitOnErr;
+
+// `count` independent defs. None calls another, so that the inliner has
+// nothing to do and materializing them grows linearly with their number.
+static std::string generateCorpus(size_t count) {
+  std::string corpus;
+  for (size_t i = 0; i < count; i++) {
+    std::string n = std::to_string(i);
+    corpus += "# generated function " + n + "\n";
+    corpus += "def fn" + n + "(a b)\n";
+    corpus += "  a * 0.25 + b / (a - 17.5) * (a + " + n +
+              ") - a * b < b + 0.5 * a;\n";
+  }
+  return corpus;
+}
+
+// `count` defs of `arity` parameters, each calling the previous one `calls`
+// times with its parameters rotated.
+static std::string generateWideCorpus(size_t count, unsigned arity,
+                                      unsigned calls) {
+  auto param = [](unsigned i) { return "a" + std::to_string(i); };
+  std::string params;
+  for (unsigned i = 0; i < arity; i++) {
+    params += " " + param(i);
+  }
+  std::string corpus = "def w0(" + params + ")";
+  for (unsigned i = 0; i < arity; i++) {
+    corpus += (i ? " + " : " ") + param(i);
+  }
+  corpus += ";\n";
+  for (size_t n = 1; n < count; n++) {
+    corpus += "def w" + std::to_string(n) + "(" + params + ")";
+    for (unsigned call = 0; call < calls; call++) {
+      corpus += (call ? " + w" : " w") + std::to_string(n - 1) + "(";
+      for (unsigned i = 0; i < arity; i++) {
+        corpus += (i ? ", " : "") + param((i + call) % arity);
+      }
+      corpus += ")";
+    }
+    corpus += ";\n";
+  }
+  return corpus;
+}
+
+template <typename F> static double bestOf(unsigned runs, F &&run) {
+  double best = std::numeric_limits<double>::max();
+  for (unsigned i = 0; i < std::max(1U, runs); i++) {
+    auto start = std::chrono::steady_clock::now();
+    run();
+    auto stop = std::chrono::steady_clock::now();
+    best = std::min(best, std::chrono::duration<double>(stop - start).count());
+  }
+  return best;
+}
+
+static std::vector<FunctionAST *> parseAll(CompilerSession &session) {
+  std::vector<FunctionAST *> functions;
+  session.getNextToken();
+  while (session.currentToken != Token::tok_eof) {
+    if (session.currentToken == ';') {
+      session.getNextToken();
+    } else {
+      functions.push_back(parseFunction(session));
+    }
+  }
+  return functions;
+}
+
+static CompilerSession *codegenAll(std::unique_ptr<CompilerSession> &session,
+                                   const std::string &corpus,
+                                   llvm::orc::KaleidoscopeJIT &jit,
+                                   bool memoize = false) {
+  CompileOptions options;
+  options.optLevel = OptLevel;
+  options.memoize = memoize;
+  session = std::make_unique<CompilerSession>(corpus, "bench", options);
+  session->TheModule->setDataLayout(jit.getDataLayout());
+  for (auto *function : parseAll(*session)) {
+    function->codegen(*session);
+  }
+  return session.get();
+}
+
+class Report {
+public:
+  // `extra` goes into the JSON result as it is
+  void add(llvm::StringRef stage, size_t functions, size_t items,
+           llvm::StringRef unit, double seconds,
+           llvm::json::Object extra = {}) {
+    double rate = double(items) / seconds;
+    llvm::json::Object result{{"stage", stage},
+                              {"functions", int64_t(functions)},
+                              {"seconds", seconds},
+                              {"rate", rate},
+                              {"unit", unit}};
+    for (auto &entry : extra) {
+      result[entry.first] = std::move(entry.second);
+    }
+    results.push_back(std::move(result));
+    fprintf(stderr, "%-10s %8zu functions %12.3f ms %14.1f %s\n",
+            stage.str().c_str(), functions, seconds * 1000, rate,
+            unit.str().c_str());
+  }
+
+  bool write(llvm::StringRef path) {
+    llvm::json::Object document{{"optLevel", int64_t(OptLevel)},
+                                {"repeat", int64_t(Repeat)},
+                                {"results", std::move(results)}};
+    std::error_code error;
+    llvm::raw_fd_ostream os(path, error);
+    if (error) {
+      fprintf(stderr, "cannot write %s: %s\n", path.str().c_str(),
+              error.message().c_str());
+      return false;
+    }
+    os << llvm::formatv("{0:2}", llvm::json::Value(std::move(document)))
+       << "\n";
+    return true;
+  }
+
+private:
+  llvm::json::Array results;
+};
+
+static void benchCorpus(Report &report, llvm::orc::KaleidoscopeJIT &jit,
+                        size_t count) {
+  std::string corpus = generateCorpus(count);
+
+  size_t tokens = 0;
+  double lexSeconds = bestOf(Repeat, [&]() {
+    Lexer lexer(corpus);
+    tokens = 0;
+    while (lexer.next() != Token::tok_eof) {
+      tokens++;
+    }
+  });
+  report.add("lex", count, tokens, "tokens/s", lexSeconds);
+
+  double parseSeconds = bestOf(Repeat, [&]() {
+    CompilerSession session(corpus);
+    parseAll(session);
+  });
+  report.add("parse", count, count, "functions/s", parseSeconds);
+
+  // parsing is timed above; take it out of the codegen number
+  std::unique_ptr<CompilerSession> session;
+  double codegenSeconds =
+      bestOf(Repeat, [&]() { codegenAll(session, corpus, jit); });
+  report.add("codegen", count, count, "functions/s",
+             std::max(codegenSeconds - parseSeconds, 1e-9));
+
+  std::vector<std::string> names;
+  for (size_t i = 0; i < count; i++) {
+    names.push_back("fn" + std::to_string(i));
+  }
+  std::string last = names.back();
+  llvm::orc::JITDylib *dylib = nullptr;
+  llvm::orc::SymbolMap symbols;
+  static unsigned dylibs = 0;
+  double materializeSeconds = std::numeric_limits<double>::max();
+  for (unsigned run = 0; run < std::max(1U, unsigned(Repeat)); run++) {
+    codegenAll(session, corpus, jit);
+    auto modules = session->takeModules();
+    dylib = &ExitOnErr(jit.createJITDylib("bench" + std::to_string(dylibs++)));
+    auto start = std::chrono::steady_clock::now();
+    for (auto &module : modules) {
+      ExitOnErr(jit.addModule(std::move(module),
+                              dylib->getDefaultResourceTracker()));
+    }
+    symbols = ExitOnErr(jit.lookup(*dylib, names));
+    auto stop = std::chrono::steady_clock::now();
+    materializeSeconds = std::min(
+        materializeSeconds, std::chrono::duration<double>(stop - start).count());
+  }
+  report.add("jit", count, count, "functions/s", materializeSeconds);
+
+  const unsigned lookups = 10000;
+  double lookupSeconds = bestOf(Repeat, [&]() {
+    for (unsigned i = 0; i < lookups; i++) {
+      ExitOnErr(jit.lookup(*dylib, llvm::StringRef(last)));
+    }
+  });
+  report.add("lookup", count, lookups, "lookups/s", lookupSeconds);
+
+  // every def in turn, `calls` times over
+  std::vector<double (*)(double, double)> entries;
+  for (auto &name : names) {
+    entries.push_back((double (*)(double, double))symbols[jit.mangle(name)]
+                          .getAddress());
+  }
+  const unsigned calls = std::max<size_t>(1, (1 << 22) / count);
+  volatile double sink = 0;
+  double executeSeconds = bestOf(Repeat, [&]() {
+    for (unsigned i = 0; i < calls; i++) {
+      for (auto *entry : entries) {
+        sink = sink + entry(1.5, double(i & 7));
+      }
+    }
+  });
+  report.add("execute", count, size_t(calls) * count, "calls/s",
+             executeSeconds);
+}
+
+static void benchWide(Report &report, llvm::orc::KaleidoscopeJIT &jit) {
+  const size_t count = 200;
+  std::string corpus = generateWideCorpus(count, 128, 8);
+  double parseSeconds = bestOf(Repeat, [&]() {
+    CompilerSession session(corpus);
+    parseAll(session);
+  });
+  std::unique_ptr<CompilerSession> session;
+  double codegenSeconds =
+      bestOf(Repeat, [&]() { codegenAll(session, corpus, jit); });
+  report.add("codegen-wide", count, count, "functions/s",
+             std::max(codegenSeconds - parseSeconds, 1e-9));
+}
+
+static const char *fibScript =
+    "def fib(x) if x < 3 then 1 else fib(x - 1) + fib(x - 2);\n";
+
+static void benchFib(Report &report, llvm::orc::KaleidoscopeJIT &jit,
+                     bool memoize) {
+  // Every run compiles fib into a fresh JITDylib, so the memo table starts
+  // empty and each timed call computes fib(n) from scratch; only the call
+  // is timed.
+  double seconds = std::numeric_limits<double>::infinity();
+  double result = 0;
+  uint64_t hits = 0, misses = 0;
+  for (unsigned run = 0; run < std::max(1U, unsigned(Repeat)); run++) {
+    std::unique_ptr<CompilerSession> session;
+    codegenAll(session, fibScript, jit, memoize);
+    auto &dylib = ExitOnErr(jit.createJITDylib(
+        (memoize ? "fib-memo." : "fib.") + std::to_string(run)));
+    for (auto &module : session->takeModules()) {
+      ExitOnErr(jit.addModule(std::move(module),
+                              dylib.getDefaultResourceTracker()));
+    }
+    auto fib = (double (*)(double))ExitOnErr(
+                   jit.lookup(dylib, llvm::StringRef("fib")))
+                   .getAddress();
+    auto start = std::chrono::steady_clock::now();
+    result = fib(Fib);
+    seconds = std::min(seconds, std::chrono::duration<double>(
+                                    std::chrono::steady_clock::now() - start)
+                                    .count());
+    if (memoize) {
+      // the same in every run, each starting from an empty table
+      auto counter = [&](const std::string &name) {
+        return *(uint64_t *)ExitOnErr(jit.lookup(dylib, llvm::StringRef(name)))
+                    .getAddress();
+      };
+      hits = counter(memoHitsName("fib"));
+      misses = counter(memoMissesName("fib"));
+    }
+    ExitOnErr(jit.getExecutionSession().removeJITDylib(dylib));
+  }
+  if (!memoize) {
+    // fib(n) with fib(1) = fib(2) = 1 makes 2 * fib(n) - 1 calls
+    report.add("fib", 1, size_t(2 * result - 1), "calls/s", seconds);
+    return;
+  }
+  // every call of the memoized fib is either a hit or a miss
+  report.add("fib-memo", 1, size_t(hits + misses), "calls/s", seconds,
+             llvm::json::Object{{"hits", int64_t(hits)},
+                                {"misses", int64_t(misses)}});
+  fprintf(stderr, "%-10s %8llu hits %8llu misses\n", "fib-memo",
+          (unsigned long long)hits, (unsigned long long)misses);
+}
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv,
+                                    "kaleidoscope pipeline benchmarks\n");
+  std::vector<unsigned> sizes = Sizes.empty()
+                                    ? std::vector<unsigned>{100, 1000, 5000}
+                                    : std::vector<unsigned>(Sizes.begin(),
+                                                            Sizes.end());
+  auto jit = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
+  Report report;
+  for (unsigned size : sizes) {
+    benchCorpus(report, *jit, std::max(1U, size));
+  }
+  benchWide(report, *jit);
+  benchFib(report, *jit, false);
+  benchFib(report, *jit, true);
+  return report.write(Out) ? 0 : 1;
+}
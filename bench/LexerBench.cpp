@@ -0,0 +1,172 @@
+// Lexer throughput: the zero-copy Lexer against the original
+// std::function<char()> driven getToken path. Token counts differ slightly:
+// getToken also returns the newline that ends every comment as a token.
+#include "../src/Lexer.hpp"
+#include "../src/Token.hpp"
+#include <cctype>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <sstream>
+#include <string>
+
+// The original lexer, with its state in globals, kept as the baseline.
+static std::string identifier;
+static double numbValue;
+static char lastChar = ' ';
+
+static int getToken(std::function<char()> getchar) {
+  while (isspace(lastChar)) {
+    lastChar = getchar();
+  }
+
+  if (isalpha(lastChar)) { // [a-zA-Z][a-zA-Z0-9]*
+    identifier = lastChar;
+    while (isalnum((lastChar = getchar()))) {
+      identifier += lastChar;
+    }
+
+    if (identifier == "def") {
+      return Token::tok_def;
+    }
+
+    if (identifier == "extern") {
+      return Token::tok_extern;
+    }
+    if (identifier == "if") {
+      return Token::tok_if;
+    }
+    if (identifier == "then") {
+      return Token::tok_then;
+    }
+    if (identifier == "else") {
+      return Token::tok_else;
+    }
+    if (identifier == "for") {
+      return Token::tok_for;
+    }
+    if (identifier == "in") {
+      return Token::tok_in;
+    }
+    if (identifier == "binary") {
+      return Token::tok_binary;
+    }
+    if (identifier == "unary") {
+      return Token::tok_unary;
+    }
+
+    return Token::tok_identifier;
+  }
+
+  // handle number
+  if (isdigit(lastChar) || lastChar == '.') { // number
+    std::stringstream numStr;
+    do {
+      numStr << (char)lastChar;
+      lastChar = getchar();
+    } while (isdigit(lastChar) || lastChar == '.');
+    numbValue = strtod(numStr.str().c_str(), 0);
+    return Token::tok_number;
+  }
+
+  // handle comments
+  if (lastChar == '#') {
+    // Comment until end of line.
+    do {
+      lastChar = getchar();
+    } while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
+  }
+
+  if (lastChar == EOF) {
+    return Token::tok_eof;
+  }
+
+  // cannot identifier any token, return its value
+  // step last char to next one, and return this char
+  int ThisChar = lastChar;
+  lastChar = getchar();
+  return ThisChar;
+}
+
+static std::string generateCorpus(size_t targetBytes) {
+  std::string corpus;
+  corpus.reserve(targetBytes + 256);
+  size_t index = 0;
+  while (corpus.size() < targetBytes) {
+    std::string n = std::to_string(index++);
+    corpus += "# generated function " + n + "\n";
+    corpus += "def func" + n + "(alpha beta gamma)\n";
+    corpus += "  alpha * 3.25 + beta / (gamma - 17.5) * func" + n +
+              "(alpha, beta, 0.125) < 1024;\n";
+    corpus += "func" + n + "(1.5, 2, 42);\n";
+  }
+  return corpus;
+}
+
+template <typename F> static double timeIt(F &&run, int iterations) {
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < iterations; i++) {
+    run();
+  }
+  auto stop = std::chrono::steady_clock::now();
+  return std::chrono::duration<double>(stop - start).count();
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 16;
+  int iterations = argc > 2 ? std::atoi(argv[2]) : 5;
+  std::string corpus = generateCorpus(megabytes << 20);
+  double totalMB = double(corpus.size()) * iterations / (1 << 20);
+
+  size_t legacyTokens = 0;
+  double legacySeconds = timeIt(
+      [&]() {
+        size_t pos = 0;
+        auto getchar = [&pos, &corpus]() {
+          if (pos < corpus.size()) {
+            return corpus[pos++];
+          }
+          return static_cast<char>(EOF);
+        };
+        lastChar = ' ';
+        while (getToken(getchar) != Token::tok_eof) {
+          legacyTokens++;
+        }
+      },
+      iterations);
+
+  size_t lexerTokens = 0;
+  double lexerSeconds = timeIt(
+      [&]() {
+        Lexer lexer(corpus);
+        while (lexer.next() != Token::tok_eof) {
+          lexerTokens++;
+        }
+      },
+      iterations);
+
+  // the lexer as the parser runs it, interning every identifier
+  size_t internedTokens = 0;
+  SymbolTable symbols;
+  double internedSeconds = timeIt(
+      [&]() {
+        Lexer lexer(corpus, &symbols);
+        while (lexer.next() != Token::tok_eof) {
+          internedTokens++;
+        }
+      },
+      iterations);
+
+  printf("corpus: %.1f MB x %d iterations\n",
+         double(corpus.size()) / (1 << 20), iterations);
+  printf("getToken(std::function): %8.1f MB/s (%zu tokens)\n",
+         totalMB / legacySeconds, legacyTokens / iterations);
+  printf("Lexer(string_view):      %8.1f MB/s (%zu tokens)\n",
+         totalMB / lexerSeconds, lexerTokens / iterations);
+  printf("Lexer + SymbolTable:     %8.1f MB/s (%zu tokens, %u symbols)\n",
+         totalMB / internedSeconds, internedTokens / iterations,
+         symbols.size());
+  printf("speedup: %.2fx\n", legacySeconds / lexerSeconds);
+  return 0;
+}
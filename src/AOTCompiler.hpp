@@ -0,0 +1,267 @@
+#ifndef __jesse_aot_compiler__
+#define __jesse_aot_compiler__
+
+#include "AST.hpp"
+#include "CompilerSession.hpp"
+#include "HostTarget.hpp"
+#include "Parser.hpp"
+#include <cctype>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Verifier.h>
+#include <llvm/Object/Archive.h>
+#include <llvm/Object/ArchiveWriter.h>
+#include <llvm/Support/CodeGen.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
+#include <llvm/Support/TargetSelect.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Ahead-of-time compilation of scripts for the host's architecture, for
+// code that should link the compiled defs directly instead of starting a
+// JIT. The CPU and features are those of CompileOptions::target, by default
+// the architecture's baseline CPU (see getGenericCPUName()), so that the
+// output runs on machines older than the one that built it.
+//
+// A script goes through the same parser, FunctionAST::codegen and
+// per-function optimization pipeline as under the JIT, into one module per
+// script. Its defs become external functions of an object file, a bitcode
+// file or a member of a static library, and a C header declares them.
+// Top-level expressions are parsed but not compiled, since there is nothing
+// to run them. Defs of other scripts are reachable through `extern`, which
+// the linker resolves.
+class AOTCompiler {
+public:
+  explicit AOTCompiler(const CompileOptions &options) : options(options) {
+    // nothing to gain from several modules when nothing compiles them
+    // concurrently, and one module per script keeps the output simple
+    this->options.modulePerFunction = false;
+    llvm::InitializeNativeTarget();
+    llvm::InitializeNativeTargetAsmPrinter();
+    if (!this->options.target) {
+      llvm::orc::HostTargetOptions host;
+      host.CPU = llvm::orc::getGenericCPUName();
+      host.OptLevel = llvm::orc::getCodeGenOptLevel(options.optLevel);
+      auto builder = llvm::orc::createHostTargetMachineBuilder(host);
+      if (!builder) {
+        throw std::runtime_error(llvm::toString(builder.takeError()));
+      }
+      this->options.target = std::move(*builder);
+    }
+    // position independent, so the objects can go into shared libraries too
+    this->options.target->setRelocationModel(llvm::Reloc::PIC_);
+    auto machine = this->options.target->createTargetMachine();
+    if (!machine) {
+      throw std::runtime_error(llvm::toString(machine.takeError()));
+    }
+    targetMachine = std::move(*machine);
+  }
+
+  // Parse and compile the script at `path` into a module for the host.
+  llvm::orc::ThreadSafeModule compile(const std::string &path) {
+    auto content = llvm::MemoryBuffer::getFile(path);
+    if (!content) {
+      throw std::runtime_error("cannot open file " + path);
+    }
+    llvm::StringRef text = (*content)->getBuffer();
+    CompilerSession session(std::string_view(text.data(), text.size()), path,
+                            options);
+    session.TheModule->setDataLayout(targetMachine->createDataLayout());
+    session.TheModule->setTargetTriple(
+        targetMachine->getTargetTriple().str());
+    session.getNextToken();
+    while (session.currentToken != Token::tok_eof) {
+      switch (session.currentToken) {
+      case ';':
+        session.getNextToken();
+        break;
+      case Token::tok_def: {
+        auto function = parseFunction(session);
+        if (!function || !function->codegen(session)) {
+          throw std::runtime_error("invalid function definition");
+        }
+        break;
+      }
+      case Token::tok_extern: {
+        auto ext = parseExtern(session);
+        session.FunctionProtos.set(ext->getSymbol(), ext);
+        break;
+      }
+      default:
+        if (!parseToplevelAST(session)) {
+          throw std::runtime_error("expected an expression");
+        }
+        break;
+      }
+      session.resetStatementAST();
+    }
+    llvm::orc::ThreadSafeModule module = session.takeModule();
+    module.withModuleDo([&path](llvm::Module &M) {
+      if (llvm::verifyModule(M, &llvm::errs())) {
+        throw std::runtime_error("invalid module for " + path);
+      }
+    });
+    return module;
+  }
+
+  // the relocatable object file of `module`
+  llvm::SmallVector<char, 0> emitObject(llvm::orc::ThreadSafeModule &module) {
+    llvm::SmallVector<char, 0> object;
+    TelemetryScope scope(options.telemetry, "emit object");
+    module.withModuleDo([&](llvm::Module &M) {
+      llvm::raw_svector_ostream os(object);
+      llvm::legacy::PassManager passes;
+      if (targetMachine->addPassesToEmitFile(passes, os, nullptr,
+                                             llvm::CGFT_ObjectFile)) {
+        throw std::runtime_error("the host target cannot emit object files");
+      }
+      passes.run(M);
+    });
+    if (options.telemetry) {
+      options.telemetry->addCount("code bytes", object.size());
+    }
+    return object;
+  }
+
+  llvm::SmallVector<char, 0> emitBitcode(llvm::orc::ThreadSafeModule &module) {
+    TelemetryScope scope(options.telemetry, "emit bitcode");
+    llvm::SmallVector<char, 0> bitcode;
+    module.withModuleDo([&](llvm::Module &M) {
+      llvm::raw_svector_ostream os(bitcode);
+      llvm::WriteBitcodeToFile(M, os);
+    });
+    return bitcode;
+  }
+
+  // Append C declarations of the defs of `module` to `os`. Operator defs,
+  // whose names are no C identifiers, are left out.
+  static void writeDeclarations(llvm::orc::ThreadSafeModule &module,
+                                llvm::raw_ostream &os) {
+    module.withModuleDo([&os](llvm::Module &M) {
+      for (auto &F : M) {
+        if (F.isDeclaration() || F.hasLocalLinkage() ||
+            !isCIdentifier(F.getName())) {
+          continue;
+        }
+        os << getCTypeName(F.getReturnType()) << " " << F.getName() << "(";
+        if (F.arg_empty()) {
+          os << "void";
+        }
+        for (auto &arg : F.args()) {
+          os << (arg.getArgNo() ? ", " : "")
+             << getCTypeName(arg.getType()) << " " << arg.getName();
+        }
+        os << ");\n";
+      }
+    });
+  }
+
+  // A header declaring the defs of `modules`, for `headerPath`.
+  static std::string
+  makeHeader(llvm::StringRef headerPath,
+             llvm::ArrayRef<std::string> scripts,
+             llvm::MutableArrayRef<llvm::orc::ThreadSafeModule> modules) {
+    std::string guard;
+    for (char c : llvm::sys::path::filename(headerPath)) {
+      guard += std::isalnum(static_cast<unsigned char>(c))
+                   ? char(std::toupper(static_cast<unsigned char>(c)))
+                   : '_';
+    }
+    std::string header;
+    llvm::raw_string_ostream os(header);
+    os << "// Generated by kaleidoscope-study from";
+    for (auto &script : scripts) {
+      os << " " << script;
+    }
+    os << "; do not edit.\n"
+       << "#ifndef " << guard << "\n#define " << guard << "\n\n"
+       << "#include <stdint.h>\n\n"
+       << "#ifdef __cplusplus\nextern \"C\" {\n#endif\n\n";
+    for (auto &module : modules) {
+      writeDeclarations(module, os);
+    }
+    os << "\n#ifdef __cplusplus\n}\n#endif\n\n#endif\n";
+    return os.str();
+  }
+
+  // A static library with one object member per module, named after the
+  // script it was compiled from.
+  void writeLibrary(const std::string &path,
+                    llvm::ArrayRef<std::string> scripts,
+                    llvm::MutableArrayRef<llvm::orc::ThreadSafeModule> modules) {
+    std::vector<llvm::SmallVector<char, 0>> objects;
+    std::vector<std::string> names;
+    for (size_t i = 0; i < modules.size(); i++) {
+      objects.push_back(emitObject(modules[i]));
+      llvm::SmallString<64> name(llvm::sys::path::filename(scripts[i]));
+      llvm::sys::path::replace_extension(name, "o");
+      names.push_back(name.str().str());
+    }
+    TelemetryScope scope(options.telemetry, "archive");
+    std::vector<llvm::NewArchiveMember> members;
+    for (size_t i = 0; i < objects.size(); i++) {
+      members.emplace_back(llvm::MemoryBufferRef(
+          llvm::StringRef(objects[i].data(), objects[i].size()), names[i]));
+    }
+    auto kind = targetMachine->getTargetTriple().isOSDarwin()
+                    ? llvm::object::Archive::K_DARWIN
+                    : llvm::object::Archive::K_GNU;
+    if (auto err = llvm::writeArchive(path, members, /*WriteSymtab=*/true,
+                                      kind, /*Deterministic=*/true,
+                                      /*Thin=*/false)) {
+      throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+  }
+
+  static void writeFile(const std::string &path, llvm::StringRef content) {
+    std::error_code error;
+    llvm::raw_fd_ostream os(path, error, llvm::sys::fs::OF_None);
+    if (error) {
+      throw std::runtime_error("cannot write " + path + ": " +
+                               error.message());
+    }
+    os << content;
+  }
+
+private:
+  static bool isCIdentifier(llvm::StringRef name) {
+    if (name.empty() || std::isdigit(static_cast<unsigned char>(name[0]))) {
+      return false;
+    }
+    for (char c : name) {
+      if (!std::isalnum(static_cast<unsigned char>(c)) && c != '_') {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // the C spelling of an f64, f32 or i64
+  static const char *getCTypeName(llvm::Type *type) {
+    if (type->isFloatTy()) {
+      return "float";
+    }
+    if (type->isIntegerTy()) {
+      return "int64_t";
+    }
+    return "double";
+  }
+
+  CompileOptions options;
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+};
+
+#endif
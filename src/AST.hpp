@@ -1,15 +1,19 @@
 #ifndef __jesse_ast__
 #define __jesse_ast__
 
-#include <iostream>
+#include "CompilerSession.hpp"
+#include "Memoize.hpp"
+#include "ValueType.hpp"
 #include <llvm/ADT/APFloat.h>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
 #include <llvm/IR/BasicBlock.h>
 #include <llvm/IR/DerivedTypes.h>
 #include <llvm/IR/Function.h>
 #include <llvm/IR/Type.h>
 #include <llvm/IR/Verifier.h>
-#include <map>
-#include <memory>
+#include <cstdint>
 #include <stdexcept>
 #include <string>
 #include <vector>
@@ -17,92 +21,202 @@
 #include <llvm/IR/Constants.h>
 #include <llvm/IR/IRBuilder.h>
 #include <llvm/IR/LLVMContext.h>
-#include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
 #include <llvm/IR/Value.h>
+#include <llvm/Support/Casting.h>
+#include <llvm/Support/Format.h>
 #include <llvm/Support/raw_ostream.h>
-#include <llvm/Transforms/InstCombine/InstCombine.h>
-#include <llvm/Transforms/Scalar.h>
-
-static std::unique_ptr<llvm::LLVMContext> TheContext;
-static std::unique_ptr<llvm::Module> TheModule;
-static std::unique_ptr<llvm::IRBuilder<>> Builder;
-static std::map<std::string, llvm::Value *> NamedValues;
+#include <llvm/Transforms/Utils/Cloning.h>
 
+// Expression nodes live in the session's ASTContext arena. Instead of a vtable
+// every node carries a one byte kind and ExpressAST dispatches on it
+// (llvm::isa/cast work through classof), which keeps nodes small and
+// trivially destructible.
+//
+// Every node also carries its ValueType, set by inferFunctionTypes() before
+// the function is generated; codegen picks native integer or float
+// operations from it.
 class ExpressAST {
 public:
-  virtual ~ExpressAST() {}
-  virtual std::string getText() = 0;
-  virtual llvm::Value *codegen() = 0;
+  enum ExprKind : uint8_t {
+    EK_Number,
+    EK_Variable,
+    EK_Binary,
+    EK_Call,
+    EK_If,
+    EK_For,
+    EK_Unary,
+    EK_Cast
+  };
+
+  ExprKind getKind() const { return Kind; }
+  ValueType getType() const { return Type; }
+  void setType(ValueType type) { Type = type; }
+
+  llvm::Value *codegen(CompilerSession &session);
+  // streams the JSON form of this expression
+  void print(llvm::raw_ostream &os) const;
+  std::string getText() const {
+    std::string text;
+    llvm::raw_string_ostream os(text);
+    print(os);
+    return os.str();
+  }
+
+protected:
+  explicit ExpressAST(ExprKind kind, ValueType type = VT_Unknown)
+      : Kind(kind), Type(type) {}
+
+private:
+  const ExprKind Kind;
+  ValueType Type;
 };
 
+// `value` as a constant of `type`
+inline llvm::Constant *getConstant(CompilerSession &session, ValueType type,
+                                   double value) {
+  llvm::Type *llvmType = getLLVMType(*session.TheContext, type);
+  if (type == VT_I64) {
+    return llvm::ConstantInt::get(llvmType, uint64_t(int64_t(value)),
+                                  /*isSigned=*/true);
+  }
+  return llvm::ConstantFP::get(llvmType, value);
+}
+
+// Convert `value` from `from` to `to`; integers convert to floats and back
+// as signed, floats truncate towards zero.
+inline llvm::Value *codegenConversion(CompilerSession &session,
+                                      llvm::Value *value, ValueType from,
+                                      ValueType to) {
+  if (from == to) {
+    return value;
+  }
+  llvm::IRBuilder<> &builder = *session.Builder;
+  llvm::Type *type = getLLVMType(*session.TheContext, to);
+  if (to == VT_I64) {
+    return builder.CreateFPToSI(value, type, "convtmp");
+  }
+  if (from == VT_I64) {
+    return builder.CreateSIToFP(value, type, "convtmp");
+  }
+  return to == VT_F64 ? builder.CreateFPExt(value, type, "convtmp")
+                      : builder.CreateFPTrunc(value, type, "convtmp");
+}
+
 class NumberExpressionAST : public ExpressAST {
 public:
-  NumberExpressionAST(double Val) : value(Val) {}
-  virtual ~NumberExpressionAST() {}
+  // `type` is VT_Unknown for a literal without a `:type` suffix, which
+  // takes the type of its context
+  NumberExpressionAST(double Val, ValueType type = VT_Unknown)
+      : ExpressAST(EK_Number, type), value(Val) {}
   double value;
-  std::string getText() override {
-    return "{\"type\":\"Number expression\", \"value\": " +
-           std::to_string(value) + "}";
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_Number; }
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"Number expression\", \"value\": "
+       << llvm::format("%f", value) << "}";
   }
-  virtual llvm::Value *codegen() override {
-    return llvm::ConstantFP::get(*TheContext, llvm::APFloat(value));
+  llvm::Value *codegen(CompilerSession &session) {
+    return getConstant(session, getType(), value);
   }
 };
 
 class VariableExprAST : public ExpressAST {
-  std::string Name;
+  Symbol Name;
 
 public:
-  VariableExprAST(const std::string &Name) : Name(Name) {}
-  std::string getText() override {
-    return "{\"type\":\"variable expression\", \"name\": \"" + Name + "\"}";
+  VariableExprAST(Symbol Name) : ExpressAST(EK_Variable), Name(Name) {}
+  llvm::StringRef getName() const { return Name.getName(); }
+  Symbol getSymbol() const { return Name; }
+  static bool classof(const ExpressAST *e) {
+    return e->getKind() == EK_Variable;
+  }
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"variable expression\", \"name\": \"" << getName()
+       << "\"}";
   }
-  virtual llvm::Value *codegen() override {
-    llvm::Value *v = NamedValues[Name];
+  llvm::Value *codegen(CompilerSession &session) {
+    llvm::Value *v = session.NamedValues.lookup(Name);
     if (!v) {
-      throw std::runtime_error("no value for name=" + Name);
+      throw std::runtime_error("no value for name=" + getName().str());
     }
     return v;
   }
 };
 
+inline llvm::Function *getFunction(CompilerSession &session, Symbol name);
+
+// Call to the def implementing a user-defined operator. The call is recorded
+// so that FunctionAST::codegen can inline it.
+inline llvm::Value *codegenOperatorCall(CompilerSession &session,
+                                        Symbol function,
+                                        llvm::ArrayRef<llvm::Value *> args) {
+  llvm::Function *func = getFunction(session, function);
+  if (!func) {
+    throw std::runtime_error("unknown operator " + function.getName().str());
+  }
+  llvm::CallInst *call = session.Builder->CreateCall(func, args, "optmp");
+  session.OperatorCalls.push_back(call);
+  return call;
+}
+
 class BinaryExprAST : public ExpressAST {
   char Op;
-  std::unique_ptr<ExpressAST> LHS, RHS;
+  // the def of a user-defined operator, null for a built-in one
+  Symbol Function;
+  ExpressAST *LHS, *RHS;
 
 public:
-  BinaryExprAST(char op, std::unique_ptr<ExpressAST> LHS,
-                std::unique_ptr<ExpressAST> RHS)
-      : Op(op), LHS(std::move(LHS)), RHS(std::move(RHS)) {}
+  BinaryExprAST(char op, ExpressAST *LHS, ExpressAST *RHS,
+                Symbol function = Symbol())
+      : ExpressAST(EK_Binary), Op(op), Function(function), LHS(LHS),
+        RHS(RHS) {}
+  char getOp() const { return Op; }
+  Symbol getOperatorFunction() const { return Function; }
+  ExpressAST *getLHS() const { return LHS; }
+  ExpressAST *getRHS() const { return RHS; }
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_Binary; }
 
-  std::string getText() override {
-    return "{\"type\":\"binary expression\", \"LHS\": " + LHS->getText() +
-           ", \"op\": \"" + Op + "\", \"RHS\": " + RHS->getText() + "}";
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"binary expression\", \"LHS\": ";
+    LHS->print(os);
+    os << ", \"op\": \"" << Op << "\", \"RHS\": ";
+    RHS->print(os);
+    os << "}";
   }
 
-  virtual llvm::Value *codegen() override {
-    llvm::Value *L = LHS->codegen();
-    llvm::Value *R = RHS->codegen();
+  llvm::Value *codegen(CompilerSession &session) {
+    llvm::Value *L = LHS->codegen(session);
+    llvm::Value *R = RHS->codegen(session);
     if (!L || !R) {
       throw std::runtime_error("illegal L or R");
     }
+    if (Function) {
+      return codegenOperatorCall(session, Function, {L, R});
+    }
+    llvm::IRBuilder<> &builder = *session.Builder;
+    // both operands have the type of the expression
+    bool integer = getType() == VT_I64;
     switch (Op) {
     case '+': {
-      return Builder->CreateFAdd(L, R);
+      return integer ? builder.CreateAdd(L, R) : builder.CreateFAdd(L, R);
     }
     case '-': {
-      return Builder->CreateFSub(L, R);
+      return integer ? builder.CreateSub(L, R) : builder.CreateFSub(L, R);
     }
     case '*': {
-      return Builder->CreateFMul(L, R);
+      return integer ? builder.CreateMul(L, R) : builder.CreateFMul(L, R);
     }
     case '/': {
-      return Builder->CreateFDiv(L, R);
+      return integer ? builder.CreateSDiv(L, R) : builder.CreateFDiv(L, R);
     }
     case '<': {
-      L = Builder->CreateFCmpULT(L, R);
-      return Builder->CreateUIToFP(L, llvm::Type::getFloatTy(*TheContext),
+      // 1 or 0 in the type of the operands
+      llvm::Type *type = L->getType();
+      if (integer) {
+        return builder.CreateZExt(builder.CreateICmpSLT(L, R), type,
+                                  "boolTemp");
+      }
+      return builder.CreateUIToFP(builder.CreateFCmpULT(L, R), type,
                                   "boolTemp");
     }
     default: {
@@ -113,19 +227,22 @@ public:
 };
 
 class CallExprAST : public ExpressAST {
-  std::string Callee;
-  std::vector<std::unique_ptr<ExpressAST>> Args;
+  Symbol Callee;
+  llvm::ArrayRef<ExpressAST *> Args;
 
 public:
-  CallExprAST(const std::string &Callee,
-              std::vector<std::unique_ptr<ExpressAST>> Args)
-      : Callee(Callee), Args(std::move(Args)) {}
-  std::string getText() override {
-    return "{\"type\":\"call expression\", \"callee\": " + Callee +
-           ", \"argsSize\":" + std::to_string(Args.size()) + "}";
-  }
-  virtual llvm::Value *codegen() override {
-    llvm::Function *calleeFunction = TheModule->getFunction(Callee);
+  CallExprAST(Symbol Callee, llvm::ArrayRef<ExpressAST *> Args)
+      : ExpressAST(EK_Call), Callee(Callee), Args(Args) {}
+  llvm::StringRef getCallee() const { return Callee.getName(); }
+  Symbol getCalleeSymbol() const { return Callee; }
+  llvm::ArrayRef<ExpressAST *> getArgs() const { return Args; }
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_Call; }
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"call expression\", \"callee\": \"" << getCallee()
+       << "\", \"argsSize\":" << Args.size() << "}";
+  }
+  llvm::Value *codegen(CompilerSession &session) {
+    llvm::Function *calleeFunction = getFunction(session, Callee);
     if (!calleeFunction) {
       throw std::runtime_error("cannot find callee");
     }
@@ -133,69 +250,645 @@ public:
       throw std::runtime_error("signature error");
     }
     std::vector<llvm::Value *> argsV;
-    for (auto &arg : Args) {
-      argsV.push_back(arg->codegen());
+    for (auto *arg : Args) {
+      argsV.push_back(arg->codegen(session));
     }
-    return Builder->CreateCall(calleeFunction, argsV, "callTemp");
+    return session.Builder->CreateCall(calleeFunction, argsV, "callTemp");
   }
 };
 
+// Any non-zero value is true.
+inline llvm::Value *codegenCondition(CompilerSession &session,
+                                     ExpressAST *condition,
+                                     const llvm::Twine &name) {
+  llvm::Value *value = condition->codegen(session);
+  llvm::Value *zero = llvm::Constant::getNullValue(value->getType());
+  if (condition->getType() == VT_I64) {
+    return session.Builder->CreateICmpNE(value, zero, name);
+  }
+  return session.Builder->CreateFCmpONE(value, zero, name);
+}
+
+// A user-defined prefix operator, applied by calling its def.
+class UnaryExprAST : public ExpressAST {
+  char Op;
+  Symbol Function;
+  ExpressAST *Operand;
+
+public:
+  UnaryExprAST(char op, Symbol function, ExpressAST *operand)
+      : ExpressAST(EK_Unary), Op(op), Function(function), Operand(operand) {}
+  char getOp() const { return Op; }
+  Symbol getOperatorFunction() const { return Function; }
+  ExpressAST *getOperand() const { return Operand; }
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_Unary; }
+
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"unary expression\", \"op\": \"" << Op
+       << "\", \"operand\": ";
+    Operand->print(os);
+    os << "}";
+  }
+
+  llvm::Value *codegen(CompilerSession &session) {
+    llvm::Value *operand = Operand->codegen(session);
+    return codegenOperatorCall(session, Function, {operand});
+  }
+};
+
+// if cond then a else b: both arms get a block of their own and meet again
+// in a phi.
+class IfExprAST : public ExpressAST {
+  ExpressAST *Cond, *Then, *Else;
+
+public:
+  IfExprAST(ExpressAST *Cond, ExpressAST *Then, ExpressAST *Else)
+      : ExpressAST(EK_If), Cond(Cond), Then(Then), Else(Else) {}
+  ExpressAST *getCond() const { return Cond; }
+  ExpressAST *getThen() const { return Then; }
+  ExpressAST *getElse() const { return Else; }
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_If; }
+
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"if expression\", \"cond\": ";
+    Cond->print(os);
+    os << ", \"then\": ";
+    Then->print(os);
+    os << ", \"else\": ";
+    Else->print(os);
+    os << "}";
+  }
+
+  llvm::Value *codegen(CompilerSession &session) {
+    llvm::IRBuilder<> &builder = *session.Builder;
+    llvm::Value *condition = codegenCondition(session, Cond, "ifcond");
+    llvm::Function *func = builder.GetInsertBlock()->getParent();
+    auto *thenBlock =
+        llvm::BasicBlock::Create(*session.TheContext, "then", func);
+    auto *elseBlock = llvm::BasicBlock::Create(*session.TheContext, "else");
+    auto *mergeBlock = llvm::BasicBlock::Create(*session.TheContext, "ifcont");
+    builder.CreateCondBr(condition, thenBlock, elseBlock);
+
+    builder.SetInsertPoint(thenBlock);
+    llvm::Value *thenValue = Then->codegen(session);
+    builder.CreateBr(mergeBlock);
+    // nested control flow may have moved the end of this arm
+    thenBlock = builder.GetInsertBlock();
+
+    func->getBasicBlockList().push_back(elseBlock);
+    builder.SetInsertPoint(elseBlock);
+    llvm::Value *elseValue = Else->codegen(session);
+    builder.CreateBr(mergeBlock);
+    elseBlock = builder.GetInsertBlock();
+
+    func->getBasicBlockList().push_back(mergeBlock);
+    builder.SetInsertPoint(mergeBlock);
+    if (thenValue->getType() != elseValue->getType()) {
+      throw std::runtime_error("if arms have different types");
+    }
+    llvm::PHINode *phi = builder.CreatePHI(thenValue->getType(), 2, "iftmp");
+    phi->addIncoming(thenValue, thenBlock);
+    phi->addIncoming(elseValue, elseBlock);
+    return phi;
+  }
+};
+
+// for var = start, end, step in body
+//
+// The loop variable is a phi in the loop header, visible (and shadowing any
+// outer name) only in the body. The body runs once before `end` is first
+// tested; the step defaults to 1. The loop itself evaluates to 0.
+class ForExprAST : public ExpressAST {
+  Symbol VarName;
+  ExpressAST *Start, *End, *Step, *Body;
+
+public:
+  ForExprAST(Symbol VarName, ExpressAST *Start, ExpressAST *End,
+             ExpressAST *Step, ExpressAST *Body)
+      : ExpressAST(EK_For), VarName(VarName), Start(Start), End(End),
+        Step(Step), Body(Body) {}
+  llvm::StringRef getVarName() const { return VarName.getName(); }
+  Symbol getVarSymbol() const { return VarName; }
+  ExpressAST *getStart() const { return Start; }
+  ExpressAST *getEnd() const { return End; }
+  // null when the step was left out
+  ExpressAST *getStep() const { return Step; }
+  ExpressAST *getBody() const { return Body; }
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_For; }
+
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"for expression\", \"var\": \"" << getVarName()
+       << "\", \"start\": ";
+    Start->print(os);
+    os << ", \"end\": ";
+    End->print(os);
+    if (Step) {
+      os << ", \"step\": ";
+      Step->print(os);
+    }
+    os << ", \"body\": ";
+    Body->print(os);
+    os << "}";
+  }
+
+  llvm::Value *codegen(CompilerSession &session) {
+    llvm::IRBuilder<> &builder = *session.Builder;
+    llvm::Value *startValue = Start->codegen(session);
+    llvm::BasicBlock *preheader = builder.GetInsertBlock();
+    llvm::Function *func = preheader->getParent();
+    auto *loopBlock =
+        llvm::BasicBlock::Create(*session.TheContext, "loop", func);
+    builder.CreateBr(loopBlock);
+
+    builder.SetInsertPoint(loopBlock);
+    llvm::PHINode *variable =
+        builder.CreatePHI(startValue->getType(), 2, getVarName());
+    variable->addIncoming(startValue, preheader);
+
+    llvm::Value *oldValue = session.NamedValues.lookup(VarName);
+    session.NamedValues.set(VarName, variable);
+
+    Body->codegen(session);
+    ValueType type = Start->getType();
+    llvm::Value *stepValue =
+        Step ? Step->codegen(session) : getConstant(session, type, 1.0);
+    llvm::Value *nextValue =
+        type == VT_I64 ? builder.CreateAdd(variable, stepValue, "nextvar")
+                       : builder.CreateFAdd(variable, stepValue, "nextvar");
+    llvm::Value *condition = codegenCondition(session, End, "loopcond");
+
+    llvm::BasicBlock *loopEnd = builder.GetInsertBlock();
+    auto *afterBlock =
+        llvm::BasicBlock::Create(*session.TheContext, "afterloop", func);
+    builder.CreateCondBr(condition, loopBlock, afterBlock);
+    builder.SetInsertPoint(afterBlock);
+    variable->addIncoming(nextValue, loopEnd);
+
+    if (oldValue) {
+      session.NamedValues.set(VarName, oldValue);
+    } else {
+      session.NamedValues.erase(VarName);
+    }
+    return llvm::Constant::getNullValue(
+        llvm::Type::getDoubleTy(*session.TheContext));
+  }
+};
+
+// f64(x), f32(x) or i64(x): the one way to change the type of a value.
+class CastExprAST : public ExpressAST {
+  ExpressAST *Operand;
+
+public:
+  CastExprAST(ValueType type, ExpressAST *operand)
+      : ExpressAST(EK_Cast, type), Operand(operand) {}
+  ExpressAST *getOperand() const { return Operand; }
+  static bool classof(const ExpressAST *e) { return e->getKind() == EK_Cast; }
+
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"cast expression\", \"to\": \""
+       << getValueTypeName(getType()) << "\", \"operand\": ";
+    Operand->print(os);
+    os << "}";
+  }
+
+  llvm::Value *codegen(CompilerSession &session) {
+    return codegenConversion(session, Operand->codegen(session),
+                             Operand->getType(), getType());
+  }
+};
+
+inline llvm::Value *ExpressAST::codegen(CompilerSession &session) {
+  switch (Kind) {
+  case EK_Number:
+    return llvm::cast<NumberExpressionAST>(this)->codegen(session);
+  case EK_Variable:
+    return llvm::cast<VariableExprAST>(this)->codegen(session);
+  case EK_Binary:
+    return llvm::cast<BinaryExprAST>(this)->codegen(session);
+  case EK_Call:
+    return llvm::cast<CallExprAST>(this)->codegen(session);
+  case EK_If:
+    return llvm::cast<IfExprAST>(this)->codegen(session);
+  case EK_For:
+    return llvm::cast<ForExprAST>(this)->codegen(session);
+  case EK_Unary:
+    return llvm::cast<UnaryExprAST>(this)->codegen(session);
+  case EK_Cast:
+    return llvm::cast<CastExprAST>(this)->codegen(session);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
+inline void ExpressAST::print(llvm::raw_ostream &os) const {
+  switch (Kind) {
+  case EK_Number:
+    return llvm::cast<NumberExpressionAST>(this)->print(os);
+  case EK_Variable:
+    return llvm::cast<VariableExprAST>(this)->print(os);
+  case EK_Binary:
+    return llvm::cast<BinaryExprAST>(this)->print(os);
+  case EK_Call:
+    return llvm::cast<CallExprAST>(this)->print(os);
+  case EK_If:
+    return llvm::cast<IfExprAST>(this)->print(os);
+  case EK_For:
+    return llvm::cast<ForExprAST>(this)->print(os);
+  case EK_Unary:
+    return llvm::cast<UnaryExprAST>(this)->print(os);
+  case EK_Cast:
+    return llvm::cast<CastExprAST>(this)->print(os);
+  }
+  llvm_unreachable("unknown expression kind");
+}
+
 // function AST part
 class PrototypeAST {
-  std::string Name;
-  std::vector<std::string> Args;
-
 public:
-  PrototypeAST(const std::string &name, std::vector<std::string> Args)
-      : Name(name), Args(std::move(Args)) {}
-  std::string &getName() { return Name; }
-  std::string getText() {
-    return "{\"type\":\"Prototype\", \"Name\": \"" + Name +
-           "\", \"argsSize\":" + std::to_string(Args.size()) + "}";
-  }
-
-  virtual llvm::Function *codegen() {
-    std::vector<llvm::Type *> doubles(Args.size(),
-                                      llvm::Type::getDoubleTy(*TheContext));
-    llvm::FunctionType *functionType = nullptr;
-
-    functionType = llvm::FunctionType::get(llvm::Type::getDoubleTy(*TheContext),
-                                           doubles, false);
-    llvm::Function *func = llvm::Function::Create(
-        functionType, llvm::Function::ExternalLinkage, Name, *TheModule);
+  // operators are defs named `unary<c>` or `binary<c>`
+  enum PrototypeKind : uint8_t { PK_Function, PK_Unary, PK_Binary };
+
+  // `argTypes` is parallel to `Args`. A def without a return annotation has
+  // VT_Unknown until FunctionAST::codegen infers it from the body.
+  PrototypeAST(Symbol name, llvm::ArrayRef<Symbol> Args,
+               llvm::ArrayRef<ValueType> argTypes, ValueType returnType,
+               PrototypeKind kind = PK_Function)
+      : Name(name), Args(Args), ArgTypes(argTypes), ReturnType(returnType),
+        Kind(kind) {}
+  llvm::StringRef getName() const { return Name.getName(); }
+  Symbol getSymbol() const { return Name; }
+  llvm::ArrayRef<Symbol> getArgs() const { return Args; }
+  llvm::ArrayRef<ValueType> getArgTypes() const { return ArgTypes; }
+  ValueType getReturnType() const { return ReturnType; }
+  void setReturnType(ValueType type) { ReturnType = type; }
+  PrototypeKind getKind() const { return Kind; }
+  bool isOperator() const { return Kind != PK_Function; }
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"Prototype\", \"Name\": \"" << getName()
+       << "\", \"argsSize\":" << Args.size() << "}";
+  }
+  std::string getText() const {
+    std::string text;
+    llvm::raw_string_ostream os(text);
+    print(os);
+    return os.str();
+  }
+
+  llvm::Function *codegen(CompilerSession &session) {
+    llvm::LLVMContext &context = *session.TheContext;
+    llvm::SmallVector<llvm::Type *, 8> argTypes;
+    for (ValueType type : ArgTypes) {
+      argTypes.push_back(getLLVMType(context, type));
+    }
+    llvm::FunctionType *functionType = llvm::FunctionType::get(
+        getLLVMType(context, ReturnType), argTypes, false);
+    llvm::Function *func =
+        llvm::Function::Create(functionType, llvm::Function::ExternalLinkage,
+                               getName(), *session.TheModule);
     int index = 0;
     for (auto &arg : func->args()) {
-      arg.setName(Args[index++]);
+      arg.setName(Args[index++].getName());
     }
+    session.ModuleFunctions.set(Name, func);
     return func;
   }
+
+private:
+  Symbol Name;
+  llvm::ArrayRef<Symbol> Args;
+  llvm::ArrayRef<ValueType> ArgTypes;
+  ValueType ReturnType;
+  PrototypeKind Kind;
 };
 
+// Find `name` in the current module, declaring it from its prototype when it
+// was defined or declared extern elsewhere.
+inline llvm::Function *getFunction(CompilerSession &session, Symbol name) {
+  if (auto *func = session.ModuleFunctions.lookup(name)) {
+    return func;
+  }
+  if (auto *proto = session.FunctionProtos.lookup(name)) {
+    return proto->codegen(session);
+  }
+  return nullptr;
+}
+
+// Externs without side effects whose result depends on their arguments only.
+inline bool isPureExtern(llvm::StringRef name) {
+  static const char *const names[] = {
+      "sin",   "cos",  "tan",  "asin",  "acos", "atan", "atan2",
+      "sinh",  "cosh", "tanh", "exp",   "exp2", "log",  "log2",
+      "log10", "pow",  "sqrt", "cbrt",  "fabs", "floor", "ceil",
+      "round", "trunc", "fmod", "fmin", "fmax", "hypot"};
+  for (const char *pure : names) {
+    if (name == pure) {
+      return true;
+    }
+  }
+  return false;
+}
+
+struct PurityInfo {
+  // only calls pure defs, pure externs and itself
+  bool pure = true;
+  // calls itself somewhere tail recursion elimination cannot turn into a
+  // jump, i.e. where memoizing can pay off
+  bool nonTailRecursion = false;
+};
+
+// Purity of the def `self` from its body `e`; `tail` says whether `e` is in
+// tail position.
+inline void analyzeCalleePurity(const CompilerSession &session, Symbol self,
+                                Symbol callee, bool tail, PurityInfo &info) {
+  if (callee == self) {
+    info.nonTailRecursion |= !tail;
+  } else {
+    const bool *known = session.PureFunctions.find(callee);
+    info.pure &= known ? *known : isPureExtern(callee.getName());
+  }
+}
+
+inline void analyzePurity(const CompilerSession &session, Symbol self,
+                          const ExpressAST *e, bool tail, PurityInfo &info) {
+  switch (e->getKind()) {
+  case ExpressAST::EK_Number:
+  case ExpressAST::EK_Variable:
+    return;
+  case ExpressAST::EK_Binary: {
+    auto *binary = llvm::cast<BinaryExprAST>(e);
+    if (binary->getOperatorFunction()) {
+      analyzeCalleePurity(session, self, binary->getOperatorFunction(), tail,
+                          info);
+    }
+    analyzePurity(session, self, binary->getLHS(), false, info);
+    analyzePurity(session, self, binary->getRHS(), false, info);
+    return;
+  }
+  case ExpressAST::EK_Call: {
+    auto *call = llvm::cast<CallExprAST>(e);
+    analyzeCalleePurity(session, self, call->getCalleeSymbol(), tail, info);
+    for (auto *arg : call->getArgs()) {
+      analyzePurity(session, self, arg, false, info);
+    }
+    return;
+  }
+  case ExpressAST::EK_If: {
+    auto *ifExpression = llvm::cast<IfExprAST>(e);
+    analyzePurity(session, self, ifExpression->getCond(), false, info);
+    analyzePurity(session, self, ifExpression->getThen(), tail, info);
+    analyzePurity(session, self, ifExpression->getElse(), tail, info);
+    return;
+  }
+  case ExpressAST::EK_For: {
+    auto *forExpression = llvm::cast<ForExprAST>(e);
+    analyzePurity(session, self, forExpression->getStart(), false, info);
+    analyzePurity(session, self, forExpression->getEnd(), false, info);
+    if (forExpression->getStep()) {
+      analyzePurity(session, self, forExpression->getStep(), false, info);
+    }
+    analyzePurity(session, self, forExpression->getBody(), false, info);
+    return;
+  }
+  case ExpressAST::EK_Unary: {
+    auto *unary = llvm::cast<UnaryExprAST>(e);
+    analyzeCalleePurity(session, self, unary->getOperatorFunction(), tail,
+                        info);
+    analyzePurity(session, self, unary->getOperand(), false, info);
+    return;
+  }
+  case ExpressAST::EK_Cast:
+    analyzePurity(session, self, llvm::cast<CastExprAST>(e)->getOperand(),
+                  false, info);
+    return;
+  }
+}
+
+// Local type inference for one def, run before its IR is generated.
+//
+// infer() types an expression bottom-up. Parameters and loop variables have
+// known types; a literal without a suffix, and a call of the def itself while
+// its return type is still being inferred, are VT_Unknown and so is anything
+// built only from them. Wherever an unknown meets a known type (the other
+// operand, a parameter, the other arm of an if) resolve() pushes the known
+// type down into it, and whatever is left unknown at the top becomes f64.
+struct TypeInference {
+  CompilerSession &session;
+  PrototypeAST *self;
+  // calls of `self` made before its return type was known
+  llvm::SmallVector<ExpressAST *, 4> recursiveCalls;
+
+  ValueType infer(ExpressAST *e) {
+    switch (e->getKind()) {
+    case ExpressAST::EK_Number:
+      return e->getType();
+    case ExpressAST::EK_Variable: {
+      auto *variable = llvm::cast<VariableExprAST>(e);
+      ValueType type = session.VariableTypes.lookup(variable->getSymbol());
+      if (type == VT_Unknown) {
+        throw std::runtime_error("no value for name=" +
+                                 variable->getName().str());
+      }
+      e->setType(type);
+      return type;
+    }
+    case ExpressAST::EK_Binary: {
+      auto *binary = llvm::cast<BinaryExprAST>(e);
+      if (binary->getOperatorFunction()) {
+        return inferCall(e, binary->getOperatorFunction(),
+                         {binary->getLHS(), binary->getRHS()});
+      }
+      ValueType type = unifyTypes(infer(binary->getLHS()),
+                                  infer(binary->getRHS()),
+                                  std::string("'") + binary->getOp() + "'");
+      resolve(e, type);
+      return type;
+    }
+    case ExpressAST::EK_Call: {
+      auto *call = llvm::cast<CallExprAST>(e);
+      return inferCall(e, call->getCalleeSymbol(), call->getArgs());
+    }
+    case ExpressAST::EK_Unary: {
+      auto *unary = llvm::cast<UnaryExprAST>(e);
+      return inferCall(e, unary->getOperatorFunction(), {unary->getOperand()});
+    }
+    case ExpressAST::EK_If: {
+      auto *ifExpression = llvm::cast<IfExprAST>(e);
+      inferDefault(ifExpression->getCond());
+      ValueType type = unifyTypes(infer(ifExpression->getThen()),
+                                  infer(ifExpression->getElse()), "if arms");
+      resolve(e, type);
+      return type;
+    }
+    case ExpressAST::EK_For: {
+      auto *forExpression = llvm::cast<ForExprAST>(e);
+      ValueType type = infer(forExpression->getStart());
+      if (forExpression->getStep()) {
+        type = unifyTypes(type, infer(forExpression->getStep()), "for step");
+      }
+      if (type == VT_Unknown) {
+        type = VT_F64;
+      }
+      resolve(forExpression->getStart(), type);
+      if (forExpression->getStep()) {
+        resolve(forExpression->getStep(), type);
+      }
+      Symbol variable = forExpression->getVarSymbol();
+      ValueType outer = session.VariableTypes.lookup(variable);
+      session.VariableTypes.set(variable, type);
+      inferDefault(forExpression->getEnd());
+      inferDefault(forExpression->getBody());
+      if (outer != VT_Unknown) {
+        session.VariableTypes.set(variable, outer);
+      } else {
+        session.VariableTypes.erase(variable);
+      }
+      e->setType(VT_F64);
+      return VT_F64;
+    }
+    case ExpressAST::EK_Cast: {
+      auto *cast = llvm::cast<CastExprAST>(e);
+      // i64(7.9) converts the f64 7.9
+      inferDefault(cast->getOperand());
+      return cast->getType();
+    }
+    }
+    llvm_unreachable("unknown expression kind");
+  }
+
+  // give the unknown parts of `e` the type `type`
+  void resolve(ExpressAST *e, ValueType type) {
+    if (type == VT_Unknown || e->getType() != VT_Unknown) {
+      return;
+    }
+    e->setType(type);
+    if (auto *number = llvm::dyn_cast<NumberExpressionAST>(e)) {
+      if (type == VT_I64 && number->value != double(int64_t(number->value))) {
+        throw std::runtime_error(
+            "literal " + std::to_string(number->value) + " is not an i64");
+      }
+    } else if (auto *binary = llvm::dyn_cast<BinaryExprAST>(e)) {
+      if (!binary->getOperatorFunction()) {
+        resolve(binary->getLHS(), type);
+        resolve(binary->getRHS(), type);
+      }
+    } else if (auto *ifExpression = llvm::dyn_cast<IfExprAST>(e)) {
+      resolve(ifExpression->getThen(), type);
+      resolve(ifExpression->getElse(), type);
+    }
+  }
+
+private:
+  // a value whose type does not matter to anyone, e.g. a condition
+  void inferDefault(ExpressAST *e) {
+    if (infer(e) == VT_Unknown) {
+      resolve(e, VT_F64);
+    }
+  }
+
+  ValueType inferCall(ExpressAST *e, Symbol callee,
+                      llvm::ArrayRef<ExpressAST *> args) {
+    PrototypeAST *proto = session.FunctionProtos.lookup(callee);
+    if (!proto) {
+      throw std::runtime_error("cannot find callee " +
+                               callee.getName().str());
+    }
+    if (proto->getArgs().size() != args.size()) {
+      throw std::runtime_error("signature error");
+    }
+    for (size_t i = 0; i < args.size(); i++) {
+      ValueType type = proto->getArgTypes()[i];
+      unifyTypes(infer(args[i]), type,
+                 "argument " + std::to_string(i + 1) + " of " +
+                     callee.getName().str());
+      resolve(args[i], type);
+    }
+    ValueType type = proto->getReturnType();
+    if (type == VT_Unknown) {
+      if (proto != self) {
+        throw std::runtime_error("return type of " + callee.getName().str() +
+                                 " is not known");
+      }
+      recursiveCalls.push_back(e);
+    }
+    e->setType(type);
+    return type;
+  }
+};
+
+// Type every node of `body`, settle the return type of `proto` if it has no
+// annotation, and return the type of the body. An annotated return type may
+// differ from it; the body is then converted on return.
+inline ValueType inferFunctionTypes(CompilerSession &session,
+                                    PrototypeAST *proto, ExpressAST *body) {
+  session.VariableTypes.clear();
+  for (size_t i = 0; i < proto->getArgs().size(); i++) {
+    session.VariableTypes.set(proto->getArgs()[i], proto->getArgTypes()[i]);
+  }
+  TypeInference inference{session, proto, {}};
+  ValueType bodyType = inference.infer(body);
+  ValueType returnType = proto->getReturnType();
+  if (returnType == VT_Unknown) {
+    returnType = bodyType == VT_Unknown ? VT_F64 : bodyType;
+  }
+  if (bodyType == VT_Unknown) {
+    inference.resolve(body, returnType);
+    bodyType = returnType;
+  }
+  for (ExpressAST *call : inference.recursiveCalls) {
+    if (call->getType() == VT_Unknown) {
+      call->setType(returnType);
+    }
+    unifyTypes(call->getType(), returnType,
+               "return type of " + proto->getName().str());
+  }
+  proto->setReturnType(returnType);
+  return bodyType;
+}
+
+// The per-function pipeline has no inliner, so calls to user-defined
+// operators are inlined here when the operator's def is in the same module,
+// letting the optimizer see through them. Calls to operators defined in
+// other modules, or to the function itself, stay calls.
+inline void inlineOperatorCalls(CompilerSession &session,
+                                llvm::Function *func) {
+  for (llvm::CallInst *call : session.OperatorCalls) {
+    llvm::Function *callee = call->getCalledFunction();
+    if (callee && callee != func && !callee->isDeclaration()) {
+      llvm::InlineFunctionInfo info;
+      llvm::InlineFunction(*call, info);
+    }
+  }
+  session.OperatorCalls.clear();
+}
+
 /// FunctionAST - This class represents a function definition itself.
 class FunctionAST {
-  std::unique_ptr<PrototypeAST> Proto;
-  std::unique_ptr<ExpressAST> Body;
-  llvm::legacy::FunctionPassManager manager;
+  PrototypeAST *Proto;
+  ExpressAST *Body;
 
 public:
-  FunctionAST(std::unique_ptr<PrototypeAST> Proto,
-              std::unique_ptr<ExpressAST> Body)
-      : Proto(std::move(Proto)), Body(std::move(Body)), manager(TheModule.get()) {
-    manager.add(llvm::createInstructionCombiningPass());
-    manager.add(llvm::createReassociatePass());
-    manager.add(llvm::createGVNSinkPass());
-    manager.add(llvm::createCFGSimplificationPass());
-    manager.doInitialization();
-  }
-  std::string getText() {
-    return "{\"type\":\"Function\", \"proto\": " + Proto->getText() +
-           ", \"body\":" + Body->getText() + "}";
-  }
-  virtual llvm::Function *codegen() {
-    llvm::Function *func = TheModule->getFunction(Proto->getName());
-    if (!func) {
-      func = Proto->codegen();
-    }
+  FunctionAST(PrototypeAST *Proto, ExpressAST *Body)
+      : Proto(Proto), Body(Body) {}
+  PrototypeAST *getProto() const { return Proto; }
+  ExpressAST *getBody() const { return Body; }
+  void print(llvm::raw_ostream &os) const {
+    os << "{\"type\":\"Function\", \"proto\": ";
+    Proto->print(os);
+    os << ", \"body\":";
+    Body->print(os);
+    os << "}";
+  }
+  std::string getText() const {
+    std::string text;
+    llvm::raw_string_ostream os(text);
+    print(os);
+    return os.str();
+  }
+  llvm::Function *codegen(CompilerSession &session) {
+    CompileTelemetry *telemetry = session.options.telemetry;
+    TelemetryScope scope(telemetry, "codegen");
+    session.FunctionProtos.set(Proto->getSymbol(), Proto);
+    ValueType bodyType = inferFunctionTypes(session, Proto, Body);
+    llvm::Function *func = getFunction(session, Proto->getSymbol());
     if (!func) {
       return nullptr;
     }
@@ -204,22 +897,84 @@ public:
       throw std::runtime_error("redefine function");
     }
     llvm::BasicBlock *basicBlock =
-        llvm::BasicBlock::Create(*TheContext, "entry", func);
-    Builder->SetInsertPoint(basicBlock);
-    NamedValues.clear();
+        llvm::BasicBlock::Create(*session.TheContext, "entry", func);
+    session.Builder->SetInsertPoint(basicBlock);
+    session.NamedValues.clear();
+    session.OperatorCalls.clear();
     for (auto &arg : func->args()) {
-      NamedValues[std::string(arg.getName())] = &arg;
+      session.NamedValues.set(Proto->getArgs()[arg.getArgNo()], &arg);
+    }
+    if (Proto->isOperator()) {
+      func->addFnAttr(llvm::Attribute::InlineHint);
     }
-    if (llvm::Value *ret = Body->codegen()) {
-      Builder->CreateRet(ret);
-      bool result = llvm::verifyFunction(*func);
-      std::cout << "verify result: " << result << std::endl;
-      manager.run(*func);
+    if (llvm::Value *ret = Body->codegen(session)) {
+      session.Builder->CreateRet(codegenConversion(session, ret, bodyType,
+                                                   Proto->getReturnType()));
+      verify(session, func);
+      if (session.options.optLevel > 0) {
+        inlineOperatorCalls(session, func);
+      }
+      // the profile describes the code as it is here, before memoizing
+      if (session.options.profile) {
+        session.options.profile->annotate(*func);
+      }
+      if (session.options.profileCounters) {
+        session.options.profileCounters->instrument(*func);
+      }
+      PurityInfo purity;
+      analyzePurity(session, Proto->getSymbol(), Body, true, purity);
+      session.PureFunctions.set(Proto->getSymbol(), purity.pure);
+      if (session.options.memoize && purity.pure && purity.nonTailRecursion &&
+          hasMemoizableSignature(*func)) {
+        llvm::Function *wrapper =
+            emitMemoWrapper(func, session.options.memoTableSize);
+        session.ModuleFunctions.set(Proto->getSymbol(), wrapper);
+        optimize(session, func);
+        optimize(session, wrapper);
+        session.MemoizedFunctions.push_back(Proto->getName().str());
+        return wrapper;
+      }
+      optimize(session, func);
       return func;
     }
+    session.ModuleFunctions.erase(Proto->getSymbol());
     func->eraseFromParent();
     return nullptr;
   }
+
+private:
+  // Invalid IR is a compiler bug; report it rather than handing it on.
+  void verify(CompilerSession &session, llvm::Function *func) {
+    std::string problems;
+    llvm::raw_string_ostream os(problems);
+    bool broken;
+    {
+      TelemetryScope scope(session.options.telemetry, "verify");
+      broken = llvm::verifyFunction(*func, &os);
+    }
+    if (broken) {
+      // calls of itself may still refer to the declaration
+      func->deleteBody();
+      throw std::runtime_error("invalid IR for " + Proto->getName().str() +
+                               ": " + os.str());
+    }
+  }
+
+  // At -O1 and up the session's module stage optimizes the function along
+  // with the rest of its module (see CompilerSession::takeModule()).
+  static void optimize(CompilerSession &session, llvm::Function *func) {
+    if (session.options.optLevel > 0) {
+      return;
+    }
+    CompileTelemetry *telemetry = session.options.telemetry;
+    {
+      TelemetryScope scope(telemetry, "optimize");
+      session.optimizer.run(*func);
+    }
+    if (telemetry) {
+      telemetry->addCount("IR instructions", func->getInstructionCount());
+    }
+  }
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,52 @@
+#ifndef __jesse_ast_context__
+#define __jesse_ast_context__
+
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/Support/Allocator.h>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Bump allocator owning every AST node of one compilation unit. Nodes are
+// never destroyed one by one: reset() drops them all at once.
+class ASTContext {
+public:
+  ASTContext() = default;
+  ASTContext(const ASTContext &) = delete;
+  ASTContext &operator=(const ASTContext &) = delete;
+
+  template <typename T, typename... Args> T *create(Args &&...args) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena nodes are released without running destructors");
+    nodeCount++;
+    return new (allocator.Allocate<T>()) T(std::forward<Args>(args)...);
+  }
+
+  template <typename T> llvm::ArrayRef<T> copyArray(llvm::ArrayRef<T> values) {
+    static_assert(std::is_trivially_destructible<T>::value,
+                  "arena arrays are released without running destructors");
+    if (values.empty()) {
+      return {};
+    }
+    T *data = allocator.Allocate<T>(values.size());
+    std::uninitialized_copy(values.begin(), values.end(), data);
+    return llvm::makeArrayRef(data, values.size());
+  }
+
+  void reset() {
+    allocator.Reset();
+    nodeCount = 0;
+  }
+
+  size_t getNodeCount() const { return nodeCount; }
+  size_t getBytesAllocated() const { return allocator.getBytesAllocated(); }
+  size_t getTotalMemory() const { return allocator.getTotalMemory(); }
+
+private:
+  llvm::BumpPtrAllocator allocator;
+  size_t nodeCount = 0;
+};
+
+#endif
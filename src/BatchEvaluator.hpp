@@ -0,0 +1,257 @@
+#ifndef __jesse_batch_evaluator__
+#define __jesse_batch_evaluator__
+
+#include "KaleidoscopeJIT.hpp"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Passes/PassBuilder.h"
+#include "llvm/Target/TargetMachine.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+// Evaluates a Kaleidoscope function over columns of doubles, floats or
+// 64-bit integers, the column type being the function's f64, f32 or i64.
+//
+// For every function evaluated, a wrapper `f$batch(inputs, output, rows)` is
+// generated around a copy of the retained IR: the loop calls `f` once per
+// row, `f` is inlined into it and the module is optimized for the host CPU at
+// -O3, so the loop vectorizer can turn it into SIMD code. The copies are
+// available_externally, so anything not inlined still calls the JIT's own
+// definition. Wrappers are compiled once and reused. f32 columns give the
+// vectorizer twice the lanes of f64 ones.
+class BatchEvaluator {
+public:
+  BatchEvaluator(KaleidoscopeJIT &JIT, JITDylib &JD)
+      : JIT(JIT), JD(JD), RetainedCtx(std::make_unique<LLVMContext>()),
+        Retained(std::make_unique<Module>("batch retained IR", *RetainedCtx)) {
+    Retained->setDataLayout(JIT.getDataLayout());
+  }
+
+  // Keep a copy of M's definitions for later wrappers. M must also be added
+  // to the JIT, in JD, for calls that do not get inlined.
+  Error addIR(const Module &M) {
+    SmallVector<char, 0> Bitcode;
+    {
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(M, OS);
+    }
+    std::lock_guard<std::mutex> Lock(Mutex);
+    auto Copy = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()),
+                        M.getModuleIdentifier()),
+        *RetainedCtx);
+    if (!Copy)
+      return Copy.takeError();
+    // every script has its own __anon_expr; they are never batch targets
+    for (auto &F : **Copy)
+      if (F.getName().startswith("__anon_expr"))
+        F.deleteBody();
+    if (Linker::linkModules(*Retained, std::move(*Copy)))
+      return make_error<StringError>("cannot retain IR of " +
+                                         M.getModuleIdentifier(),
+                                     inconvertibleErrorCode());
+    return Error::success();
+  }
+
+  // Output[i] = Name(Inputs[0][i], ..., Inputs[n-1][i]) for i < Rows. Every
+  // parameter of Name and its result must have the type of the columns.
+  Error evalBatch(StringRef Name, ArrayRef<const double *> Inputs,
+                  double *Output, size_t Rows) {
+    return evalColumns(Name, Inputs, Output, Rows, Type::DoubleTyID);
+  }
+  Error evalBatch(StringRef Name, ArrayRef<const float *> Inputs,
+                  float *Output, size_t Rows) {
+    return evalColumns(Name, Inputs, Output, Rows, Type::FloatTyID);
+  }
+  Error evalBatch(StringRef Name, ArrayRef<const int64_t *> Inputs,
+                  int64_t *Output, size_t Rows) {
+    return evalColumns(Name, Inputs, Output, Rows, Type::IntegerTyID);
+  }
+
+private:
+  using WrapperFn = void (*)(const void *const *, void *, uint64_t);
+
+  template <typename T>
+  Error evalColumns(StringRef Name, ArrayRef<const T *> Inputs, T *Output,
+                    size_t Rows, Type::TypeID Element) {
+    auto Wrapper = getWrapper(Name, Inputs.size(), Element);
+    if (!Wrapper)
+      return Wrapper.takeError();
+    (*Wrapper)(reinterpret_cast<const void *const *>(Inputs.data()), Output,
+               Rows);
+    return Error::success();
+  }
+
+  // Whether F takes and returns Element only; integers are all i64.
+  static bool hasElementSignature(const Function &F, Type::TypeID Element) {
+    auto Matches = [Element](Type *Ty) {
+      return Ty->getTypeID() == Element &&
+             (!Ty->isIntegerTy() || Ty->isIntegerTy(64));
+    };
+    if (!Matches(F.getReturnType()))
+      return false;
+    for (auto &Arg : F.args())
+      if (!Matches(Arg.getType()))
+        return false;
+    return true;
+  }
+
+  Expected<WrapperFn> getWrapper(StringRef Name, size_t Arity,
+                                 Type::TypeID Element) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Function *Target = Retained->getFunction(Name);
+    if (!Target || Target->isDeclaration())
+      return make_error<StringError>("no function " + Name + " to evaluate",
+                                     inconvertibleErrorCode());
+    if (Target->arg_size() != Arity)
+      return make_error<StringError>(
+          Name + " takes " + Twine(Target->arg_size()) + " arguments, got " +
+              Twine(Arity) + " input columns",
+          inconvertibleErrorCode());
+    if (!hasElementSignature(*Target, Element))
+      return make_error<StringError>(
+          Name + " does not take and return the type of the columns",
+          inconvertibleErrorCode());
+
+    auto Known = Wrappers.find(Name);
+    if (Known != Wrappers.end())
+      return Known->second;
+
+    auto M = copyRetained();
+    if (!M)
+      return M.takeError();
+    std::string WrapperName = (Name + "$batch").str();
+    buildWrapper(*M->getModuleUnlocked(), Name, WrapperName);
+    if (auto Err = optimize(*M->getModuleUnlocked()))
+      return Err;
+    if (auto Err = JIT.addModule(std::move(*M), JD.createResourceTracker()))
+      return Err;
+    auto Symbol = JIT.lookup(JD, StringRef(WrapperName));
+    if (!Symbol)
+      return Symbol.takeError();
+    auto Fn = jitTargetAddressToFunction<WrapperFn>(Symbol->getAddress());
+    Wrappers[Name] = Fn;
+    return Fn;
+  }
+
+  // The retained IR, in a fresh context, with every definition turned into
+  // an inlining candidate only.
+  Expected<ThreadSafeModule> copyRetained() {
+    SmallVector<char, 0> Bitcode;
+    {
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(*Retained, OS);
+    }
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode.data(), Bitcode.size()), "batch"),
+        *Ctx);
+    if (!M)
+      return M.takeError();
+    for (auto &F : **M)
+      if (!F.isDeclaration() && !F.hasLocalLinkage())
+        F.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    // state such as memo tables must be the JIT's own copy
+    for (auto &GV : (*M)->globals())
+      if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+        GV.setInitializer(nullptr);
+    return ThreadSafeModule(std::move(*M), std::move(Ctx));
+  }
+
+  // void Name$batch(const T **in, T *out, i64 rows) {
+  //   for (i = 0; i < rows; i++) out[i] = Name(in[0][i], ..., in[n-1][i]);
+  // }
+  // where T is the result type of Name.
+  static void buildWrapper(Module &M, StringRef Name, StringRef WrapperName) {
+    LLVMContext &Ctx = M.getContext();
+    Function *Target = M.getFunction(Name);
+    Type *ElementTy = Target->getReturnType();
+    Type *ElementPtrTy = ElementTy->getPointerTo();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    auto *WrapperTy = FunctionType::get(
+        Type::getVoidTy(Ctx),
+        {ElementPtrTy->getPointerTo(), ElementPtrTy, Int64Ty}, false);
+    Function *Wrapper = Function::Create(
+        WrapperTy, Function::ExternalLinkage, WrapperName, M);
+    Argument *Inputs = Wrapper->getArg(0);
+    Argument *Output = Wrapper->getArg(1);
+    Argument *Rows = Wrapper->getArg(2);
+    Output->addAttr(Attribute::NoAlias);
+
+    auto *Entry = BasicBlock::Create(Ctx, "entry", Wrapper);
+    auto *Loop = BasicBlock::Create(Ctx, "loop", Wrapper);
+    auto *Exit = BasicBlock::Create(Ctx, "exit", Wrapper);
+    IRBuilder<> Builder(Entry);
+    SmallVector<Value *, 4> Columns;
+    for (unsigned I = 0; I < Target->arg_size(); I++)
+      Columns.push_back(Builder.CreateLoad(
+          ElementPtrTy, Builder.CreateConstGEP1_64(ElementPtrTy, Inputs, I)));
+    Builder.CreateCondBr(
+        Builder.CreateICmpEQ(Rows, ConstantInt::get(Int64Ty, 0)), Exit, Loop);
+
+    Builder.SetInsertPoint(Loop);
+    PHINode *Row = Builder.CreatePHI(Int64Ty, 2, "row");
+    Row->addIncoming(ConstantInt::get(Int64Ty, 0), Entry);
+    SmallVector<Value *, 4> Args;
+    for (Value *Column : Columns)
+      Args.push_back(Builder.CreateLoad(
+          ElementTy, Builder.CreateInBoundsGEP(ElementTy, Column, Row)));
+    Builder.CreateStore(Builder.CreateCall(Target, Args),
+                        Builder.CreateInBoundsGEP(ElementTy, Output, Row));
+    Value *Next = Builder.CreateAdd(Row, ConstantInt::get(Int64Ty, 1), "next",
+                                    /*HasNUW=*/true, /*HasNSW=*/true);
+    Row->addIncoming(Next, Loop);
+    Builder.CreateCondBr(Builder.CreateICmpULT(Next, Rows), Loop, Exit);
+
+    Builder.SetInsertPoint(Exit);
+    Builder.CreateRetVoid();
+  }
+
+  Error optimize(Module &M) {
+    auto TM = JIT.createTargetMachine();
+    if (!TM)
+      return TM.takeError();
+    if (verifyModule(M, &errs()))
+      return make_error<StringError>("invalid batch wrapper",
+                                     inconvertibleErrorCode());
+    M.setTargetTriple((*TM)->getTargetTriple().str());
+    M.setDataLayout(JIT.getDataLayout());
+    PassBuilder Builder(TM->get());
+    LoopAnalysisManager LAM;
+    FunctionAnalysisManager FAM;
+    CGSCCAnalysisManager CGAM;
+    ModuleAnalysisManager MAM;
+    Builder.registerModuleAnalyses(MAM);
+    Builder.registerCGSCCAnalyses(CGAM);
+    Builder.registerFunctionAnalyses(FAM);
+    Builder.registerLoopAnalyses(LAM);
+    Builder.crossRegisterProxies(LAM, FAM, CGAM, MAM);
+    Builder.buildPerModuleDefaultPipeline(OptimizationLevel::O3)
+        .run(M, MAM);
+    return Error::success();
+  }
+
+  KaleidoscopeJIT &JIT;
+  JITDylib &JD;
+
+  std::mutex Mutex;
+  std::unique_ptr<LLVMContext> RetainedCtx;
+  std::unique_ptr<Module> Retained;
+  StringMap<WrapperFn> Wrappers;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
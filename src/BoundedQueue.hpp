@@ -0,0 +1,65 @@
+#ifndef __jesse_bounded_queue__
+#define __jesse_bounded_queue__
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <utility>
+
+// Fixed-capacity FIFO connecting two pipeline stages on different threads.
+// push() blocks while the queue is full, so a fast producer cannot run ahead
+// of its consumer by more than `capacity` items, and pop() blocks while it
+// is empty.
+//
+// close() ends the stream: pending items can still be popped, after which
+// pop() returns false, and every push() fails from then on. Closing is also
+// how a failing consumer stops its producer.
+template <typename T> class BoundedQueue {
+public:
+  explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+  BoundedQueue(const BoundedQueue &) = delete;
+  BoundedQueue &operator=(const BoundedQueue &) = delete;
+
+  // false if the queue was closed; `value` is dropped then
+  bool push(T value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notFull.wait(lock, [&]() { return closed || items.size() < capacity; });
+    if (closed) {
+      return false;
+    }
+    items.push_back(std::move(value));
+    notEmpty.notify_one();
+    return true;
+  }
+
+  // false once the queue is closed and drained
+  bool pop(T &value) {
+    std::unique_lock<std::mutex> lock(mutex);
+    notEmpty.wait(lock, [&]() { return closed || !items.empty(); });
+    if (items.empty()) {
+      return false;
+    }
+    value = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notFull.notify_all();
+    notEmpty.notify_all();
+  }
+
+private:
+  const size_t capacity;
+  std::mutex mutex;
+  std::condition_variable notFull;
+  std::condition_variable notEmpty;
+  std::deque<T> items;
+  bool closed = false;
+};
+
+#endif
@@ -0,0 +1,339 @@
+#ifndef __jesse_code_cache__
+#define __jesse_code_cache__
+
+#include "KaleidoscopeJIT.hpp"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/Layer.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Object/ObjectFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+// Recompiles a module from its bitcode when one of its symbols is looked up.
+// What CodeCache puts back in place of an evicted module.
+class RetainedModuleMaterializationUnit : public MaterializationUnit {
+public:
+  RetainedModuleMaterializationUnit(
+      IRLayer &Layer, std::string Name, SymbolFlagsMap Flags,
+      std::shared_ptr<const SmallVector<char, 0>> Bitcode)
+      : MaterializationUnit(Interface(std::move(Flags), nullptr)),
+        Layer(Layer), Name(std::move(Name)), Bitcode(std::move(Bitcode)) {}
+
+  StringRef getName() const override { return Name; }
+
+  void materialize(std::unique_ptr<MaterializationResponsibility> R) override {
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(Bitcode->data(), Bitcode->size()), Name),
+        *Ctx);
+    if (!M) {
+      Layer.getExecutionSession().reportError(M.takeError());
+      R->failMaterialization();
+      return;
+    }
+    // overridden since; the module must not define them any more
+    for (auto &G : (*M)->global_values())
+      if (Discarded.count(G.getName()))
+        G.setLinkage(GlobalValue::AvailableExternallyLinkage);
+    Layer.emit(std::move(R), ThreadSafeModule(std::move(*M), std::move(Ctx)));
+  }
+
+private:
+  void discard(const JITDylib &, const SymbolStringPtr &Symbol) override {
+    Discarded.insert(*Symbol);
+  }
+
+  IRLayer &Layer;
+  std::string Name;
+  std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+  StringSet<> Discarded;
+};
+
+// Keeps the machine code of the modules added through it within a memory
+// budget, for a JIT that stays up while it compiles more and more code.
+//
+// Every module gets a ResourceTracker of its own, and its bitcode is kept.
+// The code and data bytes of each module are counted as the JIT loads its
+// objects. Lookups and touch() record which modules were used last.
+// enforceBudget() removes least recently used modules through their
+// trackers until the resident bytes fit the budget again, and puts each back
+// as a RetainedModuleMaterializationUnit, so the next lookup that needs it
+// compiles it again.
+//
+// JIT'd code calls into other modules directly, so evicting a module also
+// evicts every resident module that refers to its definitions. Touching a
+// module touches the modules it refers to as well, which keeps the modules
+// it needs more recent than itself. Addresses returned by lookup() are
+// valid until the next enforceBudget(); the cache is meant to be driven
+// from one thread.
+class CodeCache {
+public:
+  struct Stats {
+    uint64_t BudgetBytes = 0;
+    uint64_t ResidentCodeBytes = 0;
+    uint64_t ResidentDataBytes = 0;
+    // bitcode kept to compile modules again
+    uint64_t RetainedBytes = 0;
+    size_t Modules = 0;
+    size_t ResidentModules = 0;
+    uint64_t Evictions = 0;
+    uint64_t Recompilations = 0;
+  };
+
+  CodeCache(KaleidoscopeJIT &JIT, JITDylib &JD, uint64_t BudgetBytes)
+      : JIT(JIT), JD(JD), BudgetBytes(BudgetBytes) {
+    JIT.setNotifyLoaded([this](MaterializationResponsibility &R,
+                               const object::ObjectFile &Obj,
+                               const RuntimeDyld::LoadedObjectInfo &) {
+      objectLoaded(R, Obj);
+    });
+  }
+
+  ~CodeCache() { JIT.setNotifyLoaded(nullptr); }
+
+  CodeCache(const CodeCache &) = delete;
+  CodeCache &operator=(const CodeCache &) = delete;
+
+  Error addModule(ThreadSafeModule TSM) {
+    auto E = std::make_unique<Entry>();
+    auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+    TSM.withModuleDo([&](Module &M) {
+      E->Name = M.getModuleIdentifier();
+      raw_svector_ostream OS(*Bitcode);
+      WriteBitcodeToFile(M, OS);
+      for (auto &G : M.global_values()) {
+        if (!G.hasName())
+          continue;
+        if (G.isDeclaration()) {
+          E->References.insert(G.getName());
+          continue;
+        }
+        // what IRMaterializationUnit would define
+        if (G.hasLocalLinkage() || G.hasAvailableExternallyLinkage() ||
+            G.hasAppendingLinkage())
+          continue;
+        E->Definitions.push_back(G.getName().str());
+        E->Flags[JIT.mangle(G.getName())] = JITSymbolFlags::fromGlobalValue(G);
+      }
+    });
+    E->Bitcode = std::move(Bitcode);
+    E->Tracker = JD.createResourceTracker();
+
+    std::lock_guard<std::mutex> Lock(Mutex);
+    if (auto Err = JIT.addModule(std::move(TSM), E->Tracker))
+      return Err;
+    Entry &Added = *E;
+    Entries.push_back(std::move(E));
+    ByKey[Added.Tracker->getKeyUnsafe()] = &Added;
+    for (auto &Name : Added.Definitions)
+      ByName[Name] = &Added;
+    touch(Added);
+    return Error::success();
+  }
+
+  Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+    {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto Found = ByName.find(Name);
+      if (Found != ByName.end())
+        touch(*Found->second);
+    }
+    return JIT.lookup(JD, Name);
+  }
+
+  // Mark the modules whose definitions M uses as used now, e.g. before M
+  // is compiled and run outside of the cache.
+  void touch(const Module &M) {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    for (auto &G : M.global_values()) {
+      if (!G.isDeclaration())
+        continue;
+      auto Found = ByName.find(G.getName());
+      if (Found != ByName.end())
+        touch(*Found->second);
+    }
+  }
+
+  // Evict least recently used modules until the resident code and data fit
+  // the budget.
+  Error enforceBudget() {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    while (residentBytes() > BudgetBytes) {
+      Entry *Victim = nullptr;
+      for (auto &E : Entries)
+        if (E->resident() && (!Victim || E->LastUse < Victim->LastUse))
+          Victim = E.get();
+      if (!Victim)
+        break;
+      if (auto Err = evict(withDependents(*Victim)))
+        return Err;
+    }
+    return Error::success();
+  }
+
+  Stats getStats() const {
+    std::lock_guard<std::mutex> Lock(Mutex);
+    Stats S;
+    S.BudgetBytes = BudgetBytes;
+    S.Modules = Entries.size();
+    for (auto &E : Entries) {
+      S.ResidentCodeBytes += E->CodeBytes;
+      S.ResidentDataBytes += E->DataBytes;
+      S.RetainedBytes += E->Bitcode->size();
+      S.ResidentModules += E->resident();
+    }
+    S.Evictions = Evictions;
+    S.Recompilations = Recompilations;
+    return S;
+  }
+
+  void printStats(raw_ostream &OS) const {
+    Stats S = getStats();
+    OS << "code cache: " << S.ResidentModules << "/" << S.Modules
+       << " modules resident, " << S.ResidentCodeBytes << " code + "
+       << S.ResidentDataBytes << " data bytes of " << S.BudgetBytes
+       << " budget, " << S.RetainedBytes << " bytes of bitcode kept, "
+       << S.Evictions << " evictions, " << S.Recompilations
+       << " recompilations\n";
+  }
+
+private:
+  struct Entry {
+    std::string Name;
+    ResourceTrackerSP Tracker;
+    std::shared_ptr<const SmallVector<char, 0>> Bitcode;
+    SymbolFlagsMap Flags;
+    std::vector<std::string> Definitions;
+    // everything the module declares, defined by other modules or not
+    StringSet<> References;
+    uint64_t CodeBytes = 0;
+    uint64_t DataBytes = 0;
+    uint64_t LastUse = 0;
+    // the next load of the module is a recompilation
+    bool Evicted = false;
+
+    bool resident() const { return CodeBytes + DataBytes > 0; }
+  };
+
+  uint64_t residentBytes() const {
+    uint64_t Bytes = 0;
+    for (auto &E : Entries)
+      Bytes += E->CodeBytes + E->DataBytes;
+    return Bytes;
+  }
+
+  void touch(Entry &E) {
+    uint64_t Now = ++Clock;
+    SmallVector<Entry *, 8> Worklist{&E};
+    while (!Worklist.empty()) {
+      Entry *Current = Worklist.pop_back_val();
+      if (Current->LastUse == Now)
+        continue;
+      Current->LastUse = Now;
+      for (auto &Reference : Current->References) {
+        auto Found = ByName.find(Reference.getKey());
+        if (Found != ByName.end())
+          Worklist.push_back(Found->second);
+      }
+    }
+  }
+
+  // E and every resident module referring to it, directly or not
+  std::vector<Entry *> withDependents(Entry &E) {
+    std::vector<Entry *> Evicting{&E};
+    DenseSet<Entry *> Seen{&E};
+    for (size_t I = 0; I < Evicting.size(); I++) {
+      for (auto &Other : Entries) {
+        if (!Other->resident() || Seen.count(Other.get()))
+          continue;
+        for (auto &Name : Evicting[I]->Definitions) {
+          if (Other->References.count(Name)) {
+            Seen.insert(Other.get());
+            Evicting.push_back(Other.get());
+            break;
+          }
+        }
+      }
+    }
+    return Evicting;
+  }
+
+  Error evict(ArrayRef<Entry *> Evicting) {
+    // all code goes before anything is put back, so that nothing links
+    // against a module about to be removed
+    for (Entry *E : Evicting) {
+      ByKey.erase(E->Tracker->getKeyUnsafe());
+      if (auto Err = E->Tracker->remove())
+        return Err;
+      E->CodeBytes = E->DataBytes = 0;
+      E->Evicted = true;
+      Evictions++;
+    }
+    for (Entry *E : Evicting) {
+      E->Tracker = JD.createResourceTracker();
+      ByKey[E->Tracker->getKeyUnsafe()] = E;
+      if (auto Err = JD.define(
+              std::make_unique<RetainedModuleMaterializationUnit>(
+                  JIT.getIRLayer(), E->Name, E->Flags, E->Bitcode),
+              E->Tracker))
+        return Err;
+    }
+    return Error::success();
+  }
+
+  // Called by the object layer, possibly on a compile thread.
+  void objectLoaded(MaterializationResponsibility &R,
+                    const object::ObjectFile &Obj) {
+    uint64_t Code = 0, Data = 0;
+    for (auto &Section : Obj.sections()) {
+      if (Section.isText())
+        Code += Section.getSize();
+      else if (Section.isData() || Section.isBSS())
+        Data += Section.getSize();
+    }
+    // fails only when the tracker is being removed, and then nothing counts
+    consumeError(R.withResourceKeyDo([&](ResourceKey Key) {
+      std::lock_guard<std::mutex> Lock(Mutex);
+      auto Found = ByKey.find(Key);
+      if (Found == ByKey.end())
+        return;
+      Entry &E = *Found->second;
+      E.CodeBytes += Code;
+      E.DataBytes += Data;
+      if (E.Evicted) {
+        E.Evicted = false;
+        Recompilations++;
+      }
+    }));
+  }
+
+  KaleidoscopeJIT &JIT;
+  JITDylib &JD;
+  uint64_t BudgetBytes;
+
+  mutable std::mutex Mutex;
+  std::vector<std::unique_ptr<Entry>> Entries;
+  DenseMap<ResourceKey, Entry *> ByKey;
+  StringMap<Entry *> ByName;
+  uint64_t Clock = 0;
+  uint64_t Evictions = 0;
+  uint64_t Recompilations = 0;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
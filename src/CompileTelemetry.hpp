@@ -0,0 +1,187 @@
+#ifndef __jesse_compile_telemetry__
+#define __jesse_compile_telemetry__
+
+#include <chrono>
+#include <cstdint>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/raw_ostream.h>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Where compile time goes: wall time and count of every phase (lexing,
+// parsing, IR generation, verification, each optimization pass, object
+// emission, linking, symbol lookup) plus size counters (tokens, AST nodes,
+// IR instructions, code bytes), from every thread that compiles.
+//
+// Phases nest: parsing includes lexing, IR generation includes
+// verification (and the passes at -O0; above, they run in module
+// optimization), and a lookup includes whatever compiling and linking it
+// triggered on the calling thread. So the totals of different
+// phases do not add up to the wall time.
+//
+// With `traceEvents`, every phase is also kept as an event for the Chrome
+// trace format (chrome://tracing, Perfetto), one track per thread. Lexing is
+// only ever summed up, since an event per token would dwarf the rest.
+class CompileTelemetry {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit CompileTelemetry(bool traceEvents)
+      : traceEvents(traceEvents), start(Clock::now()) {}
+
+  void recordPhase(llvm::StringRef name, Clock::time_point begin,
+                   Clock::time_point end) {
+    std::lock_guard<std::mutex> lock(mutex);
+    PhaseTotal &total = phases[name];
+    total.count++;
+    total.seconds += seconds(begin, end);
+    if (traceEvents) {
+      events.push_back({phases.find(name)->getKey(), begin, end,
+                        threadIndex(std::this_thread::get_id())});
+    }
+  }
+
+  // a phase measured elsewhere, `count` times in `phaseSeconds`
+  void addPhaseTotal(llvm::StringRef name, uint64_t count,
+                     double phaseSeconds) {
+    std::lock_guard<std::mutex> lock(mutex);
+    PhaseTotal &total = phases[name];
+    total.count += count;
+    total.seconds += phaseSeconds;
+  }
+
+  void addCount(llvm::StringRef name, uint64_t amount) {
+    std::lock_guard<std::mutex> lock(mutex);
+    counters[name] += amount;
+  }
+
+  // {"wallSeconds": s, "phases": {name: {"count": n, "seconds": s}},
+  //  "counters": {name: n}}
+  void writeJSON(llvm::raw_ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::json::OStream json(os, 2);
+    json.object([&]() {
+      json.attribute("wallSeconds", seconds(start, Clock::now()));
+      json.attributeObject("phases", [&]() {
+        for (auto &phase : phases) {
+          json.attributeObject(phase.getKey(), [&]() {
+            json.attribute("count", int64_t(phase.getValue().count));
+            json.attribute("seconds", phase.getValue().seconds);
+          });
+        }
+      });
+      json.attributeObject("counters", [&]() {
+        for (auto &counter : counters) {
+          json.attribute(counter.getKey(), int64_t(counter.getValue()));
+        }
+      });
+    });
+    os << "\n";
+  }
+
+  // Chrome trace event format: a complete ("X") event per phase, and the
+  // counters as one counter ("C") event at the end.
+  void writeChromeTrace(llvm::raw_ostream &os) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::json::OStream json(os);
+    auto microseconds = [this](Clock::time_point time) {
+      return std::chrono::duration<double, std::micro>(time - start).count();
+    };
+    json.object([&]() {
+      json.attribute("displayTimeUnit", "ms");
+      json.attributeArray("traceEvents", [&]() {
+        for (auto &event : events) {
+          json.object([&]() {
+            json.attribute("name", event.name);
+            json.attribute("ph", "X");
+            json.attribute("ts", microseconds(event.begin));
+            json.attribute("dur", microseconds(event.end) -
+                                      microseconds(event.begin));
+            json.attribute("pid", 1);
+            json.attribute("tid", int64_t(event.thread));
+          });
+        }
+        json.object([&]() {
+          json.attribute("name", "sizes");
+          json.attribute("ph", "C");
+          json.attribute("ts", microseconds(Clock::now()));
+          json.attribute("pid", 1);
+          json.attributeObject("args", [&]() {
+            for (auto &counter : counters) {
+              json.attribute(counter.getKey(), int64_t(counter.getValue()));
+            }
+          });
+        });
+      });
+    });
+    os << "\n";
+  }
+
+private:
+  struct PhaseTotal {
+    uint64_t count = 0;
+    double seconds = 0;
+  };
+
+  struct Event {
+    // key of `phases`, which lives as long as the telemetry
+    llvm::StringRef name;
+    Clock::time_point begin;
+    Clock::time_point end;
+    unsigned thread;
+  };
+
+  static double seconds(Clock::time_point begin, Clock::time_point end) {
+    return std::chrono::duration<double>(end - begin).count();
+  }
+
+  // small, stable thread numbers for the trace, in order of appearance
+  unsigned threadIndex(std::thread::id id) {
+    for (unsigned i = 0; i < threads.size(); i++) {
+      if (threads[i] == id) {
+        return i;
+      }
+    }
+    threads.push_back(id);
+    return threads.size() - 1;
+  }
+
+  const bool traceEvents;
+  const Clock::time_point start;
+
+  mutable std::mutex mutex;
+  llvm::StringMap<PhaseTotal> phases;
+  llvm::StringMap<uint64_t> counters;
+  std::vector<Event> events;
+  std::vector<std::thread::id> threads;
+};
+
+// Records the time until the end of the scope as one `name` phase. Does
+// nothing without telemetry, so it can stay in the code unconditionally.
+class TelemetryScope {
+public:
+  TelemetryScope(CompileTelemetry *telemetry, llvm::StringRef name)
+      : telemetry(telemetry), name(name) {
+    if (telemetry) {
+      begin = CompileTelemetry::Clock::now();
+    }
+  }
+  TelemetryScope(const TelemetryScope &) = delete;
+  TelemetryScope &operator=(const TelemetryScope &) = delete;
+  ~TelemetryScope() {
+    if (telemetry) {
+      telemetry->recordPhase(name, begin, CompileTelemetry::Clock::now());
+    }
+  }
+
+private:
+  CompileTelemetry *telemetry;
+  llvm::StringRef name;
+  CompileTelemetry::Clock::time_point begin;
+};
+
+#endif
@@ -0,0 +1,268 @@
+#ifndef __jesse_compiler_session__
+#define __jesse_compiler_session__
+
+#include "ASTContext.hpp"
+#include "CompileTelemetry.hpp"
+#include "Lexer.hpp"
+#include "OptimizationPipeline.hpp"
+#include "Precedence.hpp"
+#include "ProfileData.hpp"
+#include "RetainedIR.hpp"
+#include "SymbolMap.hpp"
+#include "SymbolTable.hpp"
+#include "ValueType.hpp"
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Value.h>
+#include <llvm/Target/TargetMachine.h>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class PrototypeAST;
+
+struct CompileOptions {
+  // Put every function in a module (and LLVMContext) of its own, so the JIT
+  // can compile them on different threads.
+  bool modulePerFunction = false;
+  // -O level of the per-function optimization pipeline
+  unsigned optLevel = 2;
+  // record the time spent in every optimization pass
+  bool timePasses = false;
+  // cache the results of pure functions that recurse outside tail position
+  bool memoize = false;
+  // entries per memoized function, a power of two
+  uint64_t memoTableSize = 4096;
+  // where to record phase times and sizes; none when null
+  CompileTelemetry *telemetry = nullptr;
+  // make every def count its calls, branches and call sites into this
+  ProfileData *profileCounters = nullptr;
+  // optimize defs with the counts recorded here
+  const ProfileData *profile = nullptr;
+  // inliner budget per call site; below zero the -O level's
+  int inlineThreshold = -1;
+  // largest def, in IR instructions, that later modules of the session may
+  // inline; 0 inlines across modules not at all
+  unsigned inlineImportLimit = 64;
+  // the target the code will run on, whose costs the optimizer then uses;
+  // generic costs when none
+  llvm::Optional<llvm::orc::JITTargetMachineBuilder> target;
+};
+
+// Everything needed to compile one script: its own LLVMContext, module,
+// builder and symbol table plus the lexer/parser state and the AST arena.
+// Sessions share nothing, so independent scripts can be compiled on
+// different threads.
+class CompilerSession {
+public:
+  explicit CompilerSession(std::string_view source,
+                           const std::string &moduleName = "my cool jit",
+                           const CompileOptions &options = CompileOptions())
+      : TheContext(std::make_unique<llvm::LLVMContext>()),
+        TheModule(std::make_unique<llvm::Module>(moduleName, *TheContext)),
+        Builder(std::make_unique<llvm::IRBuilder<>>(*TheContext)),
+        options(options), targetMachine(createTargetMachine(options)),
+        optimizer(options.optLevel, options.timePasses, options.telemetry,
+                  options.inlineThreshold, targetMachine.get()),
+        lexer(source, &symbols), moduleName(moduleName) {}
+
+  ~CompilerSession() {
+    if (options.telemetry) {
+      options.telemetry->addPhaseTotal("lex", lexedTokens, lexSeconds);
+      options.telemetry->addCount("tokens", lexedTokens);
+    }
+  }
+
+  std::unique_ptr<llvm::LLVMContext> TheContext;
+  std::unique_ptr<llvm::Module> TheModule;
+  std::unique_ptr<llvm::IRBuilder<>> Builder;
+  // parameters and loop variables in scope
+  SymbolMap<llvm::Value *> NamedValues;
+  // their types, while inferFunctionTypes() runs
+  SymbolMap<ValueType> VariableTypes;
+  // functions of TheModule by name; emptied whenever the module changes
+  SymbolMap<llvm::Function *> ModuleFunctions;
+  // every prototype seen so far (defs and externs), used to re-declare
+  // callees in modules other than the one that defines them
+  SymbolMap<PrototypeAST *> FunctionProtos;
+  // whether each def compiled so far is pure, for the purity of its callers
+  SymbolMap<bool> PureFunctions;
+  // calls to user-defined operators in the function being generated
+  std::vector<llvm::CallInst *> OperatorCalls;
+  // defs put behind a memo table, in definition order
+  std::vector<std::string> MemoizedFunctions;
+
+  const CompileOptions options;
+  // own copy, since target machines cache per-function state unsynchronized
+  std::unique_ptr<llvm::TargetMachine> targetMachine;
+  OptimizationPipeline optimizer;
+
+  // every identifier of the session, interned by the lexer; outlives `ast`
+  // and `declarations`
+  SymbolTable symbols;
+  // expressions and function bodies; a pipeline stage can take the arena
+  // and start a fresh one (see takeAST())
+  std::unique_ptr<ASTContext> ast = std::make_unique<ASTContext>();
+  // prototypes, which FunctionProtos refers to and which therefore outlive
+  // the AST of the statement that declared them
+  ASTContext declarations;
+  PrototypeAST *anonymousPrototype = nullptr;
+  Lexer lexer;
+  int currentToken = Token::tok_eof;
+  PrecedenceParser precedenceParser;
+
+  // lex `source` from now on, interning into this session's symbols
+  void setSource(std::string_view source) { lexer = Lexer(source, &symbols); }
+
+  int getNextToken() {
+    if (options.telemetry) {
+      // summed up here and reported once, see ~CompilerSession()
+      auto start = CompileTelemetry::Clock::now();
+      currentToken = lexer.next();
+      lexSeconds += std::chrono::duration<double>(
+                        CompileTelemetry::Clock::now() - start)
+                        .count();
+      lexedTokens++;
+      return currentToken;
+    }
+    currentToken = lexer.next();
+    return currentToken;
+  }
+
+  int getTokenPrecedence() {
+    return precedenceParser.getOpPrecedence(currentToken);
+  }
+
+  // Hand the generated module over to the JIT, after the module-level
+  // optimizations at -O1 and up. No codegen is possible on this session
+  // afterwards.
+  llvm::orc::ThreadSafeModule takeModule() {
+    optimizeModule(false);
+    return releaseModule();
+  }
+
+  // Hand over the current module and continue codegen in a fresh
+  // context/module.
+  llvm::orc::ThreadSafeModule nextModule() {
+    optimizeModule(true);
+    return replaceModule();
+  }
+
+  // The module last handed over by nextModule() was refused by the JIT:
+  // later modules must not inline its defs.
+  void rejectModule() { retainedIR.forgetLast(); }
+
+  // Drop the current module, which may hold a half-built function, and
+  // continue codegen in a fresh context/module.
+  void discardModule() { replaceModule(); }
+
+  // Seal the current module; takeModules() returns it later.
+  void finishModule() { finishedModules.push_back(nextModule()); }
+
+  // Seal the current module, which holds a top-level expression and nothing
+  // else; takeExpressionModules() returns it later.
+  void finishExpression() { expressionModules.push_back(nextModule()); }
+
+  // The modules sealed by finishExpression(), in source order.
+  std::vector<llvm::orc::ThreadSafeModule> takeExpressionModules() {
+    return std::exchange(expressionModules, {});
+  }
+
+  // All modules generated by this session, the current one last.
+  std::vector<llvm::orc::ThreadSafeModule> takeModules() {
+    std::vector<llvm::orc::ThreadSafeModule> modules =
+        std::move(finishedModules);
+    finishedModules.clear();
+    modules.push_back(takeModule());
+    return modules;
+  }
+
+  // Drop the AST in one go once codegen is done.
+  void resetAST() {
+    FunctionProtos.clear();
+    anonymousPrototype = nullptr;
+    declarations.reset();
+    ast->reset();
+  }
+
+  // Drop the AST of the statement just compiled, keeping every prototype,
+  // so that a long-running session's memory does not grow per statement.
+  void resetStatementAST() { ast->reset(); }
+
+  // Hand over the expression arena, e.g. to a codegen thread, and continue
+  // parsing into a fresh one. Prototypes stay in `declarations`.
+  std::unique_ptr<ASTContext> takeAST() {
+    return std::exchange(ast, std::make_unique<ASTContext>());
+  }
+
+private:
+  static std::unique_ptr<llvm::TargetMachine>
+  createTargetMachine(const CompileOptions &options) {
+    if (!options.target) {
+      return nullptr;
+    }
+    llvm::orc::JITTargetMachineBuilder builder = *options.target;
+    auto machine = builder.createTargetMachine();
+    if (!machine) {
+      throw std::runtime_error(llvm::toString(machine.takeError()));
+    }
+    return std::move(*machine);
+  }
+
+  // Optimize the module as a whole, inlining across its defs and from the
+  // defs of earlier modules of this session, then keep its small defs if
+  // more modules follow. At -O0 FunctionAST::codegen has already run the
+  // function pipeline.
+  void optimizeModule(bool moreModules) {
+    if (options.optLevel == 0) {
+      return;
+    }
+    {
+      TelemetryScope scope(options.telemetry, "optimize module");
+      retainedIR.importInto(*TheModule);
+      optimizer.runModule(*TheModule);
+      if (moreModules) {
+        retainedIR.retain(*TheModule, options.inlineImportLimit);
+      }
+    }
+    if (options.telemetry) {
+      options.telemetry->addCount("IR instructions",
+                                  TheModule->getInstructionCount());
+    }
+  }
+
+  llvm::orc::ThreadSafeModule releaseModule() {
+    ModuleFunctions.clear();
+    Builder.reset();
+    return llvm::orc::ThreadSafeModule(std::move(TheModule),
+                                       std::move(TheContext));
+  }
+
+  llvm::orc::ThreadSafeModule replaceModule() {
+    llvm::DataLayout dataLayout = TheModule->getDataLayout();
+    llvm::orc::ThreadSafeModule module = releaseModule();
+    TheContext = std::make_unique<llvm::LLVMContext>();
+    TheModule = std::make_unique<llvm::Module>(moduleName, *TheContext);
+    TheModule->setDataLayout(dataLayout);
+    Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+    return module;
+  }
+
+  std::string moduleName;
+  uint64_t lexedTokens = 0;
+  double lexSeconds = 0;
+  std::vector<llvm::orc::ThreadSafeModule> finishedModules;
+  std::vector<llvm::orc::ThreadSafeModule> expressionModules;
+  RetainedIR retainedIR;
+};
+
+#endif
@@ -0,0 +1,123 @@
+#ifndef __jesse_host_target__
+#define __jesse_host_target__
+
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/MC/MCSubtargetInfo.h"
+#include "llvm/MC/SubtargetFeature.h"
+#include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/CodeGen.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+#include <memory>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+// What to generate code for on this machine.
+struct HostTargetOptions {
+  // CPU to tune and select instructions for. Empty or "native" is the host
+  // CPU with every feature it reports; any other CPU brings just its own
+  // features, e.g. "x86-64" for a baseline that runs everywhere.
+  std::string CPU;
+  // comma separated "+feature"/"-feature" on top of those of the CPU
+  std::string Features;
+  Optional<CodeModel::Model> CodeModel;
+  CodeGenOpt::Level OptLevel = CodeGenOpt::Default;
+};
+
+// The baseline CPU of the host's architecture, for code that is to run on
+// other machines than the one compiling it: "x86-64" on x86-64, "i686" on
+// 32-bit x86 and "generic" elsewhere.
+inline std::string getGenericCPUName() {
+  Triple TT(sys::getProcessTriple());
+  switch (TT.getArch()) {
+  case Triple::x86_64:
+    return "x86-64";
+  case Triple::x86:
+    return "i686";
+  default:
+    return "generic";
+  }
+}
+
+inline CodeGenOpt::Level getCodeGenOptLevel(unsigned OptLevel) {
+  switch (OptLevel) {
+  case 0:
+    return CodeGenOpt::None;
+  case 1:
+    return CodeGenOpt::Less;
+  case 2:
+    return CodeGenOpt::Default;
+  default:
+    return CodeGenOpt::Aggressive;
+  }
+}
+
+// A target machine builder for the process's own triple and the CPU and
+// features chosen by Opts. The target machine would just warn about and
+// ignore an unknown CPU or feature; here they are errors.
+inline Expected<JITTargetMachineBuilder>
+createHostTargetMachineBuilder(const HostTargetOptions &Opts) {
+  InitializeNativeTarget();
+  Triple TT(sys::getProcessTriple());
+  std::string ErrMsg;
+  const Target *TheTarget = TargetRegistry::lookupTarget(TT.str(), ErrMsg);
+  if (!TheTarget)
+    return make_error<StringError>(ErrMsg, inconvertibleErrorCode());
+  std::unique_ptr<MCSubtargetInfo> STI(
+      TheTarget->createMCSubtargetInfo(TT.str(), "", ""));
+
+  JITTargetMachineBuilder JTMB(TT);
+  if (Opts.CPU.empty() || Opts.CPU == "native") {
+    JTMB.setCPU(sys::getHostCPUName().str());
+    StringMap<bool> HostFeatures;
+    if (sys::getHostCPUFeatures(HostFeatures))
+      for (auto &Feature : HostFeatures)
+        JTMB.getFeatures().AddFeature(Feature.first(), Feature.second);
+  } else {
+    if (!STI->isCPUStringValid(Opts.CPU))
+      return make_error<StringError>("unknown CPU '" + Opts.CPU + "' for " +
+                                         TT.str(),
+                                     inconvertibleErrorCode());
+    JTMB.setCPU(Opts.CPU);
+  }
+
+  // a feature the target knows makes a difference when turned on or off
+  auto FeatureBits = [&](const std::string &FS) {
+    std::unique_ptr<MCSubtargetInfo> WithFS(
+        TheTarget->createMCSubtargetInfo(TT.str(), "", FS));
+    return WithFS->getFeatureBits();
+  };
+  SubtargetFeatures Extra(Opts.Features);
+  for (auto &Feature : Extra.getFeatures()) {
+    std::string Name = SubtargetFeatures::StripFlag(Feature).str();
+    if (!SubtargetFeatures::hasFlag(Feature) ||
+        FeatureBits("+" + Name) == FeatureBits("-" + Name))
+      return make_error<StringError>(
+          "unknown feature '" + Feature + "' for " + TT.str() +
+              " (expected +name or -name)",
+          inconvertibleErrorCode());
+    // later features override earlier ones, including the CPU's
+    JTMB.getFeatures().AddFeature(Feature);
+  }
+
+  JTMB.setCodeModel(Opts.CodeModel);
+  JTMB.setCodeGenOptLevel(Opts.OptLevel);
+  return JTMB;
+}
+
+// "<triple>, cpu <name>, features +a,-b,..."
+inline void printTarget(const JITTargetMachineBuilder &JTMB, raw_ostream &OS) {
+  OS << JTMB.getTargetTriple().str() << ", cpu " << JTMB.getCPU()
+     << ", features " << JTMB.getFeatures().getString() << "\n";
+}
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
@@ -0,0 +1,848 @@
+#ifndef __jesse_interpreter__
+#define __jesse_interpreter__
+
+#include "AST.hpp"
+#include "CompilerSession.hpp"
+#include "KaleidoscopeJIT.hpp"
+#include "Parser.hpp"
+#include "SymbolMap.hpp"
+#include "ValueType.hpp"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <limits>
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// A bytecode interpreter for the defs and top-level expressions of a
+// session, for scripts that run once and briefly: interpreting them costs
+// neither a JIT, nor the optimizer, nor machine code generation.
+//
+// add() types a def like FunctionAST::codegen does and lowers it to a
+// compact stack bytecode. evaluate() does the same with a top-level
+// expression and runs it right away. Every call of a def, and every
+// iteration of a loop in it, adds to its heat; once that reaches the
+// promotion threshold the def, with every def it calls that has no machine
+// code yet, is generated and JIT-compiled, and from then on calls go to the
+// machine code. A def calling an extern the interpreter cannot call (one
+// with more than four parameters or any that is not f64, or one declared
+// with extern and defined only later) is compiled on its first call, with
+// the defs of those names as they are by then. A self call in tail
+// position reuses the frame, so tail recursion runs in constant space as in
+// compiled code.
+//
+// The JIT is only asked for on the first promotion. The ASTs given to the
+// interpreter must stay alive as long as it does.
+class Interpreter {
+public:
+  // where promoted defs are compiled
+  struct JITTarget {
+    llvm::orc::KaleidoscopeJIT *jit;
+    llvm::orc::JITDylib *dylib;
+  };
+  using JITProvider = std::function<JITTarget()>;
+
+  struct Promotion {
+    std::string name;
+    uint64_t heat;
+    // since the interpreter was created
+    double promotedAtSeconds;
+    double compileSeconds;
+  };
+
+  // `promoteThreshold` 0 never promotes a def that can be interpreted
+  Interpreter(CompilerSession &session, uint64_t promoteThreshold,
+              JITProvider getJIT)
+      : session(session), promoteThreshold(promoteThreshold),
+        getJIT(std::move(getJIT)), created(Clock::now()) {}
+
+  Interpreter(const Interpreter &) = delete;
+  Interpreter &operator=(const Interpreter &) = delete;
+
+  void add(FunctionAST *def) {
+    PrototypeAST *proto = def->getProto();
+    if (functionsByName.find(proto->getSymbol())) {
+      throw std::runtime_error("redefine function");
+    }
+    Function &function = lower(def);
+    functionsByName.set(proto->getSymbol(), &function);
+  }
+
+  // Run a top-level expression, parsed with parseToplevelAST().
+  double evaluate(FunctionAST *expression) {
+    Function &function = lower(expression);
+    if (function.interpretable) {
+      return execute(function).f64;
+    }
+    // Compiled on its own and dropped after the run, since the next
+    // expression is __anon_expr as well. Its callees stay.
+    for (Function *callee : getCallees(function)) {
+      if (!callee->native) {
+        promote(*callee);
+      }
+    }
+    auto tracker = getTarget().dylib->createResourceTracker();
+    promote(function, tracker);
+    Slot result;
+    function.native(nullptr, &result);
+    if (auto err = tracker->remove()) {
+      throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+    return result.f64;
+  }
+
+  uint64_t getInterpretedCalls() const { return interpretedCalls; }
+  const std::vector<Promotion> &getPromotions() const { return promotions; }
+
+  void printPromotions(llvm::raw_ostream &os) const {
+    os << "interpreter: " << interpretedCalls << " interpreted calls, "
+       << promotions.size() << " promotions\n";
+    for (auto &promotion : promotions) {
+      os << "promoted: " << promotion.name << " at heat " << promotion.heat
+         << " at +" << llvm::format("%.3f", promotion.promotedAtSeconds * 1000)
+         << " ms (compiled in "
+         << llvm::format("%.3f", promotion.compileSeconds * 1000) << " ms)\n";
+    }
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  // a value of any ValueType; VT_Unknown is f64, as in codegen
+  union Slot {
+    double f64;
+    float f32;
+    int64_t i64;
+  };
+
+  // Machine code entry taking the arguments and returning the result in
+  // slots, one signature for all defs. See emitEntry().
+  using NativeEntry = void (*)(const Slot *args, Slot *result);
+
+  enum Opcode : uint8_t {
+    // push `constant`
+    OP_Const,
+    // push/pop local `operand`: the parameters, then loop variables
+    OP_Load,
+    OP_Store,
+    OP_Pop,
+    // pop two operands of one type, push the result in that type
+    OP_AddF64,
+    OP_AddF32,
+    OP_AddI64,
+    OP_SubF64,
+    OP_SubF32,
+    OP_SubI64,
+    OP_MulF64,
+    OP_MulF32,
+    OP_MulI64,
+    OP_DivF64,
+    OP_DivF32,
+    OP_DivI64,
+    OP_LessF64,
+    OP_LessF32,
+    OP_LessI64,
+    // convert the top operand from type `from` to type `to`
+    OP_Convert,
+    // continue at instruction `operand`; OP_Loop is a loop's back edge
+    OP_Jump,
+    OP_Loop,
+    // pop a condition and jump when it is false
+    OP_JumpIfZeroF64,
+    OP_JumpIfZeroF32,
+    OP_JumpIfZeroI64,
+    // call function `operand` with the arguments on top of the stack
+    OP_Call,
+    // call the function itself and return what it returns
+    OP_TailCall,
+    // call extern `operand` with the f64 arguments on top of the stack
+    OP_CallExtern,
+    OP_Return,
+  };
+
+  struct Instruction {
+    Opcode op;
+    ValueType from = VT_Unknown;
+    ValueType to = VT_Unknown;
+    uint32_t operand = 0;
+    Slot constant = {0};
+  };
+
+  struct Function {
+    FunctionAST *ast;
+    std::string name;
+    // in `functions`
+    uint32_t index;
+    std::vector<Instruction> code;
+    uint32_t params = 0;
+    // parameters and loop variables
+    uint32_t locals = 0;
+    // deepest the operand stack gets
+    uint32_t maxStack = 0;
+    // calls plus loop iterations so far
+    uint64_t heat = 0;
+    std::vector<Function *> callees;
+    // callees that were no def yet when it was lowered, see getCallees()
+    std::vector<Symbol> laterCallees;
+    bool interpretable = true;
+    // generated into a module for the JIT
+    bool generated = false;
+    NativeEntry native = nullptr;
+  };
+
+  struct Extern {
+    void *address;
+    uint32_t params;
+  };
+
+  struct Frame {
+    Function *function;
+    const Instruction *pc;
+    Slot *locals;
+  };
+
+  static constexpr size_t stackSlots = 1 << 20;
+  static constexpr size_t maxFrames = 1 << 16;
+
+  static ValueType slotType(ValueType type) {
+    return type == VT_Unknown ? VT_F64 : type;
+  }
+
+  // one of three opcodes for f64, f32 and i64 in that order
+  static Opcode typed(Opcode f64, ValueType type) {
+    switch (slotType(type)) {
+    case VT_F32:
+      return Opcode(f64 + 1);
+    case VT_I64:
+      return Opcode(f64 + 2);
+    default:
+      return f64;
+    }
+  }
+
+  // Lowers one function body, keeping track of the operand stack depth.
+  struct Lowering {
+    Interpreter &interpreter;
+    Function &function;
+    // slot + 1 of every name in scope
+    SymbolMap<uint32_t> scope;
+    uint32_t depth = 0;
+
+    size_t emit(Instruction instruction, int stackEffect) {
+      depth += stackEffect;
+      function.maxStack = std::max(function.maxStack, depth);
+      function.code.push_back(instruction);
+      return function.code.size() - 1;
+    }
+
+    void patch(size_t jump) { function.code[jump].operand = here(); }
+    uint32_t here() const { return uint32_t(function.code.size()); }
+
+    void lower(ExpressAST *e, bool tail) {
+      switch (e->getKind()) {
+      case ExpressAST::EK_Number: {
+        double value = llvm::cast<NumberExpressionAST>(e)->value;
+        Instruction instruction{OP_Const};
+        switch (slotType(e->getType())) {
+        case VT_I64:
+          instruction.constant.i64 = int64_t(value);
+          break;
+        case VT_F32:
+          instruction.constant.f32 = float(value);
+          break;
+        default:
+          instruction.constant.f64 = value;
+          break;
+        }
+        emit(instruction, 1);
+        return;
+      }
+      case ExpressAST::EK_Variable: {
+        auto *variable = llvm::cast<VariableExprAST>(e);
+        uint32_t slot = scope.lookup(variable->getSymbol());
+        if (!slot) {
+          throw std::runtime_error("no value for name=" +
+                                   variable->getName().str());
+        }
+        emit({OP_Load, VT_Unknown, VT_Unknown, slot - 1}, 1);
+        return;
+      }
+      case ExpressAST::EK_Binary: {
+        auto *binary = llvm::cast<BinaryExprAST>(e);
+        if (binary->getOperatorFunction()) {
+          lowerCall(binary->getOperatorFunction(),
+                    {binary->getLHS(), binary->getRHS()}, tail);
+          return;
+        }
+        lower(binary->getLHS(), false);
+        lower(binary->getRHS(), false);
+        emit({typed(getOpcode(binary->getOp()), e->getType())}, -1);
+        return;
+      }
+      case ExpressAST::EK_Call: {
+        auto *call = llvm::cast<CallExprAST>(e);
+        lowerCall(call->getCalleeSymbol(), call->getArgs(), tail);
+        return;
+      }
+      case ExpressAST::EK_Unary: {
+        auto *unary = llvm::cast<UnaryExprAST>(e);
+        lowerCall(unary->getOperatorFunction(), {unary->getOperand()}, tail);
+        return;
+      }
+      case ExpressAST::EK_If: {
+        auto *ifExpression = llvm::cast<IfExprAST>(e);
+        lower(ifExpression->getCond(), false);
+        size_t toElse =
+            emit({typed(OP_JumpIfZeroF64, ifExpression->getCond()->getType())},
+                 -1);
+        lower(ifExpression->getThen(), tail);
+        size_t toEnd = emit({OP_Jump}, 0);
+        // the else arm pushes its value in place of the then arm's
+        depth--;
+        patch(toElse);
+        lower(ifExpression->getElse(), tail);
+        patch(toEnd);
+        return;
+      }
+      case ExpressAST::EK_For:
+        lowerFor(llvm::cast<ForExprAST>(e));
+        return;
+      case ExpressAST::EK_Cast: {
+        auto *cast = llvm::cast<CastExprAST>(e);
+        lower(cast->getOperand(), false);
+        convert(cast->getOperand()->getType(), cast->getType());
+        return;
+      }
+      }
+    }
+
+    void convert(ValueType from, ValueType to) {
+      from = slotType(from);
+      to = slotType(to);
+      if (from != to) {
+        emit({OP_Convert, from, to}, 0);
+      }
+    }
+
+    static Opcode getOpcode(char op) {
+      switch (op) {
+      case '+':
+        return OP_AddF64;
+      case '-':
+        return OP_SubF64;
+      case '*':
+        return OP_MulF64;
+      case '/':
+        return OP_DivF64;
+      case '<':
+        return OP_LessF64;
+      default:
+        throw std::runtime_error("illegal op");
+      }
+    }
+
+    // The same evaluation order as ForExprAST::codegen: the body, the step
+    // and the end condition all see the variable's value before the step.
+    void lowerFor(ForExprAST *loop) {
+      ValueType type = slotType(loop->getStart()->getType());
+      lower(loop->getStart(), false);
+      uint32_t slot = function.locals++;
+      emit({OP_Store, VT_Unknown, VT_Unknown, slot}, -1);
+      uint32_t outer = scope.lookup(loop->getVarSymbol());
+      scope.set(loop->getVarSymbol(), slot + 1);
+
+      uint32_t start = here();
+      lower(loop->getBody(), false);
+      emit({OP_Pop}, -1);
+      emit({OP_Load, VT_Unknown, VT_Unknown, slot}, 1);
+      if (loop->getStep()) {
+        lower(loop->getStep(), false);
+      } else {
+        Instruction one{OP_Const};
+        if (type == VT_I64) {
+          one.constant.i64 = 1;
+        } else if (type == VT_F32) {
+          one.constant.f32 = 1;
+        } else {
+          one.constant.f64 = 1;
+        }
+        emit(one, 1);
+      }
+      emit({typed(OP_AddF64, type)}, -1);
+      lower(loop->getEnd(), false);
+      size_t toAfter =
+          emit({typed(OP_JumpIfZeroF64, loop->getEnd()->getType())}, -1);
+      emit({OP_Store, VT_Unknown, VT_Unknown, slot}, -1);
+      emit({OP_Loop, VT_Unknown, VT_Unknown, start}, 0);
+      // the next value is still on the stack here
+      depth++;
+      patch(toAfter);
+      emit({OP_Pop}, -1);
+
+      if (outer) {
+        scope.set(loop->getVarSymbol(), outer);
+      } else {
+        scope.erase(loop->getVarSymbol());
+      }
+      Instruction zero{OP_Const};
+      zero.constant.f64 = 0;
+      emit(zero, 1);
+    }
+
+    void lowerCall(Symbol callee, llvm::ArrayRef<ExpressAST *> args,
+                   bool tail) {
+      for (auto *arg : args) {
+        lower(arg, false);
+      }
+      int stackEffect = 1 - int(args.size());
+      if (callee == function.ast->getProto()->getSymbol()) {
+        emit({tail ? OP_TailCall : OP_Call, VT_Unknown, VT_Unknown,
+              function.index},
+             stackEffect);
+        return;
+      }
+      if (Function *def = interpreter.functionsByName.lookup(callee)) {
+        function.callees.push_back(def);
+        emit({OP_Call, VT_Unknown, VT_Unknown, def->index}, stackEffect);
+        return;
+      }
+      uint32_t index = 0;
+      if (!interpreter.resolveExtern(callee, index)) {
+        // lowering goes on for the callees the JIT will need
+        function.interpretable = false;
+        function.laterCallees.push_back(callee);
+      }
+      emit({OP_CallExtern, VT_Unknown, VT_Unknown, index}, stackEffect);
+    }
+  };
+
+  // Type `def` as codegen would and lower it. A def the interpreter cannot
+  // run is kept for the JIT.
+  Function &lower(FunctionAST *def) {
+    PrototypeAST *proto = def->getProto();
+    session.FunctionProtos.set(proto->getSymbol(), proto);
+    ValueType bodyType = inferFunctionTypes(session, proto, def->getBody());
+
+    auto function = std::make_unique<Function>();
+    function->ast = def;
+    function->name = proto->getName().str();
+    function->index = uint32_t(functions.size());
+    function->params = function->locals = uint32_t(proto->getArgs().size());
+    functions.push_back(std::move(function));
+    Function &lowered = *functions.back();
+    Lowering lowering{*this, lowered, {}};
+    for (uint32_t i = 0; i < lowered.params; i++) {
+      lowering.scope.set(proto->getArgs()[i], i + 1);
+    }
+    try {
+      // a conversion on return leaves no call in tail position
+      bool tail = bodyType == proto->getReturnType();
+      lowering.lower(def->getBody(), tail);
+      lowering.convert(bodyType, proto->getReturnType());
+      lowering.emit({OP_Return}, -1);
+    } catch (...) {
+      functions.pop_back();
+      throw;
+    }
+    if (!lowered.interpretable) {
+      lowered.code.clear();
+    }
+    return lowered;
+  }
+
+  // Whether the interpreter can call extern `name`, and under what index.
+  bool resolveExtern(Symbol name, uint32_t &index) {
+    if (const uint32_t *found = externsByName.find(name)) {
+      index = *found;
+      return true;
+    }
+    PrototypeAST *proto = session.FunctionProtos.lookup(name);
+    if (!proto) {
+      throw std::runtime_error("cannot find callee " + name.getName().str());
+    }
+    bool callable = proto->getArgs().size() <= 4 &&
+                    slotType(proto->getReturnType()) == VT_F64;
+    for (ValueType type : proto->getArgTypes()) {
+      callable &= slotType(type) == VT_F64;
+    }
+    if (!callable) {
+      return false;
+    }
+    if (externs.empty()) {
+      // the symbols of the process itself, as the JIT's dylibs see them
+      llvm::sys::DynamicLibrary::LoadLibraryPermanently(nullptr);
+    }
+    void *address = llvm::sys::DynamicLibrary::SearchForAddressOfSymbol(
+        name.getName().str());
+    if (!address) {
+      // for the JIT to report
+      return false;
+    }
+    index = uint32_t(externs.size());
+    externs.push_back({address, uint32_t(proto->getArgs().size())});
+    externsByName.set(name, index);
+    return true;
+  }
+
+  static double callExtern(const Extern &callee, const Slot *args) {
+    switch (callee.params) {
+    case 0:
+      return ((double (*)())callee.address)();
+    case 1:
+      return ((double (*)(double))callee.address)(args[0].f64);
+    case 2:
+      return ((double (*)(double, double))callee.address)(args[0].f64,
+                                                          args[1].f64);
+    case 3:
+      return ((double (*)(double, double, double))callee.address)(
+          args[0].f64, args[1].f64, args[2].f64);
+    default:
+      return ((double (*)(double, double, double, double))callee.address)(
+          args[0].f64, args[1].f64, args[2].f64, args[3].f64);
+    }
+  }
+
+  static void convert(Slot &value, ValueType from, ValueType to) {
+    double wide = from == VT_I64   ? double(value.i64)
+                  : from == VT_F32 ? double(value.f32)
+                                   : value.f64;
+    if (to == VT_I64) {
+      value.i64 = from == VT_I64 ? value.i64 : int64_t(wide);
+    } else if (to == VT_F32) {
+      value.f32 = from == VT_I64 ? float(value.i64) : float(wide);
+    } else {
+      value.f64 = wide;
+    }
+  }
+
+  // whether a call of `function` should go to machine code, compiling it
+  // first if it is hot
+  bool callsNative(Function &function) {
+    function.heat++;
+    if (!function.native &&
+        (!function.interpretable ||
+         (promoteThreshold && function.heat >= promoteThreshold))) {
+      promote(function);
+    }
+    return function.native != nullptr;
+  }
+
+  Slot execute(Function &entry) {
+    if (stack.empty()) {
+      stack.resize(stackSlots);
+    }
+    Slot *const stackEnd = stack.data() + stack.size();
+    Function *function = &entry;
+    const Instruction *pc = function->code.data();
+    Slot *locals = stack.data();
+    Slot *sp = locals + function->locals;
+    frames.clear();
+    interpretedCalls++;
+
+    while (true) {
+      const Instruction &instruction = *pc++;
+      switch (instruction.op) {
+      case OP_Const:
+        *sp++ = instruction.constant;
+        break;
+      case OP_Load:
+        *sp++ = locals[instruction.operand];
+        break;
+      case OP_Store:
+        locals[instruction.operand] = *--sp;
+        break;
+      case OP_Pop:
+        --sp;
+        break;
+
+#define INTERPRETER_BINARY(OPCODE, FIELD, RESULT)                              \
+  case OPCODE: {                                                               \
+    --sp;                                                                      \
+    auto a = sp[-1].FIELD;                                                     \
+    auto b = sp[0].FIELD;                                                      \
+    sp[-1].FIELD = RESULT;                                                     \
+    break;                                                                     \
+  }
+        INTERPRETER_BINARY(OP_AddF64, f64, a + b)
+        INTERPRETER_BINARY(OP_AddF32, f32, a + b)
+        INTERPRETER_BINARY(OP_AddI64, i64, int64_t(uint64_t(a) + uint64_t(b)))
+        INTERPRETER_BINARY(OP_SubF64, f64, a - b)
+        INTERPRETER_BINARY(OP_SubF32, f32, a - b)
+        INTERPRETER_BINARY(OP_SubI64, i64, int64_t(uint64_t(a) - uint64_t(b)))
+        INTERPRETER_BINARY(OP_MulF64, f64, a * b)
+        INTERPRETER_BINARY(OP_MulF32, f32, a * b)
+        INTERPRETER_BINARY(OP_MulI64, i64, int64_t(uint64_t(a) * uint64_t(b)))
+        INTERPRETER_BINARY(OP_DivF64, f64, a / b)
+        INTERPRETER_BINARY(OP_DivF32, f32, a / b)
+        // unordered or less, as the fcmp ult of compiled code
+        INTERPRETER_BINARY(OP_LessF64, f64, !(a >= b) ? 1.0 : 0.0)
+        INTERPRETER_BINARY(OP_LessF32, f32, !(a >= b) ? 1.0f : 0.0f)
+        INTERPRETER_BINARY(OP_LessI64, i64, a < b ? 1 : 0)
+#undef INTERPRETER_BINARY
+
+      case OP_DivI64: {
+        --sp;
+        int64_t a = sp[-1].i64;
+        int64_t b = sp[0].i64;
+        // a trap in compiled code
+        if (b == 0 || (a == std::numeric_limits<int64_t>::min() && b == -1)) {
+          throw std::runtime_error("integer division by zero or overflow in " +
+                                   function->name);
+        }
+        sp[-1].i64 = a / b;
+        break;
+      }
+      case OP_Convert:
+        convert(sp[-1], instruction.from, instruction.to);
+        break;
+      case OP_Loop:
+        function->heat++;
+        pc = function->code.data() + instruction.operand;
+        break;
+      case OP_Jump:
+        pc = function->code.data() + instruction.operand;
+        break;
+      // any value but zero is true; NaN is not, as the fcmp one of compiled
+      // code
+      case OP_JumpIfZeroF64: {
+        double condition = (--sp)->f64;
+        if (!(condition < 0 || condition > 0)) {
+          pc = function->code.data() + instruction.operand;
+        }
+        break;
+      }
+      case OP_JumpIfZeroF32: {
+        float condition = (--sp)->f32;
+        if (!(condition < 0 || condition > 0)) {
+          pc = function->code.data() + instruction.operand;
+        }
+        break;
+      }
+      case OP_JumpIfZeroI64:
+        if ((--sp)->i64 == 0) {
+          pc = function->code.data() + instruction.operand;
+        }
+        break;
+      case OP_CallExtern: {
+        const Extern &callee = externs[instruction.operand];
+        Slot *args = sp - callee.params;
+        double result = callExtern(callee, args);
+        sp = args;
+        (sp++)->f64 = result;
+        break;
+      }
+      case OP_Call:
+      case OP_TailCall: {
+        Function *callee = functions[instruction.operand].get();
+        Slot *args = sp - callee->params;
+        if (callsNative(*callee)) {
+          Slot result;
+          callee->native(args, &result);
+          sp = args;
+          *sp++ = result;
+          if (instruction.op == OP_TailCall) {
+            // its return follows directly
+            pc = &returnInstruction;
+          }
+          break;
+        }
+        interpretedCalls++;
+        if (instruction.op == OP_TailCall) {
+          std::copy(args, args + callee->params, locals);
+          sp = locals + callee->locals;
+          pc = callee->code.data();
+          break;
+        }
+        if (frames.size() >= maxFrames ||
+            args + callee->locals + callee->maxStack > stackEnd) {
+          throw std::runtime_error("interpreter stack overflow in " +
+                                   callee->name);
+        }
+        frames.push_back({function, pc, locals});
+        function = callee;
+        locals = args;
+        sp = locals + callee->locals;
+        pc = callee->code.data();
+        break;
+      }
+      case OP_Return: {
+        Slot result = sp[-1];
+        if (frames.empty()) {
+          return result;
+        }
+        sp = locals;
+        *sp++ = result;
+        const Frame &caller = frames.back();
+        function = caller.function;
+        pc = caller.pc;
+        locals = caller.locals;
+        frames.pop_back();
+        break;
+      }
+      }
+    }
+  }
+
+  // Generate `function` and every def it calls that has no machine code
+  // yet into the session's module, hand the module to the JIT and call
+  // them through their entries from now on.
+  void promote(Function &function,
+               llvm::orc::ResourceTrackerSP tracker = nullptr) {
+    auto start = Clock::now();
+    getTarget();
+    if (!tracker) {
+      tracker = target.dylib->getDefaultResourceTracker();
+    }
+    std::vector<Function *> generated;
+    generate(function, generated);
+    std::vector<std::string> entries;
+    for (Function *def : generated) {
+      entries.push_back(emitEntry(*def));
+    }
+    if (auto err = target.jit->addModule(session.nextModule(), tracker)) {
+      throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+    auto symbols = target.jit->lookup(*target.dylib, entries);
+    if (!symbols) {
+      throw std::runtime_error(llvm::toString(symbols.takeError()));
+    }
+    for (size_t i = 0; i < generated.size(); i++) {
+      generated[i]->native = reinterpret_cast<NativeEntry>(
+          (*symbols)[target.jit->mangle(entries[i])].getAddress());
+    }
+    auto now = Clock::now();
+    promotions.push_back(
+        {function.name, function.heat,
+         std::chrono::duration<double>(start - created).count(),
+         std::chrono::duration<double>(now - start).count()});
+  }
+
+  const JITTarget &getTarget() {
+    if (!target.jit) {
+      target = getJIT();
+      session.TheModule->setDataLayout(target.jit->getDataLayout());
+    }
+    return target;
+  }
+
+  // The defs `function` calls: those it was lowered against, and those
+  // defined since under the names it could not resolve then, like g after
+  // `extern g(x)`, which may in turn call `function`.
+  std::vector<Function *> getCallees(const Function &function) {
+    std::vector<Function *> callees = function.callees;
+    for (Symbol name : function.laterCallees) {
+      if (Function *def = functionsByName.lookup(name)) {
+        callees.push_back(def);
+      }
+    }
+    return callees;
+  }
+
+  // callees first, so that the purity of each is known to its callers
+  void generate(Function &function, std::vector<Function *> &generated) {
+    if (function.generated || function.native) {
+      return;
+    }
+    function.generated = true;
+    for (Function *callee : getCallees(function)) {
+      generate(*callee, generated);
+    }
+    if (!function.ast->codegen(session)) {
+      throw std::runtime_error("cannot compile " + function.name);
+    }
+    generated.push_back(&function);
+  }
+
+  // `void <name>.interp(i64 *args, i64 *result)`, which calls the def with
+  // the arguments in `args` and stores its result, whatever their types.
+  std::string emitEntry(Function &function) {
+    PrototypeAST *proto = function.ast->getProto();
+    llvm::Function *def = session.ModuleFunctions.lookup(proto->getSymbol());
+    llvm::LLVMContext &context = *session.TheContext;
+    llvm::Type *slotType = llvm::Type::getInt64Ty(context);
+    llvm::Type *slotPointer = slotType->getPointerTo();
+    auto *entryType = llvm::FunctionType::get(
+        llvm::Type::getVoidTy(context), {slotPointer, slotPointer}, false);
+    std::string name = function.name + ".interp";
+    auto *entry =
+        llvm::Function::Create(entryType, llvm::Function::ExternalLinkage,
+                               name, *session.TheModule);
+    llvm::IRBuilder<> builder(
+        llvm::BasicBlock::Create(context, "entry", entry));
+    llvm::Value *args = entry->getArg(0);
+    std::vector<llvm::Value *> values;
+    for (auto &param : def->args()) {
+      llvm::Value *slot =
+          builder.CreateConstGEP1_64(slotType, args, param.getArgNo());
+      values.push_back(builder.CreateLoad(
+          param.getType(),
+          builder.CreateBitCast(slot, param.getType()->getPointerTo())));
+    }
+    llvm::Value *result = builder.CreateCall(def, values);
+    builder.CreateStore(result,
+                        builder.CreateBitCast(
+                            entry->getArg(1),
+                            def->getReturnType()->getPointerTo()));
+    builder.CreateRetVoid();
+    return name;
+  }
+
+  CompilerSession &session;
+  const uint64_t promoteThreshold;
+  JITProvider getJIT;
+  JITTarget target = {nullptr, nullptr};
+  const Clock::time_point created;
+
+  std::vector<std::unique_ptr<Function>> functions;
+  SymbolMap<Function *> functionsByName;
+  std::vector<Extern> externs;
+  SymbolMap<uint32_t> externsByName;
+
+  std::vector<Slot> stack;
+  std::vector<Frame> frames;
+  const Instruction returnInstruction{OP_Return};
+
+  uint64_t interpretedCalls = 0;
+  std::vector<Promotion> promotions;
+};
+
+// Interpret every statement of the session's source: defs are added,
+// externs declared and top-level expressions evaluated. Returns the value of
+// the last expression, 0 if there is none. The AST is kept, since the
+// interpreter runs and compiles from it.
+inline double interpretStatements(CompilerSession &session,
+                                  Interpreter &interpreter) {
+  double value = 0;
+  session.getNextToken();
+  while (session.currentToken != Token::tok_eof) {
+    switch (session.currentToken) {
+    case ';':
+      session.getNextToken();
+      break;
+    case Token::tok_def:
+      interpreter.add(parseFunction(session));
+      break;
+    case Token::tok_extern: {
+      auto ext = parseExtern(session);
+      session.FunctionProtos.set(ext->getSymbol(), ext);
+      break;
+    }
+    default:
+      value = interpreter.evaluate(parseToplevelAST(session));
+      break;
+    }
+  }
+  return value;
+}
+
+#endif
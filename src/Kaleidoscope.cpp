@@ -0,0 +1,248 @@
+#include "Kaleidoscope.hpp"
+#include "AST.hpp"
+#include "CompilerSession.hpp"
+#include "HostTarget.hpp"
+#include "KaleidoscopeJIT.hpp"
+#include "Parser.hpp"
+#include <atomic>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/Type.h>
+#include <llvm/Support/raw_ostream.h>
+#include <stdexcept>
+#include <utility>
+
+namespace kaleidoscope {
+
+const char *getTypeName(Type type) {
+  switch (type) {
+  case Type::F64:
+    return "f64";
+  case Type::F32:
+    return "f32";
+  case Type::I64:
+    return "i64";
+  }
+  return "?";
+}
+
+std::string toString(const Signature &signature) {
+  std::string text = getTypeName(signature.result);
+  text += "(";
+  for (size_t i = 0; i < signature.params.size(); i++) {
+    text += i ? ", " : "";
+    text += getTypeName(signature.params[i]);
+  }
+  return text + ")";
+}
+
+static Type toType(const llvm::Type *type) {
+  if (type->isFloatTy()) {
+    return Type::F32;
+  }
+  if (type->isIntegerTy(64)) {
+    return Type::I64;
+  }
+  return Type::F64;
+}
+
+static Signature getSignature(const llvm::Function &func) {
+  Signature signature;
+  signature.result = toType(func.getReturnType());
+  for (auto &arg : func.args()) {
+    signature.params.push_back(toType(arg.getType()));
+  }
+  return signature;
+}
+
+static const char *anonymousExpression = "__anon_expr";
+
+struct Program::Impl {
+  llvm::orc::KaleidoscopeJIT &jit;
+  llvm::orc::JITDylib &dylib;
+  // every def but the top-level expression, by name
+  std::map<std::string, Signature, std::less<>> signatures;
+  // of every def, resolved once by Engine::compile()
+  std::map<std::string, uintptr_t, std::less<>> addresses;
+
+  Impl(llvm::orc::KaleidoscopeJIT &jit, llvm::orc::JITDylib &dylib)
+      : jit(jit), dylib(dylib) {}
+
+  ~Impl() {
+    if (auto err = jit.getExecutionSession().removeJITDylib(dylib)) {
+      jit.getExecutionSession().reportError(std::move(err));
+    }
+  }
+};
+
+Program::Program(std::unique_ptr<Impl> impl) : impl(std::move(impl)) {}
+Program::Program(Program &&) noexcept = default;
+Program &Program::operator=(Program &&) noexcept = default;
+Program::~Program() = default;
+
+const Signature *Program::getSignature(std::string_view name) const {
+  auto found = impl->signatures.find(name);
+  return found == impl->signatures.end() ? nullptr : &found->second;
+}
+
+const std::map<std::string, Signature, std::less<>> &
+Program::getSignatures() const {
+  return impl->signatures;
+}
+
+bool Program::hasExpression() const {
+  return impl->addresses.count(anonymousExpression) != 0;
+}
+
+double Program::run() const {
+  if (!hasExpression()) {
+    throw std::runtime_error("the program has no top-level expression");
+  }
+  auto expression = reinterpret_cast<double (*)()>(
+      impl->addresses.find(anonymousExpression)->second);
+  return expression();
+}
+
+uintptr_t Program::getAddress(std::string_view name,
+                              const Signature &expected) const {
+  const Signature *signature = getSignature(name);
+  if (!signature) {
+    throw std::runtime_error("no def " + std::string(name));
+  }
+  if (signature->params.size() != expected.params.size()) {
+    throw std::runtime_error(
+        std::string(name) + " takes " +
+        std::to_string(signature->params.size()) + " arguments, not " +
+        std::to_string(expected.params.size()));
+  }
+  if (signature->params != expected.params ||
+      signature->result != expected.result) {
+    throw std::runtime_error(std::string(name) + " is " +
+                             toString(*signature) + ", not " +
+                             toString(expected));
+  }
+  return impl->addresses.find(name)->second;
+}
+
+struct Engine::Impl {
+  std::unique_ptr<llvm::orc::KaleidoscopeJIT> jit;
+  CompileOptions options;
+  // numbers the JITDylibs of the programs, whose names must be unique
+  std::atomic<uint64_t> programs{0};
+};
+
+Engine::Engine(const EngineOptions &options) : impl(std::make_unique<Impl>()) {
+  if (options.optLevel > 3) {
+    throw std::runtime_error("optimization level must be 0 to 3");
+  }
+  llvm::orc::HostTargetOptions host;
+  host.CPU = options.cpu;
+  host.Features = options.features;
+  host.OptLevel = llvm::orc::getCodeGenOptLevel(options.optLevel);
+  auto target = llvm::orc::createHostTargetMachineBuilder(host);
+  if (!target) {
+    throw std::runtime_error(llvm::toString(target.takeError()));
+  }
+
+  llvm::orc::KaleidoscopeJIT::Options jitOptions;
+  jitOptions.CompileThreads = options.compileThreads;
+  jitOptions.Target = *target;
+  auto jit = llvm::orc::KaleidoscopeJIT::Create(jitOptions);
+  if (!jit) {
+    throw std::runtime_error(llvm::toString(jit.takeError()));
+  }
+  impl->jit = std::move(*jit);
+
+  impl->options.optLevel = options.optLevel;
+  // modules the compile threads can share out
+  impl->options.modulePerFunction = options.compileThreads > 0;
+  impl->options.target = std::move(*target);
+}
+
+Engine::~Engine() = default;
+
+Program Engine::compile(std::string_view source, const std::string &name) {
+  llvm::orc::KaleidoscopeJIT &jit = *impl->jit;
+  CompilerSession session(source, name, impl->options);
+  session.TheModule->setDataLayout(jit.getDataLayout());
+  bool hasExpression = false;
+  session.getNextToken();
+  while (session.currentToken != Token::tok_eof) {
+    switch (session.currentToken) {
+    case ';':
+      session.getNextToken();
+      continue;
+    case Token::tok_def: {
+      auto function = parseFunction(session);
+      if (!function || !function->codegen(session)) {
+        throw std::runtime_error(name + ": invalid function definition");
+      }
+      if (impl->options.modulePerFunction) {
+        session.finishModule();
+      }
+      break;
+    }
+    case Token::tok_extern: {
+      auto ext = parseExtern(session);
+      session.FunctionProtos.set(ext->getSymbol(), ext);
+      break;
+    }
+    default: {
+      // each would define __anon_expr
+      if (hasExpression) {
+        throw std::runtime_error(name +
+                                 ": more than one top-level expression");
+      }
+      auto function = parseToplevelAST(session);
+      if (!function || !function->codegen(session)) {
+        throw std::runtime_error(name + ": invalid expression");
+      }
+      hasExpression = true;
+      if (impl->options.modulePerFunction) {
+        session.finishModule();
+      }
+      break;
+    }
+    }
+    session.resetStatementAST();
+  }
+  session.resetAST();
+
+  auto dylib = jit.createJITDylib(std::to_string(impl->programs++) + ":" +
+                                  name);
+  if (!dylib) {
+    throw std::runtime_error(llvm::toString(dylib.takeError()));
+  }
+  // from here on, the program removes the JITDylib again whatever happens
+  auto program = std::make_unique<Program::Impl>(jit, *dylib);
+  std::vector<std::string> definitions;
+  for (auto &module : session.takeModules()) {
+    module.withModuleDo([&](llvm::Module &M) {
+      for (auto &F : M) {
+        if (F.isDeclaration() || F.hasLocalLinkage()) {
+          continue;
+        }
+        definitions.push_back(F.getName().str());
+        if (F.getName() != anonymousExpression) {
+          program->signatures[F.getName().str()] = getSignature(F);
+        }
+      }
+    });
+    if (auto err = jit.addModule(std::move(module),
+                                 dylib->getDefaultResourceTracker())) {
+      throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+  }
+  // one lookup compiles every module, concurrently with compile threads
+  auto symbols = jit.lookup(*dylib, definitions);
+  if (!symbols) {
+    throw std::runtime_error(llvm::toString(symbols.takeError()));
+  }
+  for (auto &definition : definitions) {
+    program->addresses[definition] =
+        uintptr_t((*symbols)[jit.mangle(definition)].getAddress());
+  }
+  return Program(std::move(program));
+}
+
+} // namespace kaleidoscope
@@ -0,0 +1,137 @@
+#ifndef __jesse_kaleidoscope__
+#define __jesse_kaleidoscope__
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// The compiler as a library, for programs that compile source text and call
+// the compiled defs in-process. Link the `kaleidoscope` target; this header
+// needs no LLVM headers.
+//
+//   kaleidoscope::Engine engine;
+//   kaleidoscope::Program program =
+//       engine.compile("def mix(a b) a * 0.25 + b * 0.75;");
+//   auto *mix = program.getFunction<double(double, double)>("mix");
+//   double value = mix(1, 2);
+//
+// compile() compiles every def up front, so getFunction() returns the
+// address of the machine code itself: calling it costs what calling a C
+// function costs, from any number of threads. Errors throw
+// std::runtime_error.
+namespace kaleidoscope {
+
+// the scalar types of the language, f64, f32 and i64; double, float and
+// int64_t in C++
+enum class Type : uint8_t { F64, F32, I64 };
+
+const char *getTypeName(Type type);
+
+struct Signature {
+  Type result = Type::F64;
+  std::vector<Type> params;
+};
+
+// "f64(f64, i64)"
+std::string toString(const Signature &signature);
+
+struct EngineOptions {
+  // optimization level, 0 to 3, as -O
+  unsigned optLevel = 2;
+  // threads compiling the modules of a program; 0 compiles on the thread
+  // calling Engine::compile()
+  unsigned compileThreads = 0;
+  // CPU and extra features to generate code for, as -mcpu and -mattr;
+  // empty is the host CPU with all of its features
+  std::string cpu;
+  std::string features;
+};
+
+namespace detail {
+template <typename T> struct TypeOf {
+  static_assert(sizeof(T) == 0,
+                "parameters and results must be double, float or int64_t");
+};
+template <> struct TypeOf<double> {
+  static constexpr Type value = Type::F64;
+};
+template <> struct TypeOf<float> {
+  static constexpr Type value = Type::F32;
+};
+template <> struct TypeOf<int64_t> {
+  static constexpr Type value = Type::I64;
+};
+
+template <typename F> struct SignatureOf;
+template <typename R, typename... Args> struct SignatureOf<R(Args...)> {
+  static Signature get() {
+    return {TypeOf<R>::value, {TypeOf<Args>::value...}};
+  }
+};
+} // namespace detail
+
+// The compiled defs of one source text, in a namespace of their own: two
+// programs may define the same names. A program must not outlive the
+// Engine that compiled it, and its functions must not be called once it is
+// destroyed.
+class Program {
+public:
+  Program(Program &&) noexcept;
+  Program &operator=(Program &&) noexcept;
+  ~Program();
+
+  // The def `name` as a pointer to F, e.g. double(double, double). Throws
+  // if there is no such def or its parameters or result differ from F's.
+  template <typename F> F *getFunction(std::string_view name) const {
+    static_assert(std::is_function_v<F>,
+                  "getFunction takes a function type, e.g. double(double)");
+    return reinterpret_cast<F *>(
+        getAddress(name, detail::SignatureOf<F>::get()));
+  }
+
+  // null when there is no def `name`
+  const Signature *getSignature(std::string_view name) const;
+  const std::map<std::string, Signature, std::less<>> &getSignatures() const;
+
+  // The program's top-level expression, if it has one, runs as a function
+  // of no arguments returning f64.
+  bool hasExpression() const;
+  double run() const;
+
+private:
+  friend class Engine;
+  struct Impl;
+  explicit Program(std::unique_ptr<Impl> impl);
+
+  uintptr_t getAddress(std::string_view name,
+                       const Signature &expected) const;
+
+  std::unique_ptr<Impl> impl;
+};
+
+// A JIT and the options everything it compiles shares. compile() may be
+// called from several threads at once.
+class Engine {
+public:
+  explicit Engine(const EngineOptions &options = EngineOptions());
+  ~Engine();
+  Engine(const Engine &) = delete;
+  Engine &operator=(const Engine &) = delete;
+
+  // Compile the defs, externs and at most one top-level expression of
+  // `source`. `name` shows up in error messages.
+  Program compile(std::string_view source,
+                  const std::string &name = "program");
+
+private:
+  struct Impl;
+  std::unique_ptr<Impl> impl;
+};
+
+} // namespace kaleidoscope
+
+#endif
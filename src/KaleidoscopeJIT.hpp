@@ -15,8 +15,10 @@
 
 #include "llvm/ADT/StringRef.h"
 #include "llvm/ExecutionEngine/JITSymbol.h"
+#include "llvm/ExecutionEngine/Orc/CompileOnDemandLayer.h"
 #include "llvm/ExecutionEngine/Orc/CompileUtils.h"
 #include "llvm/ExecutionEngine/Orc/Core.h"
+#include "llvm/ExecutionEngine/Orc/EPCIndirectionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
 #include "llvm/ExecutionEngine/Orc/ExecutorProcessControl.h"
 #include "llvm/ExecutionEngine/Orc/IRCompileLayer.h"
@@ -26,34 +28,155 @@
 #include "llvm/IR/DataLayout.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/MC/TargetRegistry.h"
+#include "llvm/Support/ThreadPool.h"
 #include <llvm/Support/TargetSelect.h>
-#include <iostream>
-#include <llvm-c/Target.h>
+#include "CompileTelemetry.hpp"
+#include "HostTarget.hpp"
+#include "ObjectFileCache.hpp"
 #include <memory>
 
 namespace llvm {
 namespace orc {
 
+struct KaleidoscopeJITOptions {
+  // Worker threads materializing (compiling) modules. 0 compiles on the
+  // thread that asks for a symbol.
+  unsigned CompileThreads = 0;
+  // Compile each function on its first call through a lazy stub instead of
+  // when its module is added.
+  bool Lazy = false;
+  // Directory of the persistent object cache. Empty disables the cache.
+  std::string ObjectCacheDir;
+  // Records object emission, linking and symbol lookups when set.
+  CompileTelemetry *Telemetry = nullptr;
+  // What to compile for; by default the host CPU with all of its features
+  // (see createHostTargetMachineBuilder()).
+  Optional<JITTargetMachineBuilder> Target;
+};
+
+// Records every module compiled to an object as an "emit object" phase and
+// the size of the object as code bytes.
+class TelemetryIRCompiler : public IRCompileLayer::IRCompiler {
+public:
+  TelemetryIRCompiler(std::unique_ptr<IRCompiler> Compiler,
+                      CompileTelemetry &Telemetry)
+      : IRCompiler(Compiler->getManglingOptions()),
+        Compiler(std::move(Compiler)), Telemetry(Telemetry) {}
+
+  Expected<std::unique_ptr<MemoryBuffer>> operator()(Module &M) override {
+    TelemetryScope Scope(&Telemetry, "emit object");
+    auto Object = (*Compiler)(M);
+    if (Object)
+      Telemetry.addCount("code bytes", (*Object)->getBufferSize());
+    return Object;
+  }
+
+private:
+  std::unique_ptr<IRCompiler> Compiler;
+  CompileTelemetry &Telemetry;
+};
+
+// Forwards objects to the linking layer, recording the time spent there as
+// a "link" phase: loading, relocating and resolving what is already
+// available. Symbols still being compiled elsewhere are resolved later and
+// not counted.
+class TelemetryObjectLayer : public ObjectLayer {
+public:
+  TelemetryObjectLayer(ExecutionSession &ES, ObjectLayer &Base,
+                       CompileTelemetry *Telemetry)
+      : ObjectLayer(ES), Base(Base), Telemetry(Telemetry) {}
+
+  void emit(std::unique_ptr<MaterializationResponsibility> R,
+            std::unique_ptr<MemoryBuffer> O) override {
+    TelemetryScope Scope(Telemetry, "link");
+    Base.emit(std::move(R), std::move(O));
+  }
+
+private:
+  ObjectLayer &Base;
+  CompileTelemetry *Telemetry;
+};
+
 class KaleidoscopeJIT {
+public:
+  using Options = KaleidoscopeJITOptions;
+
 private:
   std::unique_ptr<ExecutionSession> ES;
+  std::unique_ptr<ThreadPool> CompileThreads;
 
   DataLayout DL;
   MangleAndInterner Mangle;
+  // copy kept for code that optimizes IR for the host, e.g. the vectorizer
+  JITTargetMachineBuilder TMBuilder;
+
+  std::unique_ptr<ObjectFileCache> ObjCache;
+  CompileTelemetry *Telemetry;
 
   RTDyldObjectLinkingLayer ObjectLayer;
+  TelemetryObjectLayer LinkLayer;
   IRCompileLayer CompileLayer;
 
+  // only set up in lazy mode
+  std::unique_ptr<EPCIndirectionUtils> EPCIU;
+  std::unique_ptr<CompileOnDemandLayer> CODLayer;
+
   JITDylib &MainJD;
 
+  static std::unique_ptr<ObjectFileCache>
+  createObjectCache(const JITTargetMachineBuilder &JTMB, const Options &Opts) {
+    if (Opts.ObjectCacheDir.empty())
+      return nullptr;
+    // everything the target machine is built from, since each changes the
+    // object; unset models are -1. The builder does not expose its codegen
+    // level, the machine it builds does.
+    std::string OptLevel = "?";
+    if (auto TM = JITTargetMachineBuilder(JTMB).createTargetMachine())
+      OptLevel = std::to_string(int((*TM)->getOptLevel()));
+    else
+      consumeError(TM.takeError());
+    const auto &CM = JTMB.getCodeModel();
+    const auto &RM = JTMB.getRelocationModel();
+    std::string ConfigKey = JTMB.getTargetTriple().str() + "|" +
+                            JTMB.getCPU() + "|" +
+                            JTMB.getFeatures().getString() + "|O" + OptLevel +
+                            "|cm" + std::to_string(CM ? int(*CM) : -1) +
+                            "|rm" + std::to_string(RM ? int(*RM) : -1);
+    return std::make_unique<ObjectFileCache>(Opts.ObjectCacheDir,
+                                             std::move(ConfigKey));
+  }
+
+  static std::unique_ptr<IRCompileLayer::IRCompiler>
+  createCompiler(JITTargetMachineBuilder JTMB, ObjectCache *Cache,
+                 CompileTelemetry *Telemetry) {
+    auto Compiler =
+        std::make_unique<ConcurrentIRCompiler>(std::move(JTMB), Cache);
+    if (!Telemetry)
+      return Compiler;
+    return std::make_unique<TelemetryIRCompiler>(std::move(Compiler),
+                                                 *Telemetry);
+  }
+
+  static void handleLazyCallThroughError() {
+    errs() << "LazyCallThrough error: Could not find function body";
+    exit(1);
+  }
+
 public:
   KaleidoscopeJIT(std::unique_ptr<ExecutionSession> ES,
-                  JITTargetMachineBuilder JTMB, DataLayout DL)
+                  std::unique_ptr<EPCIndirectionUtils> EPCIU,
+                  JITTargetMachineBuilder JTMB, DataLayout DL,
+                  const Options &Opts = Options())
       : ES(std::move(ES)), DL(std::move(DL)), Mangle(*this->ES, this->DL),
+        TMBuilder(JTMB),
+        ObjCache(createObjectCache(JTMB, Opts)), Telemetry(Opts.Telemetry),
         ObjectLayer(*this->ES,
                     []() { return std::make_unique<SectionMemoryManager>(); }),
-        CompileLayer(*this->ES, ObjectLayer,
-                     std::make_unique<ConcurrentIRCompiler>(std::move(JTMB))),
+        LinkLayer(*this->ES, ObjectLayer, Telemetry),
+        CompileLayer(*this->ES, LinkLayer,
+                     createCompiler(std::move(JTMB), ObjCache.get(),
+                                    Telemetry)),
+        EPCIU(std::move(EPCIU)),
         MainJD(this->ES->createBareJITDylib("<main>")) {
     MainJD.addGenerator(
         cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
@@ -62,59 +185,153 @@ public:
       ObjectLayer.setOverrideObjectFlagsWithResponsibilityFlags(true);
       ObjectLayer.setAutoClaimResponsibilityForObjectSymbols(true);
     }
+    if (Opts.CompileThreads > 0) {
+      CompileThreads = std::make_unique<ThreadPool>(
+          hardware_concurrency(Opts.CompileThreads));
+      this->ES->setDispatchTask([this](std::unique_ptr<Task> T) {
+        // ThreadPool tasks are std::functions and must be copyable.
+        CompileThreads->async([UnownedT = T.release()]() {
+          std::unique_ptr<Task> T(UnownedT);
+          T->run();
+        });
+      });
+    }
+    if (this->EPCIU) {
+      CODLayer = std::make_unique<CompileOnDemandLayer>(
+          *this->ES, CompileLayer, this->EPCIU->getLazyCallThroughManager(),
+          [this] { return this->EPCIU->createIndirectStubsManager(); });
+    }
   }
 
   ~KaleidoscopeJIT() {
+    if (CompileThreads)
+      CompileThreads->wait();
     if (auto Err = ES->endSession())
       ES->reportError(std::move(Err));
+    if (EPCIU)
+      if (auto Err = EPCIU->cleanup())
+        ES->reportError(std::move(Err));
   }
 
-  static Expected<std::unique_ptr<KaleidoscopeJIT>> Create() {
+  static Expected<std::unique_ptr<KaleidoscopeJIT>>
+  Create(const Options &Opts = Options()) {
     auto EPC = SelfExecutorProcessControl::Create();
     if (!EPC)
       return EPC.takeError();
 
     auto ES = std::make_unique<ExecutionSession>(std::move(*EPC));
 
-    auto Triple = ES->getExecutorProcessControl().getTargetTriple();
-    std::cout << Triple.str() << std::endl;
-    // register all targets
-    // LLVMInitializeAllTargetInfos();
-    // LLVMInitializeAllTargets();
-    // LLVMInitializeAllTargetMCs();
-    // LLVMInitializeAllAsmPrinters();
-    // LLVMInitializeAllAsmParsers();
     InitializeNativeTarget();
     InitializeNativeTargetAsmPrinter();
     InitializeNativeTargetAsmParser();
 
-    // TargetRegistry::RegisterTarget(llvm::get);
-
-    JITTargetMachineBuilder JTMB(Triple);
-    std::string ErrMsg;
-    auto *TheTarget = TargetRegistry::lookupTarget("x86_64-unknown-linux-gnu", ErrMsg);
+    Optional<JITTargetMachineBuilder> JTMB = Opts.Target;
+    if (!JTMB) {
+      auto Host = createHostTargetMachineBuilder(HostTargetOptions());
+      if (!Host)
+        return Host.takeError();
+      JTMB = std::move(*Host);
+    }
+    if (JTMB->getTargetTriple() !=
+        ES->getExecutorProcessControl().getTargetTriple())
+      return make_error<StringError>(
+          "cannot run code for " + JTMB->getTargetTriple().str() +
+              " in this process",
+          inconvertibleErrorCode());
 
-    auto DL = JTMB.getDefaultDataLayoutForTarget();
+    auto DL = JTMB->getDefaultDataLayoutForTarget();
     if (!DL)
       return DL.takeError();
 
-    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(JTMB),
-                                             std::move(*DL));
+    std::unique_ptr<EPCIndirectionUtils> EPCIU;
+    if (Opts.Lazy) {
+      auto Utils = EPCIndirectionUtils::Create(ES->getExecutorProcessControl());
+      if (!Utils)
+        return Utils.takeError();
+      EPCIU = std::move(*Utils);
+      EPCIU->createLazyCallThroughManager(
+          *ES, pointerToJITTargetAddress(&handleLazyCallThroughError));
+      if (auto Err = setUpInProcessLCTMReentryViaEPCIU(*EPCIU))
+        return Err;
+    }
+
+    return std::make_unique<KaleidoscopeJIT>(std::move(ES), std::move(EPCIU),
+                                             std::move(*JTMB), std::move(*DL),
+                                             Opts);
   }
 
   const DataLayout &getDataLayout() const { return DL; }
 
+  ExecutionSession &getExecutionSession() { return *ES; }
+
+  SymbolStringPtr mangle(StringRef Name) { return Mangle(Name); }
+
+  // A target machine matching the one the JIT compiles for.
+  Expected<std::unique_ptr<TargetMachine>> createTargetMachine() {
+    return TMBuilder.createTargetMachine();
+  }
+
+  const JITTargetMachineBuilder &getTargetMachineBuilder() const {
+    return TMBuilder;
+  }
+
   JITDylib &getMainJITDylib() { return MainJD; }
 
+  // The layer addModule() adds to, for materialization units that compile
+  // IR of their own.
+  IRLayer &getIRLayer() {
+    if (CODLayer)
+      return *CODLayer;
+    return CompileLayer;
+  }
+
+  // Called with every object the JIT loads; replaces any earlier callback.
+  void setNotifyLoaded(RTDyldObjectLinkingLayer::NotifyLoadedFunction F) {
+    ObjectLayer.setNotifyLoaded(std::move(F));
+  }
+
+  // null unless Options::ObjectCacheDir was set
+  const ObjectFileCache *getObjectCache() const { return ObjCache.get(); }
+
   Error addModule(ThreadSafeModule TSM, ResourceTrackerSP RT = nullptr) {
     if (!RT)
       RT = MainJD.getDefaultResourceTracker();
+    if (CODLayer)
+      return CODLayer->add(RT, std::move(TSM));
     return CompileLayer.add(RT, std::move(TSM));
   }
 
   Expected<JITEvaluatedSymbol> lookup(StringRef Name) {
+    TelemetryScope Scope(Telemetry, "lookup");
     return ES->lookup({&MainJD}, Mangle(Name.str()));
   }
+
+  // A separate dylib for an independently compiled script, so that scripts
+  // compiled concurrently can reuse the same symbol names.
+  Expected<JITDylib &> createJITDylib(StringRef Name) {
+    auto JD = ES->createJITDylib(Name.str());
+    if (!JD)
+      return JD.takeError();
+    JD->addGenerator(
+        cantFail(DynamicLibrarySearchGenerator::GetForCurrentProcess(
+            DL.getGlobalPrefix())));
+    return JD;
+  }
+
+  Expected<JITEvaluatedSymbol> lookup(JITDylib &JD, StringRef Name) {
+    TelemetryScope Scope(Telemetry, "lookup");
+    return ES->lookup({&JD}, Mangle(Name.str()));
+  }
+
+  // Look up many symbols with one query, so all of their modules are handed
+  // to the compile threads together instead of one dependency at a time.
+  Expected<SymbolMap> lookup(JITDylib &JD, ArrayRef<std::string> Names) {
+    TelemetryScope Scope(Telemetry, "lookup");
+    SymbolLookupSet Symbols;
+    for (auto &Name : Names)
+      Symbols.add(Mangle(Name));
+    return ES->lookup(makeJITDylibSearchOrder(&JD), std::move(Symbols));
+  }
 };
 
 } // end namespace orc
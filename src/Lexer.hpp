@@ -0,0 +1,136 @@
+#ifndef __jesse_lexer__
+#define __jesse_lexer__
+
+#include "SymbolTable.hpp"
+#include "Token.hpp"
+#include <charconv>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// A token produced by Lexer. `text` is a span into the source buffer, so the
+// buffer must outlive every token taken from it.
+struct LexToken {
+  int kind = Token::tok_eof; // Token enum value, or the character itself
+  std::string_view text;
+  double number = 0;
+  // the interned identifier, when the lexer has a SymbolTable
+  Symbol symbol;
+};
+
+// Zero-copy lexer working directly over a contiguous buffer (a std::string,
+// a string literal or a mmap'd llvm::MemoryBuffer). End of buffer is EOF.
+//
+// Given a SymbolTable, every identifier is interned as it is scanned, so the
+// parser never looks at its characters again, and keywords are told apart
+// by the same lookup.
+class Lexer {
+public:
+  explicit Lexer(std::string_view source, SymbolTable *symbols = nullptr)
+      : begin(source.data()), cursor(source.data()),
+        end(source.data() + source.size()), symbols(symbols) {}
+
+  // step to the next token and return its kind
+  int next() {
+    skipSpaceAndComments();
+    const char *start = cursor;
+    if (cursor == end) {
+      return set(Token::tok_eof, start);
+    }
+
+    unsigned char c = *cursor;
+    if (isalpha(c)) { // [a-zA-Z][a-zA-Z0-9]*
+      ++cursor;
+      while (cursor != end && isalnum(static_cast<unsigned char>(*cursor))) {
+        ++cursor;
+      }
+      if (symbols) {
+        token.symbol = symbols->intern(llvm::StringRef(start, cursor - start));
+        return set(token.symbol.getToken(), start);
+      }
+      std::string_view word(start, cursor - start);
+      if (word == "def") {
+        return set(Token::tok_def, start);
+      }
+      if (word == "extern") {
+        return set(Token::tok_extern, start);
+      }
+      if (word == "if") {
+        return set(Token::tok_if, start);
+      }
+      if (word == "then") {
+        return set(Token::tok_then, start);
+      }
+      if (word == "else") {
+        return set(Token::tok_else, start);
+      }
+      if (word == "for") {
+        return set(Token::tok_for, start);
+      }
+      if (word == "in") {
+        return set(Token::tok_in, start);
+      }
+      if (word == "binary") {
+        return set(Token::tok_binary, start);
+      }
+      if (word == "unary") {
+        return set(Token::tok_unary, start);
+      }
+      return set(Token::tok_identifier, start);
+    }
+
+    if (isdigit(c) || c == '.') { // [0-9.]+
+      ++cursor;
+      while (cursor != end &&
+             (isdigit(static_cast<unsigned char>(*cursor)) || *cursor == '.')) {
+        ++cursor;
+      }
+      // like strtod, only the longest valid prefix counts ("1.2.3" is 1.2)
+      token.number = 0;
+      std::from_chars(start, cursor, token.number);
+      return set(Token::tok_number, start);
+    }
+
+    ++cursor;
+    return set(c, start);
+  }
+
+  const LexToken &current() const { return token; }
+  int kind() const { return token.kind; }
+  std::string_view text() const { return token.text; }
+  double number() const { return token.number; }
+  Symbol symbol() const { return token.symbol; }
+
+  // byte offset of the current token in the source buffer
+  size_t offset() const { return token.text.data() - begin; }
+
+private:
+  void skipSpaceAndComments() {
+    while (cursor != end) {
+      if (isspace(static_cast<unsigned char>(*cursor))) {
+        ++cursor;
+      } else if (*cursor == '#') {
+        // Comment until end of line.
+        while (cursor != end && *cursor != '\n' && *cursor != '\r') {
+          ++cursor;
+        }
+      } else {
+        return;
+      }
+    }
+  }
+
+  int set(int kind, const char *start) {
+    token.kind = kind;
+    token.text = std::string_view(start, cursor - start);
+    return kind;
+  }
+
+  const char *begin;
+  const char *cursor;
+  const char *end;
+  SymbolTable *symbols;
+  LexToken token;
+};
+
+#endif
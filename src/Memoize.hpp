@@ -0,0 +1,161 @@
+#ifndef __jesse_memoize__
+#define __jesse_memoize__
+
+#include <cstdint>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/ADT/Twine.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/GlobalVariable.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Support/MathExtras.h>
+#include <stdexcept>
+#include <string>
+
+// Names of the globals a memoized function `name` keeps in its module. The
+// counters are exported so the host can read them after a run.
+inline std::string memoTableName(llvm::StringRef name) {
+  return (name + ".memo.table").str();
+}
+inline std::string memoHitsName(llvm::StringRef name) {
+  return (name + ".memo.hits").str();
+}
+inline std::string memoMissesName(llvm::StringRef name) {
+  return (name + ".memo.misses").str();
+}
+
+// The table keys on double arguments and stores a double result.
+inline bool hasMemoizableSignature(const llvm::Function &func) {
+  if (!func.getReturnType()->isDoubleTy()) {
+    return false;
+  }
+  for (auto &arg : func.args()) {
+    if (!arg.getType()->isDoubleTy()) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// Put a direct-mapped cache in front of `func`, whose results must depend on
+// its double arguments only.
+//
+// The body moves to an internal `<name>.uncached`, and `<name>` becomes a
+// wrapper that hashes the argument bits into a table of `tableSize` entries
+// of {valid, value, args...}. A hit returns the cached value, and a miss
+// calls the body and overwrites the slot. Memory is fixed at
+// tableSize * (16 + 8 * arity) bytes per function. Recursive calls in the
+// body go through the wrapper as well. The table is not synchronized, so a
+// memoized function must not run on several threads at once.
+//
+// Returns the wrapper, which has taken over every use of `func`.
+inline llvm::Function *emitMemoWrapper(llvm::Function *func,
+                                       uint64_t tableSize) {
+  if (!llvm::isPowerOf2_64(tableSize)) {
+    throw std::runtime_error("memo table size must be a power of two");
+  }
+  llvm::Module &module = *func->getParent();
+  llvm::LLVMContext &context = module.getContext();
+  std::string name = func->getName().str();
+  unsigned arity = func->arg_size();
+  llvm::Type *doubleTy = llvm::Type::getDoubleTy(context);
+  llvm::Type *int64Ty = llvm::Type::getInt64Ty(context);
+
+  func->setName(name + ".uncached");
+  func->setLinkage(llvm::GlobalValue::InternalLinkage);
+  llvm::Function *wrapper =
+      llvm::Function::Create(func->getFunctionType(),
+                             llvm::Function::ExternalLinkage, name, module);
+  func->replaceAllUsesWith(wrapper);
+
+  auto *entryTy = llvm::StructType::get(
+      context, {int64Ty, doubleTy, llvm::ArrayType::get(int64Ty, arity)});
+  auto *tableTy = llvm::ArrayType::get(entryTy, tableSize);
+  auto *table = new llvm::GlobalVariable(
+      module, tableTy, false, llvm::GlobalValue::ExternalLinkage,
+      llvm::ConstantAggregateZero::get(tableTy), memoTableName(name));
+  auto counter = [&](const std::string &counterName) {
+    return new llvm::GlobalVariable(module, int64Ty, false,
+                                    llvm::GlobalValue::ExternalLinkage,
+                                    llvm::ConstantInt::get(int64Ty, 0),
+                                    counterName);
+  };
+  llvm::GlobalVariable *hits = counter(memoHitsName(name));
+  llvm::GlobalVariable *misses = counter(memoMissesName(name));
+
+  auto *entryBlock = llvm::BasicBlock::Create(context, "entry", wrapper);
+  auto *hitBlock = llvm::BasicBlock::Create(context, "hit", wrapper);
+  auto *missBlock = llvm::BasicBlock::Create(context, "miss", wrapper);
+  llvm::IRBuilder<> builder(entryBlock);
+
+  // FNV-style mix of the raw argument bits; the top bits pick the slot
+  llvm::SmallVector<llvm::Value *, 4> keys;
+  llvm::Value *hash = llvm::ConstantInt::get(int64Ty, 0xcbf29ce484222325ULL);
+  for (auto &arg : wrapper->args()) {
+    llvm::Value *bits = builder.CreateBitCast(&arg, int64Ty);
+    keys.push_back(bits);
+    hash = builder.CreateMul(builder.CreateXor(hash, bits),
+                             llvm::ConstantInt::get(int64Ty,
+                                                    0x9e3779b97f4a7c15ULL));
+  }
+  llvm::Value *slot =
+      tableSize == 1
+          ? llvm::ConstantInt::get(int64Ty, 0)
+          : builder.CreateLShr(hash, 64 - llvm::Log2_64(tableSize), "slot");
+  auto *zero = llvm::ConstantInt::get(builder.getInt32Ty(), 0);
+  auto field = [&](unsigned index) {
+    return builder.CreateInBoundsGEP(
+        tableTy, table,
+        {zero, slot, llvm::ConstantInt::get(builder.getInt32Ty(), index)});
+  };
+  llvm::Value *found = builder.CreateICmpNE(
+      builder.CreateLoad(int64Ty, field(0)),
+      llvm::ConstantInt::get(int64Ty, 0));
+  for (unsigned i = 0; i < arity; i++) {
+    llvm::Value *key = builder.CreateInBoundsGEP(
+        tableTy, table,
+        {zero, slot, llvm::ConstantInt::get(builder.getInt32Ty(), 2),
+         llvm::ConstantInt::get(builder.getInt32Ty(), i)});
+    found = builder.CreateAnd(
+        found, builder.CreateICmpEQ(builder.CreateLoad(int64Ty, key),
+                                    keys[i]));
+  }
+  builder.CreateCondBr(found, hitBlock, missBlock);
+
+  auto increment = [&](llvm::GlobalVariable *count) {
+    builder.CreateStore(
+        builder.CreateAdd(builder.CreateLoad(int64Ty, count),
+                          llvm::ConstantInt::get(int64Ty, 1)),
+        count);
+  };
+
+  builder.SetInsertPoint(hitBlock);
+  increment(hits);
+  builder.CreateRet(builder.CreateLoad(doubleTy, field(1)));
+
+  builder.SetInsertPoint(missBlock);
+  increment(misses);
+  llvm::SmallVector<llvm::Value *, 4> args;
+  for (auto &arg : wrapper->args()) {
+    args.push_back(&arg);
+  }
+  llvm::Value *value = builder.CreateCall(func, args, "value");
+  // the call may have reused the slot; fill it in completely again
+  builder.CreateStore(llvm::ConstantInt::get(int64Ty, 1), field(0));
+  builder.CreateStore(value, field(1));
+  for (unsigned i = 0; i < arity; i++) {
+    builder.CreateStore(
+        keys[i], builder.CreateInBoundsGEP(
+                     tableTy, table,
+                     {zero, slot,
+                      llvm::ConstantInt::get(builder.getInt32Ty(), 2),
+                      llvm::ConstantInt::get(builder.getInt32Ty(), i)}));
+  }
+  builder.CreateRet(value);
+  return wrapper;
+}
+
+#endif
@@ -0,0 +1,98 @@
+#ifndef __jesse_object_file_cache__
+#define __jesse_object_file_cache__
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/ObjectCache.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+namespace llvm {
+namespace orc {
+
+// On-disk object cache shared by every process pointed at the same directory.
+// Objects are keyed by a SHA1 of the module bitcode plus a configuration
+// string (target triple, CPU, features, codegen level, code and relocation
+// model), so changing any of them never returns a stale object.
+class ObjectFileCache : public ObjectCache {
+public:
+  ObjectFileCache(std::string CacheDir, std::string ConfigKey)
+      : CacheDir(std::move(CacheDir)), ConfigKey(std::move(ConfigKey)) {}
+
+  std::unique_ptr<MemoryBuffer> getObject(const Module *M) override {
+    auto Object = MemoryBuffer::getFile(getCachePath(*M), /*IsText=*/false,
+                                        /*RequiresNullTerminator=*/false);
+    if (!Object) {
+      ++Misses;
+      return nullptr;
+    }
+    ++Hits;
+    return std::move(*Object);
+  }
+
+  void notifyObjectCompiled(const Module *M, MemoryBufferRef Obj) override {
+    if (sys::fs::create_directories(CacheDir))
+      return;
+    // Write to a unique temporary and rename it into place, so concurrent
+    // writers (threads or processes) never expose a partial object.
+    std::string Path = getCachePath(*M);
+    int FD;
+    SmallString<128> TempPath;
+    if (sys::fs::createUniqueFile(Path + ".tmp%%%%%%", FD, TempPath))
+      return;
+    {
+      raw_fd_ostream OS(FD, /*shouldClose=*/true);
+      OS << Obj.getBuffer();
+      if (OS.has_error()) {
+        OS.clear_error();
+        sys::fs::remove(TempPath);
+        return;
+      }
+    }
+    if (sys::fs::rename(TempPath, Path))
+      sys::fs::remove(TempPath);
+    else
+      ++Writes;
+  }
+
+  uint64_t getHits() const { return Hits; }
+  uint64_t getMisses() const { return Misses; }
+  uint64_t getWrites() const { return Writes; }
+
+private:
+  std::string getCachePath(const Module &M) const {
+    SmallVector<char, 0> Bitcode;
+    {
+      raw_svector_ostream OS(Bitcode);
+      WriteBitcodeToFile(M, OS);
+    }
+    SHA1 Hasher;
+    Hasher.update(ConfigKey);
+    Hasher.update(StringRef(Bitcode.data(), Bitcode.size()));
+    SmallString<128> Path(CacheDir);
+    sys::path::append(Path, toHex(Hasher.final(), /*LowerCase=*/true) + ".o");
+    return std::string(Path);
+  }
+
+  std::string CacheDir;
+  std::string ConfigKey;
+  std::atomic<uint64_t> Hits{0};
+  std::atomic<uint64_t> Misses{0};
+  std::atomic<uint64_t> Writes{0};
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
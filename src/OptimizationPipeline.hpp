@@ -0,0 +1,207 @@
+#ifndef __jesse_optimization_pipeline__
+#define __jesse_optimization_pipeline__
+
+#include "CompileTelemetry.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Analysis/CGSCCPassManager.h>
+#include <llvm/Analysis/InlineCost.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/Module.h>
+#include <llvm/IR/PassInstrumentation.h>
+#include <llvm/IR/PassManager.h>
+#include <llvm/Passes/PassBuilder.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Target/TargetMachine.h>
+#include <llvm/Transforms/IPO/ElimAvailExtern.h>
+#include <llvm/Transforms/IPO/GlobalDCE.h>
+#include <llvm/Transforms/IPO/Inliner.h>
+#include <llvm/Transforms/IPO/SCCP.h>
+#include <llvm/Transforms/Scalar/TailRecursionElimination.h>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+struct PassTiming {
+  uint64_t runs = 0;
+  double seconds = 0;
+};
+
+// Pipelines built once per session with the new pass manager and reused
+// for everything it compiles. run() optimizes a single function: -O1..-O3
+// run PassBuilder's function simplification pipeline for that level. Every
+// level, -O0 included, ends with tail recursion elimination, so
+// self-recursive tail calls always become loops and never grow the stack.
+//
+// runModule() is the interprocedural pipeline for a whole module at -O1 and
+// up: IPSCCP, then the inliner walking the call graph bottom-up and running
+// the same function pipeline on every function after inlining into it, then
+// dropping available_externally bodies and dead internal functions. Since
+// it simplifies every function anyway, functions of a module that goes
+// through it need no run() of their own. `inlineThreshold` is the
+// inliner's budget per call site; below zero it is the -O level's.
+//
+// With a `targetMachine`, cost decisions (inlining, unrolling, vectorizing,
+// ...) use what that target's CPU has rather than generic costs.
+//
+// With telemetry every pass run is also recorded there as a "pass <name>"
+// phase.
+class OptimizationPipeline {
+public:
+  OptimizationPipeline(unsigned optLevel, bool timePasses,
+                       CompileTelemetry *telemetry = nullptr,
+                       int inlineThreshold = -1,
+                       llvm::TargetMachine *targetMachine = nullptr)
+      : telemetry(telemetry),
+        builder(targetMachine, llvm::PipelineTuningOptions(), llvm::None,
+                timePasses || telemetry ? &callbacks : nullptr) {
+    builder.registerModuleAnalyses(moduleAnalyses);
+    builder.registerCGSCCAnalyses(cgsccAnalyses);
+    builder.registerFunctionAnalyses(functionAnalyses);
+    builder.registerLoopAnalyses(loopAnalyses);
+    builder.crossRegisterProxies(loopAnalyses, functionAnalyses, cgsccAnalyses,
+                                 moduleAnalyses);
+    if (timePasses || telemetry) {
+      registerTimingCallbacks();
+    }
+    passes = buildFunctionPasses(optLevel);
+    if (optLevel > 0) {
+      buildModulePasses(optLevel, inlineThreshold);
+    }
+  }
+
+  OptimizationPipeline(const OptimizationPipeline &) = delete;
+  OptimizationPipeline &operator=(const OptimizationPipeline &) = delete;
+
+  void run(llvm::Function &func) {
+    passes.run(func, functionAnalyses);
+    // analyses are keyed by the IR unit; never keep them past this function
+    functionAnalyses.clear();
+    moduleAnalyses.clear();
+  }
+
+  void runModule(llvm::Module &module) {
+    modulePasses.run(module, moduleAnalyses);
+    loopAnalyses.clear();
+    functionAnalyses.clear();
+    cgsccAnalyses.clear();
+    moduleAnalyses.clear();
+  }
+
+  const llvm::StringMap<PassTiming> &getTimings() const { return timings; }
+
+  // per pass wall time, slowest first
+  void printTimings(llvm::raw_ostream &os) const {
+    std::vector<const llvm::StringMapEntry<PassTiming> *> sorted;
+    double total = 0;
+    for (auto &entry : timings) {
+      sorted.push_back(&entry);
+      total += entry.second.seconds;
+    }
+    std::sort(sorted.begin(), sorted.end(), [](auto *a, auto *b) {
+      return a->second.seconds > b->second.seconds;
+    });
+    os << "pass timing (" << llvm::format("%.3f", total * 1000) << " ms):\n";
+    for (auto *entry : sorted) {
+      const PassTiming &timing = entry->second;
+      os << llvm::format("  %10.3f ms %8llu runs  ", timing.seconds * 1000,
+                         (unsigned long long)timing.runs)
+         << entry->getKey() << "\n";
+    }
+  }
+
+  static llvm::OptimizationLevel toOptimizationLevel(unsigned optLevel) {
+    switch (optLevel) {
+    case 0:
+      return llvm::OptimizationLevel::O0;
+    case 1:
+      return llvm::OptimizationLevel::O1;
+    case 2:
+      return llvm::OptimizationLevel::O2;
+    case 3:
+      return llvm::OptimizationLevel::O3;
+    default:
+      throw std::runtime_error("optimization level must be 0 to 3");
+    }
+  }
+
+private:
+  using Clock = std::chrono::steady_clock;
+
+  // Only leaf passes are timed; pass managers and adaptors would count the
+  // time of the passes they contain a second time.
+  static bool isContainer(llvm::StringRef pass) {
+    return llvm::isSpecialPass(pass, {"PassManager", "PassAdaptor"});
+  }
+
+  llvm::FunctionPassManager buildFunctionPasses(unsigned optLevel) {
+    llvm::FunctionPassManager functionPasses;
+    if (optLevel > 0) {
+      functionPasses = builder.buildFunctionSimplificationPipeline(
+          toOptimizationLevel(optLevel), llvm::ThinOrFullLTOPhase::None);
+    }
+    functionPasses.addPass(llvm::TailCallElimPass());
+    return functionPasses;
+  }
+
+  void buildModulePasses(unsigned optLevel, int inlineThreshold) {
+    llvm::ModuleInlinerWrapperPass inliner(
+        inlineThreshold < 0 ? llvm::getInlineParams(optLevel, 0)
+                            : llvm::getInlineParams(inlineThreshold));
+    inliner.getPM().addPass(
+        llvm::createCGSCCToFunctionPassAdaptor(buildFunctionPasses(optLevel)));
+    modulePasses.addPass(llvm::IPSCCPPass());
+    modulePasses.addPass(std::move(inliner));
+    modulePasses.addPass(llvm::EliminateAvailableExternallyPass());
+    modulePasses.addPass(llvm::GlobalDCEPass());
+  }
+
+  void registerTimingCallbacks() {
+    callbacks.registerBeforeNonSkippedPassCallback(
+        [this](llvm::StringRef pass, llvm::Any) {
+          if (!isContainer(pass)) {
+            started.push_back(Clock::now());
+          }
+        });
+    auto finished = [this](llvm::StringRef pass) {
+      if (isContainer(pass) || started.empty()) {
+        return;
+      }
+      Clock::time_point now = Clock::now();
+      PassTiming &timing = timings[pass];
+      timing.runs++;
+      timing.seconds +=
+          std::chrono::duration<double>(now - started.back()).count();
+      if (telemetry) {
+        telemetry->recordPhase(("pass " + pass).str(), started.back(), now);
+      }
+      started.pop_back();
+    };
+    callbacks.registerAfterPassCallback(
+        [finished](llvm::StringRef pass, llvm::Any,
+                   const llvm::PreservedAnalyses &) { finished(pass); });
+    callbacks.registerAfterPassInvalidatedCallback(
+        [finished](llvm::StringRef pass, const llvm::PreservedAnalyses &) {
+          finished(pass);
+        });
+  }
+
+  CompileTelemetry *telemetry;
+  llvm::PassInstrumentationCallbacks callbacks;
+  llvm::PassBuilder builder;
+  llvm::LoopAnalysisManager loopAnalyses;
+  llvm::FunctionAnalysisManager functionAnalyses;
+  llvm::CGSCCAnalysisManager cgsccAnalyses;
+  llvm::ModuleAnalysisManager moduleAnalyses;
+  llvm::FunctionPassManager passes;
+  llvm::ModulePassManager modulePasses;
+
+  llvm::StringMap<PassTiming> timings;
+  std::vector<Clock::time_point> started;
+};
+
+#endif
@@ -0,0 +1,412 @@
+#ifndef __jesse_parser__
+#define __jesse_parser__
+
+#include "AST.hpp"
+#include "CompilerSession.hpp"
+#include <llvm/ADT/ArrayRef.h>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringRef.h>
+#include <stdexcept>
+
+// annotation ::= ':' ('f64' | 'f32' | 'i64')
+//
+// Returns VT_Unknown, consuming nothing, when there is no annotation.
+inline ValueType parseTypeAnnotation(CompilerSession &session) {
+  if (session.currentToken != ':') {
+    return VT_Unknown;
+  }
+  ValueType type = VT_Unknown;
+  if (session.getNextToken() == Token::tok_identifier) {
+    type = parseValueType(session.lexer.symbol().getName());
+  }
+  if (type == VT_Unknown) {
+    throw std::runtime_error("Expected f64, f32 or i64 after ':'");
+  }
+  session.getNextToken();
+  return type;
+}
+
+// numberexpr ::= number annotation?
+inline ExpressAST *parseNumberExpression(CompilerSession &session) {
+  double value = session.lexer.number();
+  session.getNextToken(); // consumed this number token
+  return session.ast->create<NumberExpressionAST>(
+      value, parseTypeAnnotation(session));
+}
+
+// A character token that can name a user-defined operator. ':' is taken by
+// type annotations.
+inline bool isOperatorToken(int token) {
+  return token > 0 && token < 128 && ispunct(token) && token != '(' &&
+         token != ')' && token != ',' && token != ';' && token != '#' &&
+         token != ':';
+}
+
+// prototype ::= identifier '(' parameter* ')' annotation?
+//           ::= 'unary' op '(' parameter ')' annotation?
+//           ::= 'binary' op number? '(' parameter parameter ')' annotation?
+// parameter ::= identifier annotation?
+//
+// f64, f32 and i64 are reserved for conversions and cannot name a def or
+// an extern. Parameters default to f64. A def without a return annotation
+// gets the type of its body; see inferFunctionTypes().
+//
+// An operator is usable as soon as its prototype is parsed, so its own body
+// can use it.
+inline PrototypeAST *parsePrototype(CompilerSession &session) {
+  ASTContext &declarations = session.declarations;
+  Symbol functionName;
+  auto kind = PrototypeAST::PK_Function;
+  int op = 0;
+  int precedence = PrecedenceParser::defaultUserPrecedence;
+  switch (session.currentToken) {
+  case Token::tok_identifier:
+    functionName = session.lexer.symbol();
+    // f64(x) and the like always parse as conversions, so a def of that
+    // name could never be called
+    if (parseValueType(functionName.getName())) {
+      throw std::runtime_error(functionName.getName().str() +
+                               " is a type and cannot name a function");
+    }
+    session.getNextToken();
+    break;
+  case Token::tok_unary:
+  case Token::tok_binary: {
+    bool unary = session.currentToken == Token::tok_unary;
+    kind = unary ? PrototypeAST::PK_Unary : PrototypeAST::PK_Binary;
+    op = session.getNextToken();
+    if (!isOperatorToken(op)) {
+      throw std::runtime_error("Expected operator character after " +
+                               std::string(unary ? "unary" : "binary"));
+    }
+    if (!unary && PrecedenceParser::isBuiltinOperator(op)) {
+      throw std::runtime_error(std::string("cannot redefine operator ") +
+                               char(op));
+    }
+    functionName = session.symbols.intern(
+        (unary ? "unary" : "binary") + std::string(1, char(op)));
+    session.getNextToken();
+    if (!unary && session.currentToken == Token::tok_number) {
+      double value = session.lexer.number();
+      if (value != int(value) || value < PrecedenceParser::minPrecedence ||
+          value > PrecedenceParser::maxPrecedence) {
+        throw std::runtime_error("operator precedence must be an integer "
+                                 "from 1 to 100");
+      }
+      precedence = int(value);
+      session.getNextToken();
+    }
+    break;
+  }
+  default:
+    throw std::runtime_error("function define must have identifier");
+  }
+
+  if (session.currentToken != '(') {
+    throw std::runtime_error("Expected '(' in prototype");
+  }
+
+  llvm::SmallVector<Symbol, 8> argNames;
+  llvm::SmallVector<ValueType, 8> argTypes;
+  session.getNextToken();
+  while (session.currentToken == Token::tok_identifier) {
+    argNames.push_back(session.lexer.symbol());
+    session.getNextToken();
+    ValueType type = parseTypeAnnotation(session);
+    argTypes.push_back(type == VT_Unknown ? VT_F64 : type);
+  }
+
+  if (session.currentToken != ')') {
+    throw std::runtime_error("Expected ')' in prototype");
+  }
+  session.getNextToken();
+  ValueType returnType = parseTypeAnnotation(session);
+  if (kind == PrototypeAST::PK_Unary) {
+    if (argNames.size() != 1) {
+      throw std::runtime_error("a unary operator takes one operand");
+    }
+    session.precedenceParser.addUnaryOperator(op, functionName);
+  } else if (kind == PrototypeAST::PK_Binary) {
+    if (argNames.size() != 2) {
+      throw std::runtime_error("a binary operator takes two operands");
+    }
+    session.precedenceParser.addBinaryOperator(op, precedence, functionName);
+  }
+  return declarations.create<PrototypeAST>(
+      functionName, declarations.copyArray<Symbol>(argNames),
+      declarations.copyArray<ValueType>(argTypes), returnType, kind);
+}
+
+inline ExpressAST *parseExpression(CompilerSession &session);
+
+// Run `parse` on a top-level statement as a "parse" phase of the session's
+// telemetry, counting the AST nodes it creates.
+template <typename F>
+inline auto parseStatement(CompilerSession &session, F &&parse) {
+  CompileTelemetry *telemetry = session.options.telemetry;
+  if (!telemetry) {
+    return parse();
+  }
+  auto nodeCount = [&session]() {
+    return session.ast->getNodeCount() + session.declarations.getNodeCount();
+  };
+  size_t nodesBefore = nodeCount();
+  TelemetryScope scope(telemetry, "parse");
+  auto result = parse();
+  telemetry->addCount("AST nodes", nodeCount() - nodesBefore);
+  return result;
+}
+
+inline FunctionAST *parseFunction(CompilerSession &session) {
+  return parseStatement(session, [&session]() -> FunctionAST * {
+    session.getNextToken();
+    auto prototype = parsePrototype(session);
+    if (auto expression = parseExpression(session)) {
+      return session.ast->create<FunctionAST>(prototype, expression);
+    }
+    return nullptr;
+  });
+}
+
+// An extern has no body to infer from, so it returns f64 unless annotated.
+inline PrototypeAST *parseExtern(CompilerSession &session) {
+  return parseStatement(session, [&session]() {
+    session.getNextToken(); // eat extern
+    PrototypeAST *prototype = parsePrototype(session);
+    if (prototype->getReturnType() == VT_Unknown) {
+      prototype->setReturnType(VT_F64);
+    }
+    return prototype;
+  });
+}
+
+inline FunctionAST *parseToplevelAST(CompilerSession &session) {
+  return parseStatement(session, [&session]() -> FunctionAST * {
+    auto expression = parseExpression(session);
+    if (!expression) {
+      return nullptr;
+    }
+    // one prototype shared by every top-level expression of the session;
+    // it returns f64 whatever the type of the expression, which is what the
+    // callers of __anon_expr expect
+    if (!session.anonymousPrototype) {
+      session.anonymousPrototype = session.declarations.create<PrototypeAST>(
+          session.symbols.intern("__anon_expr"), llvm::ArrayRef<Symbol>(),
+          llvm::ArrayRef<ValueType>(), VT_F64);
+    }
+    return session.ast->create<FunctionAST>(session.anonymousPrototype,
+                                            expression);
+  });
+}
+
+inline ExpressAST *parseIdentifierExpression(CompilerSession &session);
+inline ExpressAST *parseParenExpression(CompilerSession &session);
+inline ExpressAST *parseIfExpression(CompilerSession &session);
+inline ExpressAST *parseForExpression(CompilerSession &session);
+
+inline ExpressAST *parsePrimary(CompilerSession &session) {
+  switch (session.currentToken) {
+  case Token::tok_identifier:
+    return parseIdentifierExpression(session);
+  case Token::tok_number:
+    return parseNumberExpression(session);
+  case '(':
+    return parseParenExpression(session);
+  case Token::tok_if:
+    return parseIfExpression(session);
+  case Token::tok_for:
+    return parseForExpression(session);
+  default:
+    return nullptr;
+  }
+}
+
+// identifierexpr ::= identifier
+//                ::= identifier '(' expression* ')'
+//                ::= ('f64' | 'f32' | 'i64') '(' expression ')'
+inline ExpressAST *parseIdentifierExpression(CompilerSession &session) {
+  Symbol identifierName = session.lexer.symbol();
+  session.getNextToken();
+  if (session.currentToken != '(') { // not call, variable expression
+    return session.ast->create<VariableExprAST>(identifierName);
+  } else if (ValueType type = parseValueType(identifierName.getName())) {
+    // conversion
+    session.getNextToken(); // eat (
+    auto operand = parseExpression(session);
+    if (!operand) {
+      return nullptr;
+    }
+    if (session.currentToken != ')') {
+      throw std::runtime_error("Expected ')' after the operand of " +
+                               identifierName.getName().str());
+    }
+    session.getNextToken(); // eat )
+    return session.ast->create<CastExprAST>(type, operand);
+  } else {
+    // call expression
+    session.getNextToken();
+    llvm::SmallVector<ExpressAST *, 8> args;
+    if (session.currentToken != ')') {
+      while (true) {
+        if (auto arg = parseExpression(session)) {
+          args.push_back(arg);
+        } else {
+          return nullptr;
+        }
+
+        if (session.currentToken == ')') {
+          break;
+        }
+
+        if (session.currentToken != ',') {
+          throw std::runtime_error("arguments expression error");
+        }
+        session.getNextToken();
+      }
+    }
+    session.getNextToken(); // eat )
+    return session.ast->create<CallExprAST>(
+        identifierName, session.ast->copyArray<ExpressAST *>(args));
+  }
+}
+
+// parenexpr ::= '(' expression ')'
+inline ExpressAST *parseParenExpression(CompilerSession &session) {
+  session.getNextToken(); // eat (
+  auto v = parseExpression(session);
+  if (!v) {
+    return nullptr;
+  } else {
+    if (session.currentToken != ')') {
+      throw std::runtime_error("incorrect () expression");
+    }
+  }
+  session.getNextToken(); // eat )
+  return v;
+}
+
+// ifexpr ::= 'if' expression 'then' expression 'else' expression
+inline ExpressAST *parseIfExpression(CompilerSession &session) {
+  session.getNextToken(); // eat if
+  auto condition = parseExpression(session);
+  if (!condition) {
+    return nullptr;
+  }
+  if (session.currentToken != Token::tok_then) {
+    throw std::runtime_error("Expected 'then' in if expression");
+  }
+  session.getNextToken();
+  auto thenExpression = parseExpression(session);
+  if (!thenExpression) {
+    return nullptr;
+  }
+  if (session.currentToken != Token::tok_else) {
+    throw std::runtime_error("Expected 'else' in if expression");
+  }
+  session.getNextToken();
+  auto elseExpression = parseExpression(session);
+  if (!elseExpression) {
+    return nullptr;
+  }
+  return session.ast->create<IfExprAST>(condition, thenExpression,
+                                        elseExpression);
+}
+
+// forexpr ::= 'for' identifier '=' expression ',' expression
+//             (',' expression)? 'in' expression
+inline ExpressAST *parseForExpression(CompilerSession &session) {
+  session.getNextToken(); // eat for
+  if (session.currentToken != Token::tok_identifier) {
+    throw std::runtime_error("Expected identifier after for");
+  }
+  Symbol variableName = session.lexer.symbol();
+  if (session.getNextToken() != '=') {
+    throw std::runtime_error("Expected '=' after for variable");
+  }
+  session.getNextToken();
+  auto start = parseExpression(session);
+  if (!start) {
+    return nullptr;
+  }
+  if (session.currentToken != ',') {
+    throw std::runtime_error("Expected ',' after for start value");
+  }
+  session.getNextToken();
+  auto end = parseExpression(session);
+  if (!end) {
+    return nullptr;
+  }
+  ExpressAST *step = nullptr;
+  if (session.currentToken == ',') {
+    session.getNextToken();
+    step = parseExpression(session);
+    if (!step) {
+      return nullptr;
+    }
+  }
+  if (session.currentToken != Token::tok_in) {
+    throw std::runtime_error("Expected 'in' after for");
+  }
+  session.getNextToken();
+  auto body = parseExpression(session);
+  if (!body) {
+    return nullptr;
+  }
+  return session.ast->create<ForExprAST>(variableName, start, end, step, body);
+}
+
+// unary ::= primary | unaryop unary
+inline ExpressAST *parseUnary(CompilerSession &session) {
+  Symbol function =
+      session.precedenceParser.getUnaryFunction(session.currentToken);
+  if (!function) {
+    return parsePrimary(session);
+  }
+  char op = static_cast<char>(session.currentToken);
+  session.getNextToken();
+  auto operand = parseUnary(session);
+  if (!operand) {
+    return nullptr;
+  }
+  return session.ast->create<UnaryExprAST>(op, function, operand);
+}
+
+inline ExpressAST *parseBinaryRHS(int expressionPrecedence, ExpressAST *LHS,
+                                  CompilerSession &session) {
+  while (true) {
+    int currentOperatorPrecedence = session.getTokenPrecedence();
+    if (currentOperatorPrecedence < expressionPrecedence) {
+      // 唯一出口，当当前处理的token不是二元操作符的时候
+      return LHS;
+    }
+
+    int ope = session.currentToken;
+    session.getNextToken();
+    auto RHS = parseUnary(session);
+    if (!RHS) {
+      return nullptr;
+    }
+    int nextOperatorPrecedence = session.getTokenPrecedence();
+    if (currentOperatorPrecedence < nextOperatorPrecedence) {
+      // a+b*c
+      // 如果当前是+下一个是*,
+      // 则将当前的RHS当作下一个操作的LHS进行处理，得到新的RHS
+      // 为了让1+2+3中，1+2成为一个LHS，需要将Current operator precedence调高1
+      RHS = parseBinaryRHS(currentOperatorPrecedence + 1, RHS, session);
+    }
+    LHS = session.ast->create<BinaryExprAST>(
+        static_cast<char>(ope), LHS, RHS,
+        session.precedenceParser.getBinaryFunction(ope));
+  }
+  return nullptr;
+}
+
+inline ExpressAST *parseExpression(CompilerSession &session) {
+  auto LHS = parseUnary(session);
+  if (!LHS) {
+    return nullptr;
+  }
+  return parseBinaryRHS(0, LHS, session);
+}
+
+#endif
@@ -1,32 +1,78 @@
 #ifndef __jesse_precedence__
 #define __jesse_precedence__
 
+#include "SymbolTable.hpp"
+#include <array>
+#include <cstdint>
 
-#include <cctype>
-#include <unordered_map>
+// binary operator precedence by character token, -1 for none
+using OperatorPrecedenceTable = std::array<int8_t, 256>;
 
-class PrecedenceParser {
+constexpr OperatorPrecedenceTable makeBuiltinOperatorPrecedence() {
+  OperatorPrecedenceTable table{};
+  for (auto &precedence : table) {
+    precedence = -1;
+  }
+  table['<'] = 10;
+  table['+'] = 20;
+  table['-'] = 20;
+  table['*'] = 40;
+  table['/'] = 40;
+  return table;
+}
 
+inline constexpr OperatorPrecedenceTable builtinOperatorPrecedence =
+    makeBuiltinOperatorPrecedence();
+
+// Operator table indexed directly by the character token, so looking up the
+// token in parseBinaryRHS is a bounds check and a load. The built-in
+// operators are a constexpr image that every table starts from; operators
+// declared with `def binary<c> <precedence>` or `def unary<c>` are added
+// when their prototype is parsed, together with the Symbol of the def that
+// implements them.
+class PrecedenceParser {
 public:
-  PrecedenceParser() {
-    binOpPrecedence['<'] = 10;
-    binOpPrecedence['+'] = 20;
-    binOpPrecedence['-'] = 20;
-    binOpPrecedence['*'] = 40;
-    binOpPrecedence['/'] = 40;
-  }
+  // used when `def binary<c>` gives none
+  static constexpr int defaultUserPrecedence = 30;
+
+  // 1 for the weakest binding
+  static constexpr int minPrecedence = 1;
+  static constexpr int maxPrecedence = 100;
 
-  int getOpPrecedence(char c) {
-    if (!isascii(c)){
+  PrecedenceParser() : binaryPrecedence(builtinOperatorPrecedence) {}
+
+  // precedence of `token` as a binary operator, -1 if it is none
+  int getOpPrecedence(int token) const {
+    if (token < 0 || token > 255) {
       return -1;
     }
-    int prec = binOpPrecedence[c];
-    if (prec <= 0) return -1;
-    return prec;
+    return binaryPrecedence[token];
+  }
+
+  static bool isBuiltinOperator(int token) {
+    return token >= 0 && token <= 255 && builtinOperatorPrecedence[token] > 0;
+  }
+
+  // the def implementing a user-defined operator; null for the built-ins
+  Symbol getBinaryFunction(int token) const {
+    return token >= 0 && token <= 255 ? binaryFunctions[token] : Symbol();
+  }
+  Symbol getUnaryFunction(int token) const {
+    return token >= 0 && token <= 255 ? unaryFunctions[token] : Symbol();
+  }
+
+  void addBinaryOperator(unsigned char op, int precedence, Symbol function) {
+    binaryPrecedence[op] = int8_t(precedence);
+    binaryFunctions[op] = function;
+  }
+  void addUnaryOperator(unsigned char op, Symbol function) {
+    unaryFunctions[op] = function;
   }
 
 private:
-  std::unordered_map<char, int> binOpPrecedence;
+  OperatorPrecedenceTable binaryPrecedence;
+  std::array<Symbol, 256> binaryFunctions{};
+  std::array<Symbol, 256> unaryFunctions{};
 };
 
-#endif
\ No newline at end of file
+#endif
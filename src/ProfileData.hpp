@@ -0,0 +1,361 @@
+#ifndef __jesse_profile_data__
+#define __jesse_profile_data__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <limits>
+#include <llvm/ADT/SmallString.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Function.h>
+#include <llvm/IR/IRBuilder.h>
+#include <llvm/IR/Instructions.h>
+#include <llvm/IR/IntrinsicInst.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Support/FileSystem.h>
+#include <llvm/Support/JSON.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Execution profile of JIT'd functions, for profile-guided optimization.
+//
+// instrument() makes a function count its calls, which way each of its
+// conditional branches goes and how often each of its call sites runs.
+// annotate() turns the counts of a function into an entry count, branch
+// weights and inlining hints: functions called at least 1% as often as the
+// most called one get inlinehint, and functions and call sites that never
+// ran are marked cold. Branches and call sites are matched by position, so
+// both must see the function at the same point of compilation; a checksum
+// of the CFG catches functions that changed in between, whose counts are
+// then ignored.
+//
+// Functions are told apart by the canonical path of the script they come
+// from (the source file name of their module, made absolute with symlinks
+// resolved when it names a file) and their name, so scripts compiled side
+// by side may define functions of the same name, and a profile matches its
+// script however the path to it is spelled. Counters are bumped with relaxed
+// atomic adds, as the instrumented code may run on several threads.
+//
+// The counts outlive the process through write() and read(). A function
+// instrumented again with the same shape keeps adding to the counts read
+// for it, so profiles accumulate over runs.
+class ProfileData {
+public:
+  ProfileData() = default;
+  ProfileData(const ProfileData &) = delete;
+  ProfileData &operator=(const ProfileData &) = delete;
+
+  void instrument(llvm::Function &func) {
+    Shape shape = getShape(func);
+    Counter *counters = getCounters(func, shape);
+    llvm::LLVMContext &context = func.getContext();
+    llvm::IRBuilder<> builder(&*func.getEntryBlock().getFirstInsertionPt());
+    increment(builder, address(context, &counters[0]));
+    for (size_t i = 0; i < shape.branches.size(); i++) {
+      llvm::BranchInst *branch = shape.branches[i];
+      builder.SetInsertPoint(branch);
+      increment(builder, builder.CreateSelect(
+                             branch->getCondition(),
+                             address(context, &counters[1 + 2 * i]),
+                             address(context, &counters[2 + 2 * i])));
+    }
+    size_t firstCall = 1 + 2 * shape.branches.size();
+    for (size_t i = 0; i < shape.calls.size(); i++) {
+      builder.SetInsertPoint(shape.calls[i]);
+      increment(builder, address(context, &counters[firstCall + i]));
+    }
+  }
+
+  // Returns whether there were counts for `func` as it is now.
+  bool annotate(llvm::Function &func) const {
+    Shape shape = getShape(func);
+    std::vector<uint64_t> counts;
+    uint64_t maxEntry = 0;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      lookups++;
+      auto module = modules.find(getModuleName(func));
+      if (module == modules.end()) {
+        return false;
+      }
+      auto found = module->second.find(func.getName());
+      if (found == module->second.end() || !found->second->matches(shape)) {
+        return false;
+      }
+      const FunctionProfile &profile = *found->second;
+      for (size_t i = 0; i < profile.size(); i++) {
+        counts.push_back(profile.counters[i].load(std::memory_order_relaxed));
+      }
+      for (auto &entry : module->second) {
+        maxEntry = std::max(
+            maxEntry,
+            entry.second->counters[0].load(std::memory_order_relaxed));
+      }
+      annotated++;
+    }
+
+    uint64_t entry = counts[0];
+    func.setEntryCount(entry);
+    if (entry == 0) {
+      func.addFnAttr(llvm::Attribute::Cold);
+    } else if (entry >= maxEntry / 100) {
+      func.addFnAttr(llvm::Attribute::InlineHint);
+    }
+    llvm::MDBuilder md(func.getContext());
+    for (size_t i = 0; i < shape.branches.size(); i++) {
+      uint64_t taken = counts[1 + 2 * i], notTaken = counts[2 + 2 * i];
+      if (taken + notTaken == 0) {
+        continue;
+      }
+      // weights are 32 bits wide; only their ratio matters
+      uint64_t scale =
+          std::max(taken, notTaken) / std::numeric_limits<uint32_t>::max() + 1;
+      shape.branches[i]->setMetadata(
+          llvm::LLVMContext::MD_prof,
+          md.createBranchWeights(uint32_t(taken / scale),
+                                 uint32_t(notTaken / scale)));
+    }
+    size_t firstCall = 1 + 2 * shape.branches.size();
+    for (size_t i = 0; i < shape.calls.size(); i++) {
+      if (entry > 0 && counts[firstCall + i] == 0) {
+        shape.calls[i]->addFnAttr(llvm::Attribute::Cold);
+      }
+    }
+    return true;
+  }
+
+  // Functions annotate() was asked for, and those it found counts for; a
+  // profile of other scripts, or of other versions of them, matches none.
+  uint64_t getLookups() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return lookups;
+  }
+  uint64_t getAnnotated() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return annotated;
+  }
+
+  // {"modules": {script path: {name: {"checksum": c, "branches": b,
+  //  "calls": n, "counters": [entry, taken, not taken, ..., call site, ...]}}}}
+  void write(const std::string &path) const {
+    std::error_code error;
+    llvm::raw_fd_ostream os(path, error, llvm::sys::fs::OF_Text);
+    if (error) {
+      throw std::runtime_error("cannot write " + path + ": " +
+                               error.message());
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    llvm::json::OStream json(os, 2);
+    json.object([&]() {
+      json.attributeObject("modules", [&]() {
+        for (auto &module : modules) {
+          json.attributeObject(module.getKey(), [&]() {
+            for (auto &entry : module.second) {
+              const FunctionProfile &profile = *entry.second;
+              json.attributeObject(entry.getKey(), [&]() {
+                json.attribute("checksum", int64_t(profile.checksum));
+                json.attribute("branches", int64_t(profile.branches));
+                json.attribute("calls", int64_t(profile.calls));
+                json.attributeArray("counters", [&]() {
+                  for (size_t i = 0; i < profile.size(); i++) {
+                    json.value(int64_t(
+                        profile.counters[i].load(std::memory_order_relaxed)));
+                  }
+                });
+              });
+            }
+          });
+        }
+      });
+    });
+    os << "\n";
+  }
+
+  // Add the profile written to `path` by write().
+  void read(const std::string &path) {
+    auto content = llvm::MemoryBuffer::getFile(path);
+    if (!content) {
+      throw std::runtime_error("cannot open profile " + path);
+    }
+    auto parsed = llvm::json::parse((*content)->getBuffer());
+    if (!parsed) {
+      throw std::runtime_error("invalid profile " + path + ": " +
+                               llvm::toString(parsed.takeError()));
+    }
+    const llvm::json::Object *root = parsed->getAsObject();
+    const llvm::json::Object *entries =
+        root ? root->getObject("modules") : nullptr;
+    if (!entries) {
+      throw std::runtime_error("invalid profile " + path);
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto &module : *entries) {
+      const llvm::json::Object *functions = module.second.getAsObject();
+      if (!functions) {
+        throw std::runtime_error("invalid profile of " + module.first.str() +
+                                 " in " + path);
+      }
+      for (auto &entry : *functions) {
+        auto profile = readFunction(entry.second);
+        if (!profile) {
+          throw std::runtime_error("invalid profile of " + entry.first.str() +
+                                   " of " + module.first.str() + " in " +
+                                   path);
+        }
+        modules[module.first.str()][entry.first.str()] = std::move(profile);
+      }
+    }
+  }
+
+private:
+  using Counter = std::atomic<uint64_t>;
+  static_assert(sizeof(Counter) == sizeof(uint64_t) &&
+                    Counter::is_always_lock_free,
+                "instrumented code adds to the counters as plain i64");
+
+  struct Shape {
+    std::vector<llvm::BranchInst *> branches;
+    std::vector<llvm::CallBase *> calls;
+    uint64_t checksum = 0;
+  };
+
+  struct FunctionProfile {
+    uint64_t checksum = 0;
+    size_t branches = 0;
+    size_t calls = 0;
+    // entry, taken and not taken per branch, then one per call site;
+    // incremented directly by instrumented code
+    std::unique_ptr<Counter[]> counters;
+
+    size_t size() const { return 1 + 2 * branches + calls; }
+    bool matches(const Shape &shape) const {
+      return checksum == shape.checksum &&
+             branches == shape.branches.size() && calls == shape.calls.size();
+    }
+  };
+
+  // Branches and calls in layout order, and a checksum of the CFG that
+  // stays the same from one run to the next.
+  static Shape getShape(llvm::Function &func) {
+    Shape shape;
+    uint64_t hash = 14695981039346656037ull;
+    auto mix = [&hash](uint64_t value) {
+      hash = (hash ^ value) * 1099511628211ull;
+    };
+    for (auto &block : func) {
+      mix(block.size());
+      for (auto &inst : block) {
+        if (auto *branch = llvm::dyn_cast<llvm::BranchInst>(&inst)) {
+          mix(branch->getNumSuccessors());
+          if (branch->isConditional()) {
+            shape.branches.push_back(branch);
+          }
+        } else if (auto *call = llvm::dyn_cast<llvm::CallBase>(&inst)) {
+          if (!llvm::isa<llvm::IntrinsicInst>(call)) {
+            shape.calls.push_back(call);
+          }
+        }
+      }
+    }
+    shape.checksum = hash;
+    return shape;
+  }
+
+  // The source file name survives the bitcode round trip of
+  // TieredCompiler, unlike the module identifier. Names that are no file,
+  // such as the REPL's, stay as they are. Called with `mutex` held.
+  llvm::StringRef getModuleName(const llvm::Function &func) const {
+    llvm::StringRef name = func.getParent()->getSourceFileName();
+    auto found = canonicalNames.find(name);
+    if (found == canonicalNames.end()) {
+      llvm::SmallString<256> path;
+      if (llvm::sys::fs::real_path(name, path)) {
+        path = name;
+      }
+      found = canonicalNames.try_emplace(name, path.str().str()).first;
+    }
+    return found->second;
+  }
+
+  Counter *getCounters(llvm::Function &func, const Shape &shape) {
+    std::lock_guard<std::mutex> lock(mutex);
+    auto &profile = modules[getModuleName(func)][func.getName()];
+    if (profile && profile->matches(shape)) {
+      return profile->counters.get();
+    }
+    if (profile) {
+      // code compiled from the old definition may still be running
+      retired.push_back(std::move(profile));
+    }
+    profile = std::make_unique<FunctionProfile>();
+    profile->checksum = shape.checksum;
+    profile->branches = shape.branches.size();
+    profile->calls = shape.calls.size();
+    profile->counters = std::make_unique<Counter[]>(profile->size());
+    return profile->counters.get();
+  }
+
+  static std::unique_ptr<FunctionProfile>
+  readFunction(const llvm::json::Value &value) {
+    const llvm::json::Object *object = value.getAsObject();
+    if (!object) {
+      return nullptr;
+    }
+    auto checksum = object->getInteger("checksum");
+    auto branches = object->getInteger("branches");
+    auto calls = object->getInteger("calls");
+    const llvm::json::Array *counters = object->getArray("counters");
+    if (!checksum || !branches || !calls || !counters || *branches < 0 ||
+        *calls < 0) {
+      return nullptr;
+    }
+    auto profile = std::make_unique<FunctionProfile>();
+    profile->checksum = uint64_t(*checksum);
+    profile->branches = size_t(*branches);
+    profile->calls = size_t(*calls);
+    if (counters->size() != profile->size()) {
+      return nullptr;
+    }
+    profile->counters = std::make_unique<Counter[]>(profile->size());
+    for (size_t i = 0; i < counters->size(); i++) {
+      auto count = (*counters)[i].getAsInteger();
+      if (!count) {
+        return nullptr;
+      }
+      profile->counters[i].store(uint64_t(*count), std::memory_order_relaxed);
+    }
+    return profile;
+  }
+
+  static llvm::Constant *address(llvm::LLVMContext &context,
+                                 Counter *counter) {
+    llvm::Type *int64Type = llvm::Type::getInt64Ty(context);
+    return llvm::ConstantExpr::getIntToPtr(
+        llvm::ConstantInt::get(int64Type, reinterpret_cast<uintptr_t>(counter)),
+        int64Type->getPointerTo());
+  }
+
+  static void increment(llvm::IRBuilder<> &builder, llvm::Value *counter) {
+    builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter,
+                            builder.getInt64(1), llvm::MaybeAlign(8),
+                            llvm::AtomicOrdering::Monotonic);
+  }
+
+  mutable std::mutex mutex;
+  // script path -> function name -> profile
+  llvm::StringMap<llvm::StringMap<std::unique_ptr<FunctionProfile>>> modules;
+  // source file name -> script path
+  mutable llvm::StringMap<std::string> canonicalNames;
+  mutable uint64_t lookups = 0;
+  mutable uint64_t annotated = 0;
+  std::vector<std::unique_ptr<FunctionProfile>> retired;
+};
+
+#endif
@@ -0,0 +1,190 @@
+#ifndef __jesse_retained_ir__
+#define __jesse_retained_ir__
+
+#include <algorithm>
+#include <llvm/ADT/SmallVector.h>
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringSet.h>
+#include <llvm/Bitcode/BitcodeReader.h>
+#include <llvm/Bitcode/BitcodeWriter.h>
+#include <llvm/IR/Constants.h>
+#include <llvm/IR/Module.h>
+#include <llvm/Linker/Linker.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Utils/Cloning.h>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Bodies of small defs from modules a session has already handed over, so
+// that its later modules can inline calls into them. Without this, a call
+// to a def of an earlier module (another REPL statement, stream chunk or
+// --module-per-function module) is always a real call.
+//
+// The defs of a module are kept together as the bitcode of a copy of the
+// module in which every other function is a declaration. importInto() links
+// the bodies a module calls into it as available_externally definitions:
+// the inliner may use them, and the module stage drops them before the JIT
+// sees the module, which links against the original definitions instead.
+class RetainedIR {
+public:
+  // Keep the defs of `module` with at most `instructionLimit` instructions.
+  // Defs using globals other than functions stay out, since an imported
+  // copy would need those globals as well.
+  void retain(const llvm::Module &module, unsigned instructionLimit) {
+    replaced.clear();
+    std::vector<std::string> names;
+    for (auto &func : module) {
+      if (isRetainable(func, instructionLimit)) {
+        names.push_back(func.getName().str());
+      }
+    }
+    if (names.empty()) {
+      return;
+    }
+    std::unique_ptr<llvm::Module> copy = llvm::CloneModule(module);
+    llvm::StringSet<> kept;
+    for (auto &name : names) {
+      kept.insert(name);
+    }
+    for (auto &func : *copy) {
+      if (!func.isDeclaration() && !kept.count(func.getName())) {
+        func.deleteBody();
+      }
+    }
+    for (auto global = copy->global_begin(); global != copy->global_end();) {
+      llvm::GlobalVariable &variable = *global++;
+      if (variable.use_empty()) {
+        variable.eraseFromParent();
+      }
+    }
+    auto bitcode = std::make_shared<llvm::SmallVector<char, 0>>();
+    llvm::raw_svector_ostream os(*bitcode);
+    llvm::WriteBitcodeToFile(*copy, os);
+    for (auto &name : names) {
+      auto &body = bodies[name];
+      replaced.emplace_back(name, body);
+      body = bitcode;
+    }
+  }
+
+  // Undo the last retain(), for a module the JIT then refused: later
+  // modules inline the bodies kept before it again.
+  void forgetLast() {
+    for (auto &[name, previous] : replaced) {
+      if (previous) {
+        bodies[name] = previous;
+      } else {
+        bodies.erase(name);
+      }
+    }
+    replaced.clear();
+  }
+
+  // Link the retained bodies of the functions `module` declares into it,
+  // and in turn those of the functions these call. Returns how many
+  // functions were imported.
+  unsigned importInto(llvm::Module &module) {
+    unsigned imported = 0;
+    llvm::StringSet<> tried;
+    while (true) {
+      std::vector<std::shared_ptr<llvm::SmallVector<char, 0>>> sources;
+      for (auto &func : module) {
+        if (!func.isDeclaration() || !tried.insert(func.getName()).second) {
+          continue;
+        }
+        auto found = bodies.find(func.getName());
+        if (found != bodies.end() &&
+            std::find(sources.begin(), sources.end(), found->second) ==
+                sources.end()) {
+          sources.push_back(found->second);
+        }
+      }
+      if (sources.empty()) {
+        return imported;
+      }
+      for (auto &source : sources) {
+        imported += link(module, *source);
+      }
+    }
+  }
+
+private:
+  static bool isRetainable(const llvm::Function &func,
+                           unsigned instructionLimit) {
+    if (func.isDeclaration() || func.hasLocalLinkage() ||
+        func.getName().startswith("__anon_expr") ||
+        func.getInstructionCount() > instructionLimit) {
+      return false;
+    }
+    for (auto &block : func) {
+      for (auto &inst : block) {
+        for (auto &operand : inst.operands()) {
+          if (usesGlobalVariable(operand.get())) {
+            return false;
+          }
+        }
+      }
+    }
+    return true;
+  }
+
+  static bool usesGlobalVariable(const llvm::Value *value) {
+    if (auto *global = llvm::dyn_cast<llvm::GlobalValue>(value)) {
+      auto *func = llvm::dyn_cast<llvm::Function>(global);
+      return !func || func->hasLocalLinkage();
+    }
+    if (auto *expr = llvm::dyn_cast<llvm::ConstantExpr>(value)) {
+      for (auto &operand : expr->operands()) {
+        if (usesGlobalVariable(operand.get())) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  // Link the needed definitions of `bitcode` into `module` as
+  // available_externally; returns how many there were.
+  static unsigned link(llvm::Module &module,
+                       const llvm::SmallVector<char, 0> &bitcode) {
+    auto source = llvm::parseBitcodeFile(
+        llvm::MemoryBufferRef(llvm::StringRef(bitcode.data(), bitcode.size()),
+                              "retained"),
+        module.getContext());
+    if (!source) {
+      throw std::runtime_error("cannot read retained IR: " +
+                               llvm::toString(source.takeError()));
+    }
+    llvm::StringSet<> defined;
+    for (auto &func : module) {
+      if (!func.isDeclaration()) {
+        defined.insert(func.getName());
+      }
+    }
+    if (llvm::Linker::linkModules(module, std::move(*source),
+                                  llvm::Linker::LinkOnlyNeeded)) {
+      throw std::runtime_error("cannot link retained IR into " +
+                               module.getName().str());
+    }
+    unsigned imported = 0;
+    for (auto &func : module) {
+      if (!func.isDeclaration() && !defined.count(func.getName())) {
+        func.setLinkage(llvm::GlobalValue::AvailableExternallyLinkage);
+        imported++;
+      }
+    }
+    return imported;
+  }
+
+  llvm::StringMap<std::shared_ptr<llvm::SmallVector<char, 0>>> bodies;
+  // what the last retain() overwrote, null for names new to `bodies`
+  std::vector<
+      std::pair<std::string, std::shared_ptr<llvm::SmallVector<char, 0>>>>
+      replaced;
+};
+
+#endif
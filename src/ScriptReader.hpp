@@ -0,0 +1,212 @@
+#ifndef __jesse_script_reader__
+#define __jesse_script_reader__
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+// A run of whole statements of a script: it starts right after a statement
+// boundary (or at the beginning) and ends right after one (or at the end).
+// The text is either owned or a view into the reader's mapping; in the
+// latter case the pages it covers are given back to the kernel once the
+// chunk is destroyed, so a mapped multi-GB script is not resident all at
+// once.
+class ScriptChunk {
+public:
+  ScriptChunk() = default;
+  ScriptChunk(std::string text, uint64_t offset)
+      : storage(std::move(text)), offset(offset) {}
+  ScriptChunk(std::string_view mapped, uint64_t offset)
+      : mapped(mapped), offset(offset) {}
+  ScriptChunk(ScriptChunk &&other) { *this = std::move(other); }
+  ScriptChunk &operator=(ScriptChunk &&other) {
+    release();
+    storage = std::move(other.storage);
+    mapped = std::exchange(other.mapped, std::string_view());
+    offset = other.offset;
+    return *this;
+  }
+  ~ScriptChunk() { release(); }
+
+  std::string_view text() const {
+    return mapped.data() ? mapped : std::string_view(storage);
+  }
+  // byte offset of text() in the script
+  uint64_t getOffset() const { return offset; }
+
+private:
+  void release() {
+    if (!mapped.data()) {
+      return;
+    }
+    // only whole pages: the ones at either end are shared with neighbours
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t(mapped.data()) + page - 1) & ~(page - 1);
+    uintptr_t end = (uintptr_t(mapped.data()) + mapped.size()) & ~(page - 1);
+    if (begin < end) {
+      madvise((void *)begin, end - begin, MADV_DONTNEED);
+    }
+    mapped = std::string_view();
+  }
+
+  std::string storage;
+  std::string_view mapped;
+  uint64_t offset = 0;
+};
+
+// Position right after the last ';' of text[from, end) that is not inside a
+// comment, or npos. Cuts are only made after such a ';', so the part of a
+// line that lies before `text` never holds a '#'.
+inline size_t lastStatementEnd(std::string_view text, size_t from = 0) {
+  size_t end = text.size();
+  while (end > from) {
+    size_t semicolon = text.find_last_of(';', end - 1);
+    if (semicolon == std::string_view::npos || semicolon < from) {
+      return std::string_view::npos;
+    }
+    size_t lineStart = text.find_last_of("\r\n", semicolon);
+    lineStart = lineStart == std::string_view::npos ? 0 : lineStart + 1;
+    size_t comment = text.find('#', lineStart);
+    if (comment > semicolon) {
+      return semicolon + 1;
+    }
+    end = comment; // ';' after a '#' on the same line are commented out
+  }
+  return std::string_view::npos;
+}
+
+// Reads a script from a file or stdin as a sequence of ScriptChunks of
+// about `chunkSize` bytes, so that parsing can start before the whole script
+// is read and memory stays proportional to the chunk size. A chunk grows
+// past `chunkSize` only when no statement ends within it.
+//
+// Regular files may be mmap'd instead of read, which saves a copy per
+// chunk; pipes and stdin are always read.
+class ScriptReader {
+public:
+  // `path` "-" is stdin. Throws std::runtime_error if it cannot be opened.
+  ScriptReader(const std::string &path, size_t chunkSize, bool useMmap)
+      : chunkSize(chunkSize ? chunkSize : 1) {
+    if (path == "-") {
+      fd = STDIN_FILENO;
+      return;
+    }
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("cannot open file " + path + ": " +
+                               strerror(errno));
+    }
+    struct stat status;
+    if (useMmap && fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+        status.st_size > 0) {
+      void *address =
+          mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (address != MAP_FAILED) {
+        madvise(address, status.st_size, MADV_SEQUENTIAL);
+        mapping = std::string_view((const char *)address, status.st_size);
+      }
+    }
+  }
+  ScriptReader(const ScriptReader &) = delete;
+  ScriptReader &operator=(const ScriptReader &) = delete;
+  ~ScriptReader() {
+    if (mapping.data()) {
+      munmap((void *)mapping.data(), mapping.size());
+    }
+    if (fd > STDIN_FILENO) {
+      ::close(fd);
+    }
+  }
+
+  bool isMapped() const { return mapping.data() != nullptr; }
+
+  // The next chunk; false at the end of the script.
+  bool next(ScriptChunk &chunk) {
+    return isMapped() ? nextMapped(chunk) : nextRead(chunk);
+  }
+
+  uint64_t getBytesRead() const { return offset; }
+
+private:
+  bool nextMapped(ScriptChunk &chunk) {
+    std::string_view rest = mapping.substr(offset);
+    if (rest.empty()) {
+      return false;
+    }
+    size_t scanned = 0;
+    size_t size = std::min(chunkSize, rest.size());
+    size_t cut;
+    while ((cut = lastStatementEnd(rest.substr(0, size), scanned)) ==
+               std::string_view::npos &&
+           size < rest.size()) {
+      scanned = size;
+      size = std::min(size + chunkSize, rest.size());
+    }
+    if (cut == std::string_view::npos) {
+      cut = rest.size();
+    }
+    chunk = ScriptChunk(rest.substr(0, cut), offset);
+    offset += cut;
+    return true;
+  }
+
+  bool nextRead(ScriptChunk &chunk) {
+    std::string text = std::move(carry);
+    carry.clear();
+    size_t scanned = 0;
+    size_t cut = std::string::npos;
+    while (true) {
+      if (text.size() >= chunkSize) {
+        cut = lastStatementEnd(text, scanned);
+        if (cut != std::string::npos) {
+          break;
+        }
+        scanned = text.size();
+      }
+      if (atEnd) {
+        cut = text.size();
+        break;
+      }
+      size_t size = text.size();
+      text.resize(size + chunkSize);
+      ssize_t count;
+      do {
+        count = ::read(fd, &text[size], chunkSize);
+      } while (count < 0 && errno == EINTR);
+      if (count < 0) {
+        throw std::runtime_error(std::string("read error: ") +
+                                 strerror(errno));
+      }
+      text.resize(size + count);
+      atEnd = count == 0;
+    }
+    if (text.empty()) {
+      return false;
+    }
+    carry.assign(text, cut, std::string::npos);
+    text.resize(cut);
+    chunk = ScriptChunk(std::move(text), offset);
+    offset += cut;
+    return true;
+  }
+
+  const size_t chunkSize;
+  int fd = -1;
+  std::string_view mapping;
+  // read but not handed out yet: the start of an unfinished statement
+  std::string carry;
+  bool atEnd = false;
+  uint64_t offset = 0;
+};
+
+#endif
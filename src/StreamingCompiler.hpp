@@ -0,0 +1,359 @@
+#ifndef __jesse_streaming_compiler__
+#define __jesse_streaming_compiler__
+
+#include "AST.hpp"
+#include "BoundedQueue.hpp"
+#include "CompilerSession.hpp"
+#include "KaleidoscopeJIT.hpp"
+#include "Parser.hpp"
+#include "ScriptReader.hpp"
+#include "TieredCompiler.hpp"
+#include <llvm/ExecutionEngine/JITSymbol.h>
+#include <llvm/ExecutionEngine/Orc/Core.h>
+#include <llvm/ExecutionEngine/Orc/ThreadSafeModule.h>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Add a module holding a top-level expression under its own ResourceTracker,
+// run it and remove it again, so that expressions do not pile up in the JIT.
+inline double runExpressionModule(llvm::orc::KaleidoscopeJIT &jit,
+                                  llvm::orc::JITDylib &dylib,
+                                  llvm::orc::ThreadSafeModule module) {
+  auto tracker = dylib.createResourceTracker();
+  auto symbol = [&]() {
+    if (auto err = jit.addModule(std::move(module), tracker)) {
+      return llvm::Expected<llvm::JITEvaluatedSymbol>(std::move(err));
+    }
+    return jit.lookup(dylib, "__anon_expr");
+  }();
+  if (!symbol) {
+    // leave no half-materialized __anon_expr behind for the next one
+    llvm::consumeError(tracker->remove());
+    throw std::runtime_error(llvm::toString(symbol.takeError()));
+  }
+  auto expression = (double (*)())(intptr_t)symbol->getAddress();
+  double value = expression();
+  if (auto err = tracker->remove()) {
+    throw std::runtime_error(llvm::toString(std::move(err)));
+  }
+  return value;
+}
+
+struct StreamOptions {
+  // bytes read per chunk; a chunk is cut at the last statement in it
+  size_t chunkSize = 1 << 20;
+  // chunks, parsed chunks and modules in flight between two stages
+  size_t queueDepth = 4;
+  // map regular files instead of reading them
+  bool mmap = false;
+};
+
+struct StreamStats {
+  uint64_t bytes = 0;
+  uint64_t chunks = 0;
+  uint64_t definitions = 0;
+  uint64_t expressions = 0;
+  uint64_t modules = 0;
+  // time each stage spent working rather than waiting on its queues
+  double readSeconds = 0;
+  double parseSeconds = 0;
+  double codegenSeconds = 0;
+  double jitSeconds = 0;
+  double wallSeconds = 0;
+};
+
+// Compiles and runs one script as it is read, as a pipeline of four stages
+// connected by BoundedQueues:
+//
+//   read (ScriptReader) -> lex/parse -> IR codegen -> JIT materialization
+//
+// The first three run on threads of their own, the JIT stage on the caller.
+// Each chunk of statements is parsed into an AST arena of its own, which is
+// freed once its IR is generated, and the defs of a chunk become one module
+// (one per def with CompileOptions::modulePerFunction) that the JIT stage
+// compiles right away. Top-level expressions are run in order as soon as
+// everything before them is in the JIT. Memory therefore depends on the
+// chunk size and queue depth, not on the size of the script.
+class StreamingCompiler {
+public:
+  StreamingCompiler(llvm::orc::KaleidoscopeJIT &jit,
+                    llvm::orc::JITDylib &dylib,
+                    const CompileOptions &compileOptions,
+                    const StreamOptions &options,
+                    llvm::orc::TieredCompiler *tiered = nullptr)
+      : jit(jit), dylib(dylib), options(options), tiered(tiered),
+        parser("", "stream", compileOptions),
+        codegen("", "stream", compileOptions), chunks(options.queueDepth),
+        parsed(options.queueDepth), compiled(options.queueDepth) {
+    codegen.TheModule->setDataLayout(jit.getDataLayout());
+  }
+
+  // Compile and run the script at `path` ("-" is stdin), passing the value of
+  // every top-level expression to `onResult` on the calling thread. Call once
+  // per StreamingCompiler. Throws std::runtime_error on the first error;
+  // every statement of the chunks before the failing one has run by then.
+  void run(const std::string &path,
+           const std::function<void(double)> &onResult) {
+    auto start = std::chrono::steady_clock::now();
+    ScriptReader reader(path, options.chunkSize, options.mmap);
+    std::thread readThread([&]() {
+      stage([&]() { readStage(reader); }, [&]() { chunks.close(); });
+    });
+    std::thread parseThread([&]() {
+      stage([&]() { parseStage(); },
+            [&]() {
+              chunks.close();
+              parsed.close();
+            });
+    });
+    std::thread codegenThread([&]() {
+      stage([&]() { codegenStage(); },
+            [&]() {
+              parsed.close();
+              compiled.close();
+            });
+    });
+    stage([&]() { jitStage(onResult); }, [&]() { compiled.close(); });
+    readThread.join();
+    parseThread.join();
+    codegenThread.join();
+    stats.bytes = reader.getBytesRead();
+    stats.wallSeconds = secondsSince(start);
+    if (!error.empty()) {
+      throw std::runtime_error(error);
+    }
+  }
+
+  // the session that generated the IR, e.g. for its memoized functions
+  CompilerSession &getSession() { return codegen; }
+  const StreamStats &getStats() const { return stats; }
+
+private:
+  struct Statement {
+    int kind; // tok_def, tok_extern, or 0 for a top-level expression
+    FunctionAST *function;
+    PrototypeAST *prototype;
+  };
+
+  struct ParsedChunk {
+    // owns the expressions of `statements`; prototypes are in the parser's
+    // declarations, which outlive every chunk
+    std::unique_ptr<ASTContext> ast;
+    std::vector<Statement> statements;
+  };
+
+  struct CompiledModule {
+    llvm::orc::ThreadSafeModule module;
+    bool expression = false;
+  };
+
+  static double secondsSince(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() -
+                                         start)
+        .count();
+  }
+
+  // Runs a stage, then closes its input and output queues however it ended:
+  // the stage upstream stops at its next push, and the one downstream
+  // finishes what was queued before. So an error stops the pipeline at the
+  // stage that failed and the statements before it still run, in order.
+  template <typename F, typename G> void stage(F &&body, G &&closeQueues) {
+    try {
+      body();
+    } catch (const std::exception &e) {
+      std::lock_guard<std::mutex> lock(errorMutex);
+      if (error.empty()) {
+        error = e.what();
+      }
+    }
+    closeQueues();
+  }
+
+  void readStage(ScriptReader &reader) {
+    ScriptChunk chunk;
+    while (true) {
+      auto start = std::chrono::steady_clock::now();
+      bool more = reader.next(chunk);
+      stats.readSeconds += secondsSince(start);
+      if (!more || !chunks.push(std::move(chunk))) {
+        break;
+      }
+      stats.chunks++;
+    }
+  }
+
+  // top ::= definition | external | expression | ';'
+  void parseStage() {
+    ScriptChunk chunk;
+    while (chunks.pop(chunk)) {
+      auto start = std::chrono::steady_clock::now();
+      ParsedChunk result;
+      parser.setSource(chunk.text());
+      parser.getNextToken();
+      try {
+        while (parser.currentToken != Token::tok_eof) {
+          switch (parser.currentToken) {
+          case ';':
+            parser.getNextToken();
+            break;
+          case Token::tok_def:
+            result.statements.push_back(
+                {Token::tok_def, checked(parseFunction(parser)), nullptr});
+            break;
+          case Token::tok_extern:
+            result.statements.push_back(
+                {Token::tok_extern, nullptr, parseExtern(parser)});
+            break;
+          default:
+            result.statements.push_back(
+                {0, checked(parseToplevelAST(parser)), nullptr});
+            break;
+          }
+        }
+      } catch (const std::exception &e) {
+        throw std::runtime_error(
+            std::string(e.what()) + " at byte " +
+            std::to_string(chunk.getOffset() + parser.lexer.offset()));
+      }
+      result.ast = parser.takeAST();
+      chunk = ScriptChunk(); // every name in it is interned by now
+      stats.parseSeconds += secondsSince(start);
+      if (!parsed.push(std::move(result))) {
+        break;
+      }
+    }
+  }
+
+  static FunctionAST *checked(FunctionAST *function) {
+    if (!function) {
+      throw std::runtime_error("expected an expression");
+    }
+    return function;
+  }
+
+  void codegenStage() {
+    ParsedChunk chunk;
+    size_t pendingDefinitions = 0;
+    // hand the defs generated so far to the JIT stage
+    auto flush = [&]() {
+      if (pendingDefinitions == 0) {
+        return true;
+      }
+      pendingDefinitions = 0;
+      return compiled.push({codegen.nextModule(), false});
+    };
+    while (parsed.pop(chunk)) {
+      auto start = std::chrono::steady_clock::now();
+      bool open = true;
+      for (auto &statement : chunk.statements) {
+        if (statement.kind == Token::tok_extern) {
+          codegen.FunctionProtos.set(statement.prototype->getSymbol(),
+                                     statement.prototype);
+          continue;
+        }
+        bool expression = statement.kind != Token::tok_def;
+        // an expression must see every def before it in the JIT
+        if (expression && !(open = flush())) {
+          break;
+        }
+        if (!statement.function->codegen(codegen)) {
+          throw std::runtime_error(expression
+                                       ? "invalid expression"
+                                       : "invalid function definition");
+        }
+        if (expression) {
+          open = compiled.push({codegen.nextModule(), true});
+        } else {
+          pendingDefinitions++;
+          stats.definitions++;
+          if (codegen.options.modulePerFunction) {
+            open = flush();
+          }
+        }
+        if (!open) {
+          break;
+        }
+      }
+      open = open && flush();
+      // the chunk's AST is no longer needed
+      chunk = ParsedChunk();
+      stats.codegenSeconds += secondsSince(start);
+      if (!open) {
+        break;
+      }
+    }
+  }
+
+  void jitStage(const std::function<void(double)> &onResult) {
+    CompiledModule compiledModule;
+    while (compiled.pop(compiledModule)) {
+      auto start = std::chrono::steady_clock::now();
+      stats.modules++;
+      if (compiledModule.expression) {
+        double value =
+            runExpressionModule(jit, dylib, std::move(compiledModule.module));
+        stats.jitSeconds += secondsSince(start);
+        stats.expressions++;
+        onResult(value);
+        continue;
+      }
+      addDefinitions(std::move(compiledModule.module));
+      stats.jitSeconds += secondsSince(start);
+    }
+  }
+
+  // Add a module of defs and compile all of them now, rather than on the
+  // first lookup, so that compiling overlaps with the stages before.
+  void addDefinitions(llvm::orc::ThreadSafeModule module) {
+    if (tiered) {
+      if (auto err = tiered->addModule(std::move(module))) {
+        throw std::runtime_error(llvm::toString(std::move(err)));
+      }
+      return;
+    }
+    std::vector<std::string> definitions;
+    module.withModuleDo([&definitions](llvm::Module &M) {
+      for (auto &F : M) {
+        if (!F.isDeclaration() && !F.hasLocalLinkage()) {
+          definitions.push_back(F.getName().str());
+        }
+      }
+    });
+    if (auto err = jit.addModule(std::move(module),
+                                 dylib.getDefaultResourceTracker())) {
+      throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+    if (auto err = jit.lookup(dylib, definitions).takeError()) {
+      throw std::runtime_error(llvm::toString(std::move(err)));
+    }
+  }
+
+  llvm::orc::KaleidoscopeJIT &jit;
+  llvm::orc::JITDylib &dylib;
+  const StreamOptions options;
+  llvm::orc::TieredCompiler *tiered;
+
+  // lexer, arenas and prototypes; touched by the parse stage only, except
+  // for the prototypes, which the parse stage no longer reads once parsed
+  // (codegen fills in inferred return types)
+  CompilerSession parser;
+  // LLVMContext, module and symbol tables; touched by the codegen stage only
+  CompilerSession codegen;
+
+  BoundedQueue<ScriptChunk> chunks;
+  BoundedQueue<ParsedChunk> parsed;
+  BoundedQueue<CompiledModule> compiled;
+
+  std::mutex errorMutex;
+  std::string error;
+  StreamStats stats;
+};
+
+#endif
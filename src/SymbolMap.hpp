@@ -0,0 +1,143 @@
+#ifndef __jesse_symbol_map__
+#define __jesse_symbol_map__
+
+#include "SymbolTable.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Flat open-addressing hash map from Symbol to V, for the tables codegen
+// consults at every variable and call: slots live in one array, probing is
+// linear, and the hash is a multiply of the symbol id, so a lookup is a few
+// compares of pointers in a cache line or two. Removal shifts the rest of
+// the probe run back instead of leaving tombstones.
+//
+// Keys must all come from the same SymbolTable.
+template <typename V> class SymbolMap {
+public:
+  // the value of `symbol`, or null
+  V *find(Symbol symbol) {
+    if (count == 0) {
+      return nullptr;
+    }
+    for (size_t i = home(symbol);; i = (i + 1) & mask()) {
+      if (slots[i].key == symbol) {
+        return &slots[i].value;
+      }
+      if (!slots[i].key) {
+        return nullptr;
+      }
+    }
+  }
+  const V *find(Symbol symbol) const {
+    return const_cast<SymbolMap *>(this)->find(symbol);
+  }
+
+  // the value of `symbol`, or V() if there is none
+  V lookup(Symbol symbol) const {
+    const V *value = find(symbol);
+    return value ? *value : V();
+  }
+
+  bool contains(Symbol symbol) const { return find(symbol) != nullptr; }
+
+  // insert or overwrite
+  void set(Symbol symbol, V value) {
+    if ((count + 1) * 4 > slots.size() * 3) {
+      grow();
+    }
+    size_t i = home(symbol);
+    while (slots[i].key && slots[i].key != symbol) {
+      i = (i + 1) & mask();
+    }
+    if (!slots[i].key) {
+      slots[i].key = symbol;
+      count++;
+    }
+    slots[i].value = std::move(value);
+  }
+
+  // returns whether `symbol` was present
+  bool erase(Symbol symbol) {
+    if (count == 0) {
+      return false;
+    }
+    size_t i = home(symbol);
+    while (slots[i].key != symbol) {
+      if (!slots[i].key) {
+        return false;
+      }
+      i = (i + 1) & mask();
+    }
+    // move later members of the run into the hole unless that would put
+    // them before their home slot
+    for (size_t j = (i + 1) & mask(); slots[j].key; j = (j + 1) & mask()) {
+      size_t wanted = home(slots[j].key);
+      if (((j - wanted) & mask()) >= ((j - i) & mask())) {
+        slots[i] = std::move(slots[j]);
+        i = j;
+      }
+    }
+    slots[i] = Slot();
+    count--;
+    return true;
+  }
+
+  // Empty the map but keep its slots, so a map refilled for every function
+  // stops allocating once it has seen the largest one.
+  void clear() {
+    if (count == 0) {
+      return;
+    }
+    for (auto &slot : slots) {
+      slot = Slot();
+    }
+    count = 0;
+  }
+
+  size_t size() const { return count; }
+  bool empty() const { return count == 0; }
+
+  // calls f(Symbol, V&) for every entry, in no particular order
+  template <typename F> void forEach(F &&f) {
+    for (auto &slot : slots) {
+      if (slot.key) {
+        f(slot.key, slot.value);
+      }
+    }
+  }
+
+private:
+  struct Slot {
+    Symbol key;
+    V value = V();
+  };
+
+  size_t mask() const { return slots.size() - 1; }
+  size_t home(Symbol symbol) const {
+    // Fibonacci hashing: ids are dense, so spread them with the top bits
+    uint64_t hash = uint64_t(symbol.getID() + 1) * 0x9e3779b97f4a7c15ULL;
+    return size_t(hash >> shift);
+  }
+
+  void grow() {
+    std::vector<Slot> old = std::move(slots);
+    slots = std::vector<Slot>(old.empty() ? 16 : old.size() * 2);
+    shift = old.empty() ? 60 : shift - 1;
+    count = 0;
+    for (auto &slot : old) {
+      if (slot.key) {
+        set(slot.key, std::move(slot.value));
+      }
+    }
+  }
+
+  std::vector<Slot> slots;
+  // 64 - log2(slots.size()), so that home() keeps as many top bits of the
+  // hash as the table has slots
+  unsigned shift = 64;
+  size_t count = 0;
+};
+
+#endif
@@ -0,0 +1,81 @@
+#ifndef __jesse_symbol_table__
+#define __jesse_symbol_table__
+
+#include "Token.hpp"
+#include <llvm/ADT/StringMap.h>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/Support/Allocator.h>
+#include <cstdint>
+
+struct SymbolInfo {
+  // dense, in the order the names were first seen
+  uint32_t id;
+  // the keyword's Token, or tok_identifier
+  int token;
+};
+
+// An interned identifier: a pointer to its one entry in a SymbolTable, so
+// equal names are equal symbols and comparing or hashing one never looks at
+// the characters. Trivially copyable, so AST nodes in an arena can hold it.
+class Symbol {
+public:
+  using Entry = llvm::StringMapEntry<SymbolInfo>;
+
+  Symbol() = default;
+  explicit Symbol(const Entry *entry) : entry(entry) {}
+
+  llvm::StringRef getName() const { return entry->getKey(); }
+  uint32_t getID() const { return entry->getValue().id; }
+  int getToken() const { return entry->getValue().token; }
+
+  explicit operator bool() const { return entry != nullptr; }
+  bool operator==(Symbol other) const { return entry == other.entry; }
+  bool operator!=(Symbol other) const { return entry != other.entry; }
+
+private:
+  const Entry *entry = nullptr;
+};
+
+// Session-wide interner. The lexer turns every identifier into a Symbol as
+// it scans it, and from then on names are only compared by identity: AST
+// nodes hold Symbols, and codegen keys its tables (SymbolMap) by them.
+// Keywords are interned up front, so recognizing one is the same lookup.
+//
+// Entries are never freed before the table, so a Symbol outlives the AST
+// arena it was parsed into. Interning is not synchronized, but a Symbol may
+// be read on other threads once it has been handed over.
+class SymbolTable {
+public:
+  SymbolTable() {
+    addKeyword("def", Token::tok_def);
+    addKeyword("extern", Token::tok_extern);
+    addKeyword("if", Token::tok_if);
+    addKeyword("then", Token::tok_then);
+    addKeyword("else", Token::tok_else);
+    addKeyword("for", Token::tok_for);
+    addKeyword("in", Token::tok_in);
+    addKeyword("binary", Token::tok_binary);
+    addKeyword("unary", Token::tok_unary);
+  }
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+
+  Symbol intern(llvm::StringRef name) {
+    auto inserted = names.try_emplace(
+        name, SymbolInfo{uint32_t(names.size()), Token::tok_identifier});
+    return Symbol(&*inserted.first);
+  }
+
+  // number of distinct names, i.e. one past the largest id
+  uint32_t size() const { return names.size(); }
+
+private:
+  void addKeyword(llvm::StringRef name, int token) {
+    names.try_emplace(name, SymbolInfo{uint32_t(names.size()), token});
+  }
+
+  llvm::BumpPtrAllocator allocator;
+  llvm::StringMap<SymbolInfo, llvm::BumpPtrAllocator &> names{allocator};
+};
+
+#endif
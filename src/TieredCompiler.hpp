@@ -0,0 +1,336 @@
+#ifndef __jesse_tiered_compiler__
+#define __jesse_tiered_compiler__
+
+#include "KaleidoscopeJIT.hpp"
+#include "OptimizationPipeline.hpp"
+#include "ProfileData.hpp"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/IndirectionUtils.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace llvm {
+namespace orc {
+
+// Two-tier compilation on top of KaleidoscopeJIT.
+//
+// Every function `f` added here is published as an indirect stub named `f`;
+// its baseline body is emitted as `f$tier0`, and all calls in JIT'd code go
+// through the stub. The baseline body counts its calls, and when the count
+// reaches the threshold the function is queued for a background thread that
+// reoptimizes the retained IR at the top optimization level, emits it as
+// `f$tier1` and swaps the stub pointer over. Callers pick up the new body on
+// their next call.
+//
+// With a ProfileData the baseline also counts its branches and call sites,
+// and tier 1 is optimized with the counts gathered up to its promotion.
+//
+// The stubs, counters and queue live in the TieredCompiler and the code it
+// compiles refers to them directly, so none of that code may run once the
+// TieredCompiler is destroyed: keep it alive as long as the JITDylib's
+// functions are called, or remove the JITDylib first.
+class TieredCompiler {
+public:
+  struct Promotion {
+    std::string Name;
+    uint64_t Calls;
+    // since the TieredCompiler was created
+    double PromotedAtSeconds;
+    double CompileSeconds;
+  };
+
+  TieredCompiler(KaleidoscopeJIT &JIT, JITDylib &JD, unsigned OptLevel,
+                 uint64_t Threshold, ProfileData *Profile = nullptr)
+      : JIT(JIT), JD(JD), OptLevel(OptLevel), Threshold(Threshold),
+        Profile(Profile),
+        Stubs(createLocalIndirectStubsManagerBuilder(
+            JIT.getExecutionSession()
+                .getExecutorProcessControl()
+                .getTargetTriple())()),
+        Start(std::chrono::steady_clock::now()) {
+    cantFail(JD.define(absoluteSymbols(
+        {{JIT.mangle("kaleidoscope.tier_up"),
+          JITEvaluatedSymbol(pointerToJITTargetAddress(&tierUpHook),
+                             JITSymbolFlags::Exported)}})));
+    Worker = std::thread([this] { promoteQueued(); });
+  }
+
+  ~TieredCompiler() {
+    {
+      std::lock_guard<std::mutex> Lock(QueueMutex);
+      Stopping = true;
+    }
+    QueueChanged.notify_one();
+    Worker.join();
+  }
+
+  // Compile the baseline tier of every function defined in TSM and route
+  // their names through stubs.
+  Error addModule(ThreadSafeModule TSM) {
+    std::vector<std::string> Bodies;
+    Error Err = TSM.withModuleDo([&](Module &M) -> Error {
+      auto Bitcode = std::make_shared<SmallVector<char, 0>>();
+      {
+        raw_svector_ostream OS(*Bitcode);
+        WriteBitcodeToFile(M, OS);
+      }
+
+      IndirectStubsManager::StubInitsMap Inits;
+      SymbolMap StubSymbols;
+      std::vector<Function *> Defined;
+      // internal helpers stay plain parts of the module they belong to
+      for (auto &F : M)
+        if (!F.isDeclaration() && !F.hasLocalLinkage())
+          Defined.push_back(&F);
+      for (auto *F : Defined) {
+        std::string Name = F->getName().str();
+        TieredFunction &TF = addFunction(Name, Bitcode);
+        // before the tier-up check adds a branch the retained IR lacks
+        if (Profile)
+          Profile->instrument(*F);
+        instrument(*F, TF);
+        moveBodyBehindStub(*F, Name, "$tier0");
+        Bodies.push_back(Name + "$tier0");
+        Inits[Name] = {pointerToJITTargetAddress(&unresolvedStub),
+                       JITSymbolFlags::Exported | JITSymbolFlags::Callable};
+      }
+      if (auto Err = Stubs->createStubs(Inits))
+        return Err;
+      for (auto &Init : Inits)
+        StubSymbols[JIT.mangle(Init.getKey())] =
+            Stubs->findStub(Init.getKey(), true);
+      if (StubSymbols.empty())
+        return Error::success();
+      return JD.define(absoluteSymbols(std::move(StubSymbols)));
+    });
+    if (Err)
+      return Err;
+
+    if (auto Err = JIT.addModule(std::move(TSM), JD.createResourceTracker()))
+      return Err;
+    return pointStubsAt(Bodies, "$tier0");
+  }
+
+  std::vector<Promotion> getPromotions() const {
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    return Promotions;
+  }
+
+  void printPromotions(raw_ostream &OS) const {
+    for (auto &P : getPromotions())
+      OS << "tier-up: " << P.Name << " after " << P.Calls << " calls at +"
+         << format("%.3f", P.PromotedAtSeconds * 1000) << " ms (compiled in "
+         << format("%.3f", P.CompileSeconds * 1000) << " ms)\n";
+  }
+
+private:
+  struct TieredFunction {
+    TieredFunction(std::string Name,
+                   std::shared_ptr<SmallVector<char, 0>> Bitcode)
+        : Name(std::move(Name)), Bitcode(std::move(Bitcode)) {}
+
+    std::string Name;
+    std::shared_ptr<SmallVector<char, 0>> Bitcode;
+    // Both accessed directly by the baseline body, on any thread running
+    // it. Queued is set by the first call to reach the threshold.
+    std::atomic<uint64_t> Calls{0};
+    std::atomic<bool> Queued{false};
+  };
+  static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t) &&
+                    sizeof(std::atomic<bool>) == 1,
+                "the baseline accesses the counters as i64 and i8");
+
+  TieredFunction &addFunction(std::string Name,
+                              std::shared_ptr<SmallVector<char, 0>> Bitcode) {
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    Functions.emplace_back(std::move(Name), std::move(Bitcode));
+    return Functions.back();
+  }
+
+  // Rename F's body to Name+Suffix and send every use of the old name to a
+  // declaration that resolves to the stub.
+  static void moveBodyBehindStub(Function &F, StringRef Name,
+                                 StringRef Suffix) {
+    F.setName(Name + Suffix);
+    Function *Decl = Function::Create(F.getFunctionType(),
+                                      Function::ExternalLinkage, Name,
+                                      F.getParent());
+    F.replaceAllUsesWith(Decl);
+  }
+
+  // calls = atomic calls + 1
+  // if (calls >= Threshold && !queued) tier_up(this, function)
+  //
+  // The count is atomic since the baseline may run on several threads at
+  // once; with >= no promotion is lost when concurrent calls skip past the
+  // threshold, and tier_up() queues the function once whoever gets there.
+  void instrument(Function &F, TieredFunction &TF) {
+    LLVMContext &Ctx = F.getContext();
+    Type *Int64Ty = Type::getInt64Ty(Ctx);
+    Type *Int8Ty = Type::getInt8Ty(Ctx);
+    BasicBlock &Entry = F.getEntryBlock();
+    IRBuilder<> Builder(&Entry, Entry.getFirstInsertionPt());
+    Constant *Counter = ConstantExpr::getIntToPtr(
+        ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(&TF.Calls)),
+        Int64Ty->getPointerTo());
+    Constant *Queued = ConstantExpr::getIntToPtr(
+        ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(&TF.Queued)),
+        Int8Ty->getPointerTo());
+    Value *One = ConstantInt::get(Int64Ty, 1);
+    Value *Calls = Builder.CreateAdd(
+        Builder.CreateAtomicRMW(AtomicRMWInst::Add, Counter, One, Align(8),
+                                AtomicOrdering::Monotonic),
+        One);
+    auto *Hot = cast<Instruction>(Builder.CreateICmpUGE(
+        Calls, ConstantInt::get(Int64Ty, Threshold)));
+    Instruction *CheckQueued = SplitBlockAndInsertIfThen(
+        Hot, Hot->getNextNode(), false,
+        MDBuilder(Ctx).createBranchWeights(1, 1 << 20));
+    Builder.SetInsertPoint(CheckQueued);
+    LoadInst *IsQueued = Builder.CreateAlignedLoad(Int8Ty, Queued, Align(1));
+    IsQueued->setAtomic(AtomicOrdering::Monotonic);
+    Instruction *Then = SplitBlockAndInsertIfThen(
+        Builder.CreateICmpEQ(IsQueued, ConstantInt::get(Int8Ty, 0)),
+        CheckQueued, false, MDBuilder(Ctx).createBranchWeights(1, 1 << 20));
+    Builder.SetInsertPoint(Then);
+    FunctionCallee Hook = F.getParent()->getOrInsertFunction(
+        "kaleidoscope.tier_up", Type::getVoidTy(Ctx), Int64Ty, Int64Ty);
+    Builder.CreateCall(
+        Hook, {ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(this)),
+               ConstantInt::get(Int64Ty, reinterpret_cast<uintptr_t>(&TF))});
+  }
+
+  Error pointStubsAt(ArrayRef<std::string> Bodies, StringRef Suffix) {
+    auto Symbols = JIT.lookup(JD, Bodies);
+    if (!Symbols)
+      return Symbols.takeError();
+    for (auto &Body : Bodies) {
+      StringRef Name = StringRef(Body).drop_back(Suffix.size());
+      JITTargetAddress Address = (*Symbols)[JIT.mangle(Body)].getAddress();
+      if (auto Err = Stubs->updatePointer(Name, Address))
+        return Err;
+    }
+    return Error::success();
+  }
+
+  // Rebuild F from the retained IR in a fresh context, with every other
+  // exported function and global reduced to a declaration, optimize it at
+  // the top level and publish it.
+  Error promote(TieredFunction &TF) {
+    auto Begin = std::chrono::steady_clock::now();
+    auto Ctx = std::make_unique<LLVMContext>();
+    auto M = parseBitcodeFile(
+        MemoryBufferRef(StringRef(TF.Bitcode->data(), TF.Bitcode->size()),
+                        TF.Name),
+        *Ctx);
+    if (!M)
+      return M.takeError();
+    Function *Target = nullptr;
+    for (auto &F : **M) {
+      if (F.isDeclaration() || F.hasLocalLinkage())
+        continue;
+      if (F.getName() == TF.Name)
+        Target = &F;
+      else
+        F.deleteBody();
+    }
+    // exported globals (e.g. memo tables) stay shared with the baseline
+    for (auto &GV : (*M)->globals())
+      if (!GV.isDeclaration() && !GV.hasLocalLinkage())
+        GV.setInitializer(nullptr);
+    if (!Target)
+      return make_error<StringError>("no body for " + TF.Name,
+                                     inconvertibleErrorCode());
+    if (Profile)
+      Profile->annotate(*Target);
+    moveBodyBehindStub(*Target, TF.Name, "$tier1");
+    OptimizationPipeline(OptLevel, false).run(*Target);
+
+    if (auto Err = JIT.addModule(ThreadSafeModule(std::move(*M), std::move(Ctx)),
+                                 JD.createResourceTracker()))
+      return Err;
+    if (auto Err = pointStubsAt({TF.Name + "$tier1"}, "$tier1"))
+      return Err;
+
+    auto End = std::chrono::steady_clock::now();
+    std::lock_guard<std::mutex> Lock(QueueMutex);
+    Promotions.push_back(
+        {TF.Name, TF.Calls.load(std::memory_order_relaxed),
+         std::chrono::duration<double>(End - Start).count(),
+         std::chrono::duration<double>(End - Begin).count()});
+    return Error::success();
+  }
+
+  void promoteQueued() {
+    std::unique_lock<std::mutex> Lock(QueueMutex);
+    while (true) {
+      QueueChanged.wait(Lock, [this] { return Stopping || !Queue.empty(); });
+      if (Stopping)
+        return;
+      TieredFunction *TF = Queue.front();
+      Queue.pop_front();
+      Lock.unlock();
+      if (auto Err = promote(*TF))
+        logAllUnhandledErrors(std::move(Err), errs(), "tier-up failed: ");
+      Lock.lock();
+    }
+  }
+
+  // Called from JIT'd code, on the thread running it.
+  static void tierUpHook(uint64_t Self, uint64_t Function) {
+    auto *This = reinterpret_cast<TieredCompiler *>(Self);
+    auto *TF = reinterpret_cast<TieredFunction *>(Function);
+    // only the first of the calls racing past the threshold queues it
+    if (TF->Queued.exchange(true))
+      return;
+    {
+      std::lock_guard<std::mutex> Lock(This->QueueMutex);
+      This->Queue.push_back(TF);
+    }
+    This->QueueChanged.notify_one();
+  }
+
+  static void unresolvedStub() {
+    errs() << "tiered JIT: called a function before its baseline was ready\n";
+    abort();
+  }
+
+  KaleidoscopeJIT &JIT;
+  JITDylib &JD;
+  unsigned OptLevel;
+  uint64_t Threshold;
+  ProfileData *Profile;
+  std::unique_ptr<IndirectStubsManager> Stubs;
+  std::chrono::steady_clock::time_point Start;
+
+  mutable std::mutex QueueMutex;
+  std::condition_variable QueueChanged;
+  // deque: the baseline code holds pointers to these entries
+  std::deque<TieredFunction> Functions;
+  std::deque<TieredFunction *> Queue;
+  std::vector<Promotion> Promotions;
+  bool Stopping = false;
+  std::thread Worker;
+};
+
+} // end namespace orc
+} // end namespace llvm
+
+#endif
@@ -1,13 +1,6 @@
 #ifndef __jesse_token__
 #define __jesse_token__
-#include <cctype>
 #include <cstdint>
-#include <cstdio>
-#include <cstdlib>
-#include <functional>
-#include <sstream>
-#include <string>
-#include <iostream>
 enum Token : int32_t {
   tok_eof = -1,
 
@@ -18,62 +11,17 @@ enum Token : int32_t {
   // primary
   tok_identifier = -4,
   tok_number = -5,
-};
-
-static std::string identifier;
-static double numbValue;
-static char lastChar = ' ';
-
-static int getToken(std::function<char()> getchar) {
-  while (isspace(lastChar)) {
-    lastChar = getchar();
-  }
-
-  if (isalpha(lastChar)) { // [a-zA-Z][a-zA-Z0-9]*
-    identifier = lastChar;
-    while (isalnum((lastChar = getchar()))) {
-      identifier += lastChar;
-    }
-
-    if (identifier == "def") {
-      return Token::tok_def;
-    }
 
-    if (identifier == "extern") {
-      return Token::tok_extern;
-    }
+  // control flow
+  tok_if = -6,
+  tok_then = -7,
+  tok_else = -8,
+  tok_for = -9,
+  tok_in = -10,
 
-    return Token::tok_identifier;
-  }
-
-  // handle number
-  if (isdigit(lastChar) || lastChar == '.') { // number
-    std::stringstream numStr;
-    do {
-      numStr << (char)lastChar;
-      lastChar = getchar();
-    } while (isdigit(lastChar) || lastChar == '.');
-    numbValue = strtod(numStr.str().c_str(), 0);
-    return Token::tok_number;
-  }
-
-  // handle comments
-  if (lastChar == '#') {
-    // Comment until end of line.
-    do {
-      lastChar = getchar();
-    } while (lastChar != EOF && lastChar != '\n' && lastChar != '\r');
-  }
-
-  if (lastChar == EOF) {
-    return Token::tok_eof;
-  }
-
-  // cannot identifier any token, return its value
-  // step last char to next one, and return this char
-  int ThisChar = lastChar;
-  lastChar = getchar();
-  return ThisChar;
-}
+  // user-defined operators
+  tok_binary = -11,
+  tok_unary = -12,
+};
 
 #endif
\ No newline at end of file
@@ -0,0 +1,83 @@
+#ifndef __jesse_value_type__
+#define __jesse_value_type__
+
+#include <cstdint>
+#include <llvm/ADT/StringRef.h>
+#include <llvm/IR/DerivedTypes.h>
+#include <llvm/IR/LLVMContext.h>
+#include <llvm/IR/Type.h>
+#include <stdexcept>
+#include <string>
+
+// The scalar types of the language, written `f64`, `f32` and `i64` in
+// annotations. Everything unannotated is f64, except that a literal without
+// a suffix takes the type its context asks for.
+enum ValueType : uint8_t {
+  // not inferred yet; resolves to the context's type, f64 by default
+  VT_Unknown,
+  VT_F64,
+  VT_F32,
+  VT_I64,
+};
+
+inline const char *getValueTypeName(ValueType type) {
+  switch (type) {
+  case VT_Unknown:
+    return "?";
+  case VT_F64:
+    return "f64";
+  case VT_F32:
+    return "f32";
+  case VT_I64:
+    return "i64";
+  }
+  return "?";
+}
+
+// VT_Unknown if `name` is not a type name
+inline ValueType parseValueType(llvm::StringRef name) {
+  if (name == "f64") {
+    return VT_F64;
+  }
+  if (name == "f32") {
+    return VT_F32;
+  }
+  if (name == "i64") {
+    return VT_I64;
+  }
+  return VT_Unknown;
+}
+
+inline bool isFloatingType(ValueType type) {
+  return type == VT_F64 || type == VT_F32;
+}
+
+inline llvm::Type *getLLVMType(llvm::LLVMContext &context, ValueType type) {
+  switch (type) {
+  case VT_F32:
+    return llvm::Type::getFloatTy(context);
+  case VT_I64:
+    return llvm::Type::getInt64Ty(context);
+  case VT_Unknown:
+  case VT_F64:
+    break;
+  }
+  return llvm::Type::getDoubleTy(context);
+}
+
+// The type both sides of `what` agree on: an unknown side takes the other
+// one's type. Two different known types are an error; conversions are
+// explicit, e.g. f64(n).
+inline ValueType unifyTypes(ValueType a, ValueType b, llvm::StringRef what) {
+  if (a == VT_Unknown || a == b) {
+    return b;
+  }
+  if (b == VT_Unknown) {
+    return a;
+  }
+  throw std::runtime_error("type mismatch in " + what.str() + ": " +
+                           getValueTypeName(a) + " and " +
+                           getValueTypeName(b));
+}
+
+#endif
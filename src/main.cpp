@@ -1,11 +1,20 @@
 #include "./KaleidoscopeJIT.hpp"
+#include "AOTCompiler.hpp"
 #include "AST.hpp"
-#include "Precedence.hpp"
-#include "Token.hpp"
+#include "CodeCache.hpp"
+#include "CompilerSession.hpp"
+#include "HostTarget.hpp"
+#include "Interpreter.hpp"
+#include "Parser.hpp"
+#include "ProfileData.hpp"
+#include "StreamingCompiler.hpp"
+#include "TieredCompiler.hpp"
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <fstream>
-#include <functional>
 #include <iostream>
 #include <iterator>
 #include <llvm/Bitcode/BitcodeWriter.h>
@@ -13,360 +22,999 @@
 #include <llvm/IR/LLVMContext.h>
 #include <llvm/IR/LegacyPassManager.h>
 #include <llvm/IR/Module.h>
+#include <llvm/Support/CommandLine.h>
 #include <llvm/Support/FileUtilities.h>
+#include <llvm/Support/Format.h>
+#include <llvm/Support/MemoryBuffer.h>
+#include <llvm/Support/Path.h>
 #include <llvm/Support/TargetSelect.h>
 #include <llvm/Support/raw_ostream.h>
 #include <llvm/Transforms/InstCombine/InstCombine.h>
 #include <llvm/Transforms/Scalar.h>
 #include <memory>
+#include <mutex>
 #include <stdexcept>
+#include <sys/resource.h>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
-extern double numbValue;
-
-static int currentToken;
-static int getNextToken(std::function<char()> getchar) {
-  currentToken = getToken(getchar);
-  return currentToken;
-}
-
-static PrecedenceParser precedenceParser;
+// declared first so that it outlives the JIT, which records into it
+static std::unique_ptr<CompileTelemetry> Telemetry;
+// counters that JIT'd code increments, and the profile read for --profile-use
+static std::unique_ptr<ProfileData> Profile;
 static std::unique_ptr<llvm::orc::KaleidoscopeJIT> TheJIT;
-
-static int getTokenPrecedence() {
-  return precedenceParser.getOpPrecedence(static_cast<char>(currentToken));
-}
-
-static std::unique_ptr<ExpressAST>
-parseNumberExpression(std::function<char()> getchar) {
-  auto result = std::make_unique<NumberExpressionAST>(numbValue);
-  getNextToken(getchar); // consumed this number token
-  return std::move(result);
-}
-
-static std::unique_ptr<PrototypeAST>
-parsePrototype(std::function<char()> getchar) {
-  if (currentToken != Token::tok_identifier) {
-    throw new std::runtime_error("function define must have identifier");
-  }
-  std::string functionName = identifier;
-  getNextToken(getchar);
-
-  if (currentToken != '(') {
-    throw new std::runtime_error("Expected '(' in prototype");
-  }
-
-  std::vector<std::string> argNames;
-  while (getNextToken(getchar) == Token::tok_identifier) {
-    argNames.push_back(identifier);
-  }
-
-  if (currentToken != ')') {
-    throw new std::runtime_error("Expected ')' in prototype");
-  }
-  getNextToken(getchar);
-  return std::make_unique<PrototypeAST>(std::move(functionName),
-                                        std::move(argNames));
-}
-
-static std::unique_ptr<ExpressAST>
-parseExpression(std::function<char()> getchar);
-
-static std::unique_ptr<FunctionAST>
-parseFunction(std::function<char()> getchar) {
-  getNextToken(getchar);
-  auto prototype = parsePrototype(getchar);
-  if (auto expression = parseExpression(getchar)) {
-    return std::make_unique<FunctionAST>(std::move(prototype),
-                                         std::move(expression));
+// CPU, features, code model and codegen level chosen on the command line
+static llvm::Optional<llvm::orc::JITTargetMachineBuilder> Target;
+
+static llvm::cl::list<std::string> InputFiles(llvm::cl::Positional,
+                                              llvm::cl::desc("[scripts...]"));
+static llvm::cl::opt<unsigned>
+    Jobs("j", llvm::cl::desc("Scripts compiled concurrently (0 = all cores)"),
+         llvm::cl::init(0));
+static llvm::cl::opt<bool> ModulePerFunction(
+    "module-per-function",
+    llvm::cl::desc("Emit every def into its own module so that the JIT can "
+                   "compile them in parallel"));
+static llvm::cl::opt<unsigned> CompileThreads(
+    "compile-threads",
+    llvm::cl::desc("JIT compile threads (0 = compile on the calling thread)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<bool>
+    Lazy("lazy", llvm::cl::desc("Compile functions on their first call"));
+static llvm::cl::opt<std::string>
+    ObjectCacheDir("object-cache",
+                   llvm::cl::desc("Directory caching compiled objects"),
+                   llvm::cl::value_desc("dir"));
+
+static llvm::cl::opt<unsigned>
+    OptLevel("O", llvm::cl::desc("Optimization level (0-3)"), llvm::cl::Prefix,
+             llvm::cl::init(2));
+// named apart from LLVM's own -inline-threshold, also registered here
+static llvm::cl::opt<int> InlineBudget(
+    "inline-budget",
+    llvm::cl::desc("Inline cost threshold per call site (default: that of "
+                   "the -O level)"),
+    llvm::cl::init(-1));
+static llvm::cl::opt<unsigned> InlineImportLimit(
+    "inline-import-limit",
+    llvm::cl::desc("Largest def, in IR instructions, kept for inlining into "
+                   "modules compiled after it (0 = none)"),
+    llvm::cl::init(64));
+static llvm::cl::opt<std::string>
+    CPU("mcpu",
+        llvm::cl::desc("CPU to generate code for (default: the host's, with "
+                       "all of its features; for --emit-* the baseline of "
+                       "the architecture, e.g. x86-64; native for the "
+                       "host's)"),
+        llvm::cl::value_desc("name"));
+static llvm::cl::opt<std::string> Features(
+    "mattr",
+    llvm::cl::desc("Target features to enable or disable on top of the "
+                   "CPU's, e.g. -avx512f,+fma"),
+    llvm::cl::value_desc("+a,-b,..."));
+static llvm::cl::opt<llvm::CodeModel::Model> CodeModel(
+    "code-model", llvm::cl::desc("Code model (default: the target's)"),
+    llvm::cl::values(clEnumValN(llvm::CodeModel::Small, "small", "Small"),
+                     clEnumValN(llvm::CodeModel::Kernel, "kernel", "Kernel"),
+                     clEnumValN(llvm::CodeModel::Medium, "medium", "Medium"),
+                     clEnumValN(llvm::CodeModel::Large, "large", "Large")));
+static llvm::cl::opt<int> CodeGenOptLevel(
+    "codegen-opt",
+    llvm::cl::desc("Code generator optimization level (0-3, default: that "
+                   "of -O)"),
+    llvm::cl::init(-1));
+static llvm::cl::opt<bool>
+    PrintTarget("print-target",
+                llvm::cl::desc("Print the target triple, CPU and features "
+                               "code is generated for"));
+
+static llvm::cl::opt<bool> TimePasses(
+    "pass-timing",
+    llvm::cl::desc("Report the time spent in each optimization pass"));
+static llvm::cl::opt<bool>
+    Tiered("tiered",
+           llvm::cl::desc("Start functions unoptimized and recompile hot ones "
+                          "at -O in the background"));
+static llvm::cl::opt<uint64_t> TierUpThreshold(
+    "tier-up-threshold",
+    llvm::cl::desc("Calls after which a function is recompiled (--tiered)"),
+    llvm::cl::init(1000));
+static llvm::cl::opt<bool> Interpret(
+    "interpret",
+    llvm::cl::desc("Interpret defs and top-level expressions and compile "
+                   "only the defs that get hot"));
+static llvm::cl::opt<uint64_t> PromoteThreshold(
+    "promote-threshold",
+    llvm::cl::desc("Calls plus loop iterations after which an interpreted "
+                   "def is compiled (--interpret, 0 = never)"),
+    llvm::cl::init(1000));
+
+static llvm::cl::opt<bool>
+    Repl("repl", llvm::cl::desc("Compile and run statements read from stdin "
+                                "one at a time"));
+static llvm::cl::opt<uint64_t> CodeCacheBudget(
+    "code-cache-budget",
+    llvm::cl::desc("Bytes of code and data the defs of the REPL may keep "
+                   "compiled; the least recently used are dropped and "
+                   "compiled again when next called (0 = unlimited)"),
+    llvm::cl::init(0));
+static llvm::cl::opt<bool> Memoize(
+    "memoize",
+    llvm::cl::desc("Cache results of pure functions that recurse outside "
+                   "tail position"));
+static llvm::cl::opt<uint64_t> MemoTableSize(
+    "memo-table-size",
+    llvm::cl::desc("Entries of each memo table, a power of two (--memoize)"),
+    llvm::cl::init(4096));
+
+static llvm::cl::opt<bool> Stream(
+    "stream",
+    llvm::cl::desc("Compile each script (- for stdin) while it is read, "
+                   "with reading, parsing, codegen and JIT on separate "
+                   "threads"));
+static llvm::cl::opt<uint64_t> StreamChunkSize(
+    "stream-chunk-size",
+    llvm::cl::desc("Bytes read at a time (--stream)"),
+    llvm::cl::init(1 << 20));
+static llvm::cl::opt<unsigned> StreamQueueDepth(
+    "stream-queue-depth",
+    llvm::cl::desc("Work items buffered between two stages (--stream)"),
+    llvm::cl::init(4));
+static llvm::cl::opt<bool>
+    Mmap("mmap", llvm::cl::desc("Map script files instead of reading them "
+                                "(--stream)"));
+
+static llvm::cl::opt<bool> EmitObj(
+    "emit-obj",
+    llvm::cl::desc("Compile each script ahead of time into an object file "
+                   "and a C header next to it instead of running it"));
+static llvm::cl::opt<bool> EmitBC(
+    "emit-bc",
+    llvm::cl::desc("Compile each script ahead of time into a bitcode file "
+                   "and a C header next to it instead of running it"));
+static llvm::cl::opt<bool> EmitLib(
+    "emit-lib",
+    llvm::cl::desc("Compile all scripts ahead of time into one static "
+                   "library and a C header instead of running them"));
+static llvm::cl::opt<std::string> OutputFile(
+    "o",
+    llvm::cl::desc("Output of --emit-lib (default libkaleidoscope.a), or of "
+                   "--emit-obj/--emit-bc for a single script"),
+    llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<std::string> TelemetryFile(
+    "telemetry",
+    llvm::cl::desc("Write the time and count of every compile phase and the "
+                   "code sizes to a file (- for stdout)"),
+    llvm::cl::value_desc("file"));
+enum class TelemetryFormat { JSON, Chrome };
+static llvm::cl::opt<TelemetryFormat> TelemetryFormatOpt(
+    "telemetry-format", llvm::cl::desc("Format of --telemetry"),
+    llvm::cl::values(
+        clEnumValN(TelemetryFormat::JSON, "json", "phase totals and counters"),
+        clEnumValN(TelemetryFormat::Chrome, "chrome",
+                   "Chrome trace events with every phase")),
+    llvm::cl::init(TelemetryFormat::JSON));
+static llvm::cl::opt<std::string> ProfileGenerate(
+    "profile-generate",
+    llvm::cl::desc("Count calls, branches and call sites while the scripts "
+                   "run and write the profile to a file"),
+    llvm::cl::value_desc("file"));
+static llvm::cl::opt<std::string> ProfileUse(
+    "profile-use",
+    llvm::cl::desc("Optimize with the branch weights and inlining hints of a "
+                   "profile written by --profile-generate"),
+    llvm::cl::value_desc("file"));
+
+static llvm::cl::opt<bool>
+    DumpAST("dump-ast", llvm::cl::desc("Print every def as it is parsed"));
+static llvm::cl::opt<bool>
+    DumpIR("dump-ir",
+           llvm::cl::desc("Print the module to stderr after every top-level "
+                          "expression"));
+
+static CompileOptions compileOptions() {
+  CompileOptions options;
+  options.modulePerFunction = ModulePerFunction;
+  // with --tiered the baseline is unoptimized and -O applies to tier 1
+  options.optLevel = Tiered ? 0 : unsigned(OptLevel);
+  options.timePasses = TimePasses;
+  options.inlineThreshold = InlineBudget;
+  options.inlineImportLimit = InlineImportLimit;
+  options.target = Target;
+  options.memoize = Memoize;
+  options.memoTableSize = MemoTableSize;
+  options.telemetry = Telemetry.get();
+  // with --tiered the TieredCompiler profiles and uses the profile itself
+  if (!Tiered) {
+    if (!ProfileGenerate.empty()) {
+      options.profileCounters = Profile.get();
+    }
+    if (!ProfileUse.empty()) {
+      options.profile = Profile.get();
+    }
   }
-  return nullptr;
+  return options;
 }
 
-static std::unique_ptr<PrototypeAST>
-parseExtern(std::function<char()> getchar) {
-  getNextToken(getchar); // eat extern
-  return parsePrototype(getchar);
+static llvm::orc::KaleidoscopeJIT::Options jitOptions() {
+  llvm::orc::KaleidoscopeJIT::Options options;
+  options.CompileThreads = CompileThreads;
+  options.Lazy = Lazy;
+  options.ObjectCacheDir = ObjectCacheDir;
+  options.Telemetry = Telemetry.get();
+  options.Target = Target;
+  return options;
 }
 
-static std::unique_ptr<FunctionAST>
-parseToplevelAST(std::function<char()> getchar) {
-
-  if (auto expression = parseExpression(getchar)) {
-    auto Proto = std::make_unique<PrototypeAST>("__anon_expr",
-                                                std::vector<std::string>());
-    return std::make_unique<FunctionAST>(std::move(Proto),
-                                         std::move(expression));
-  }
-  return nullptr;
+// TheJIT, created on first use: with --interpret a run may never need it.
+// Safe to call from several threads.
+static llvm::orc::KaleidoscopeJIT &getJIT() {
+  static std::once_flag created;
+  std::call_once(created, []() {
+    auto jit = llvm::orc::KaleidoscopeJIT::Create(jitOptions());
+    if (!jit) {
+      throw std::runtime_error(llvm::toString(jit.takeError()));
+    }
+    TheJIT = std::move(*jit);
+  });
+  return *TheJIT;
 }
 
 // top ::= function define | external function | expression | ; | EOF
-static void driver(std::function<char()> getchar) {
+static void driver(CompilerSession &session) {
   while (true) {
-    switch (currentToken) {
+    switch (session.currentToken) {
     case Token::tok_eof:
       return;
     case ';': {
-      getNextToken(getchar);
+      session.getNextToken();
       break;
     }
     case Token::tok_def: {
-      auto function = parseFunction(getchar);
-      function->codegen();
-      if (function) {
+      auto function = parseFunction(session);
+      function->codegen(session);
+      if (DumpAST) {
         std::cout << function->getText() << std::endl;
       }
+      if (session.options.modulePerFunction) {
+        session.finishModule();
+      }
       break;
     }
     case Token::tok_extern: {
-      auto ext = parseExtern(getchar);
-      ext->getText();
+      auto ext = parseExtern(session);
+      session.FunctionProtos.set(ext->getSymbol(), ext);
+      if (DumpAST) {
+        std::cout << ext->getText() << std::endl;
+      }
       break;
     }
     default: {
-      auto function = parseToplevelAST(getchar);
-      function->codegen();
-      TheModule->print(llvm::errs(), nullptr);
-      if (function) {
-        function->getText();
+      // Every top-level expression goes into a module of its own, which
+      // runExpressions() runs and drops in turn, so that a script may have
+      // several although each defines __anon_expr.
+      if (!session.TheModule->empty()) {
+        if (DumpIR) {
+          session.TheModule->print(llvm::errs(), nullptr);
+        }
+        session.finishModule();
+      }
+      auto function = parseToplevelAST(session);
+      function->codegen(session);
+      if (DumpIR) {
+        session.TheModule->print(llvm::errs(), nullptr);
       }
+      session.finishExpression();
       break;
     }
     }
   }
 }
 
-static std::unique_ptr<ExpressAST>
-parseIdentifierExpression(std::function<char()> getchar);
-static std::unique_ptr<ExpressAST>
-parseParenExpression(std::function<char()> getchar);
-
-static std::unique_ptr<ExpressAST> parsePrimary(std::function<char()> getchar) {
-  switch (currentToken) {
-  case Token::tok_identifier:
-    return parseIdentifierExpression(getchar);
-  case Token::tok_number:
-    return parseNumberExpression(getchar);
-  case '(':
-    return parseParenExpression(getchar);
-  default:
-    return nullptr;
-  }
+int precedenceParse() {
+  CompilerSession session("a/b-c*d;\n");
+  session.getNextToken();
+  auto parsedExpression = parseExpression(session);
+  std::cout << parsedExpression->getText() << std::endl;
+  return 0;
 }
 
-static std::unique_ptr<ExpressAST>
-parseIdentifierExpression(std::function<char()> getchar) {
-  std::string identifierName = identifier;
-  getNextToken(getchar);
-  if (currentToken != '(') { // not call, variable expression
-    return std::make_unique<VariableExprAST>(identifierName);
-  } else {
-    // call expression
-    getNextToken(getchar);
-    std::vector<std::unique_ptr<ExpressAST>> args;
-    if (currentToken != ')') {
-      while (true) {
-        if (auto arg = parseExpression(getchar)) {
-          args.push_back(std::move(arg));
-        } else {
-          return nullptr;
-        }
+static const char *builtinScript = R"(
+    def fib(x) 
+      2 * x ;
+    fib(42);
+  )";
 
-        if (currentToken == ')') {
-          break;
-        }
+int driverParse(CompilerSession &session) {
+  session.getNextToken();
+  driver(session);
+  // the module holds everything we need now, drop the whole AST at once
+  session.resetAST();
 
-        if (currentToken != ',') {
-          throw std::runtime_error("arguments expression error");
+  return 0;
+}
+
+static llvm::ExitOnError ExitOnErr;
+
+// Hand every module of the session to the JIT and materialize all of their
+// definitions with a single lookup, so the compile threads get all modules
+// at once. With a tiered compiler the modules go through its stubs instead.
+static llvm::Error addModules(CompilerSession &session,
+                              llvm::orc::ResourceTrackerSP tracker,
+                              llvm::orc::TieredCompiler *tiered = nullptr) {
+  std::vector<std::string> definitions;
+  for (auto &module : session.takeModules()) {
+    if (tiered) {
+      if (auto err = tiered->addModule(std::move(module))) {
+        return err;
+      }
+      continue;
+    }
+    module.withModuleDo([&definitions](llvm::Module &M) {
+      for (auto &F : M) {
+        if (!F.isDeclaration() && !F.hasLocalLinkage()) {
+          definitions.push_back(F.getName().str());
         }
-        getNextToken(getchar);
       }
+    });
+    if (auto err = TheJIT->addModule(std::move(module), tracker)) {
+      return err;
     }
-    getNextToken(getchar); // eat )
-    return std::make_unique<CallExprAST>(identifierName, std::move(args));
   }
+  return TheJIT->lookup(tracker->getJITDylib(), definitions).takeError();
 }
 
-// parenexpr ::= '(' expression ')'
-static std::unique_ptr<ExpressAST>
-parseParenExpression(std::function<char()> getchar) {
-  getNextToken(getchar); // eat (
-  auto v = parseExpression(getchar);
-  if (!v) {
-    return nullptr;
-  } else {
-    if (currentToken != ')') {
-      throw std::runtime_error("incorrect () expression");
+// Run the top-level expressions of the session in source order, once its
+// defs are in `dylib`. Returns the value of the last, 0 if there is none.
+static double runExpressions(CompilerSession &session,
+                             llvm::orc::JITDylib &dylib) {
+  double value = 0;
+  for (auto &module : session.takeExpressionModules()) {
+    value = runExpressionModule(*TheJIT, dylib, std::move(module));
+  }
+  return value;
+}
+
+// Hit rate of every memo table of the session, read from its counters.
+static void printMemoStats(CompilerSession &session,
+                           llvm::orc::JITDylib &dylib, llvm::raw_ostream &os) {
+  for (auto &name : session.MemoizedFunctions) {
+    auto hits = TheJIT->lookup(dylib, llvm::StringRef(memoHitsName(name)));
+    auto misses =
+        TheJIT->lookup(dylib, llvm::StringRef(memoMissesName(name)));
+    if (!hits || !misses) {
+      llvm::consumeError(hits.takeError());
+      llvm::consumeError(misses.takeError());
+      continue;
     }
+    uint64_t hitCount = *(uint64_t *)hits->getAddress();
+    uint64_t missCount = *(uint64_t *)misses->getAddress();
+    uint64_t calls = hitCount + missCount;
+    os << "memo: " << name << " " << hitCount << " hits, " << missCount
+       << " misses ("
+       << llvm::format("%.1f", calls ? 100.0 * hitCount / calls : 0.0)
+       << "% hit rate)\n";
   }
-  return v;
 }
 
-int parseRealScript() {
-  std::ifstream input(
-      "/home/jesse/Documents/workspace/Kaleidoscope/testscript/test.kl");
-  if (!input) {
-    std::cerr << "cannot open file\n";
-    return 1;
+// The builtin script through the Interpreter; its hot defs are compiled
+// into the main JITDylib.
+static void interpretBuiltin() {
+  CompilerSession session(builtinScript, "my cool jit", compileOptions());
+  Interpreter interpreter(session, PromoteThreshold, []() {
+    llvm::orc::KaleidoscopeJIT &jit = getJIT();
+    return Interpreter::JITTarget{&jit, &jit.getMainJITDylib()};
+  });
+  int returnVal = interpretStatements(session, interpreter);
+  std::cout << "interpreter result: " << returnVal << std::endl;
+  interpreter.printPromotions(llvm::errs());
+  if (TheJIT) {
+    printMemoStats(session, TheJIT->getMainJITDylib(), llvm::errs());
   }
-  input.seekg(0, std::ios::end);
-  uint32_t size{static_cast<uint32_t>(input.tellg()) + 1U};
-  input.seekg(0, std::ios::beg);
-  std::unique_ptr<char[]> content(new char[size]{});
-  uint32_t pos = 0;
+}
 
-  input.read(content.get(), size);
-  input.close();
+void compileAndCallJIT(){
+  TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(jitOptions()));
+  CompilerSession session(builtinScript, "my cool jit", compileOptions());
+  session.TheModule->setDataLayout(TheJIT->getDataLayout());
+  driverParse(session);
+  if (session.options.timePasses) {
+    session.optimizer.printTimings(llvm::errs());
+  }
+  auto resourceTracker = TheJIT->getMainJITDylib().createResourceTracker();
+  std::unique_ptr<llvm::orc::TieredCompiler> tiered;
+  if (Tiered) {
+    tiered = std::make_unique<llvm::orc::TieredCompiler>(
+        *TheJIT, TheJIT->getMainJITDylib(), OptLevel, TierUpThreshold,
+        Profile.get());
+  }
+  ExitOnErr(addModules(session, resourceTracker, tiered.get()));
+  int returnVal = runExpressions(session, TheJIT->getMainJITDylib());
+  std::cout << "jit compiler result: " << returnVal << std::endl;
+  if (tiered) {
+    tiered->printPromotions(llvm::errs());
+  }
+  printMemoStats(session, TheJIT->getMainJITDylib(), llvm::errs());
+}
 
-  auto getchar = [&pos, &content, &size]() {
-    if (pos < size) {
-      char chr = (char)(*(content.get() + pos));
-      pos++;
-      return chr;
-    } else {
-      return static_cast<char>(EOF);
+template <typename T> static T throwOnError(llvm::Expected<T> value) {
+  if (!value) {
+    throw std::runtime_error(llvm::toString(value.takeError()));
+  }
+  return *value;
+}
+
+struct ScriptResult {
+  double value = 0;
+  // from reading the file until its defs are compiled, or with
+  // --interpret until it can run
+  double startupSeconds = 0;
+};
+
+// Run one script in the Interpreter. The JITDylib its hot defs are compiled
+// into is only created with the first of them. Safe to call from several
+// threads.
+static ScriptResult interpretScript(const std::string &path, size_t index) {
+  auto start = std::chrono::steady_clock::now();
+  auto content = llvm::MemoryBuffer::getFile(path);
+  if (!content) {
+    throw std::runtime_error("cannot open file " + path);
+  }
+  auto buffer = (*content)->getBuffer();
+  CompilerSession session(std::string_view(buffer.data(), buffer.size()),
+                          path, compileOptions());
+  llvm::orc::JITDylib *dylib = nullptr;
+  Interpreter interpreter(session, PromoteThreshold, [&]() {
+    llvm::orc::KaleidoscopeJIT &jit = getJIT();
+    dylib = &throwOnError<llvm::orc::JITDylib &>(
+        jit.createJITDylib(std::to_string(index) + ":" + path));
+    return Interpreter::JITTarget{&jit, dylib};
+  });
+  ScriptResult result;
+  // the interpreter runs each statement as soon as it is parsed
+  result.startupSeconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+  result.value = interpretStatements(session, interpreter);
+  std::string report;
+  llvm::raw_string_ostream os(report);
+  if (!interpreter.getPromotions().empty()) {
+    interpreter.printPromotions(os);
+  }
+  if (dylib) {
+    printMemoStats(session, *dylib, os);
+  }
+  llvm::errs() << os.str();
+  return result;
+}
+
+// Compile one script in its own session and JITDylib, then run its top-level
+// expressions. Safe to call from several threads sharing TheJIT.
+static ScriptResult compileAndRunScript(const std::string &path,
+                                        size_t index) {
+  if (Interpret) {
+    return interpretScript(path, index);
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto content = llvm::MemoryBuffer::getFile(path);
+  if (!content) {
+    throw std::runtime_error("cannot open file " + path);
+  }
+  auto buffer = (*content)->getBuffer();
+  CompilerSession session(std::string_view(buffer.data(), buffer.size()),
+                          path, compileOptions());
+  session.TheModule->setDataLayout(TheJIT->getDataLayout());
+  driverParse(session);
+  if (session.options.timePasses) {
+    // one write per script, so concurrent reports do not interleave
+    std::string report;
+    llvm::raw_string_ostream os(report);
+    os << path << " ";
+    session.optimizer.printTimings(os);
+    llvm::errs() << os.str();
+  }
+
+  auto &dylib = throwOnError<llvm::orc::JITDylib &>(
+      TheJIT->createJITDylib(std::to_string(index) + ":" + path));
+  std::unique_ptr<llvm::orc::TieredCompiler> tiered;
+  if (Tiered) {
+    tiered = std::make_unique<llvm::orc::TieredCompiler>(
+        *TheJIT, dylib, OptLevel, TierUpThreshold, Profile.get());
+  }
+  if (auto err = addModules(session, dylib.getDefaultResourceTracker(),
+                            tiered.get())) {
+    throw std::runtime_error(llvm::toString(std::move(err)));
+  }
+  ScriptResult result;
+  result.startupSeconds = std::chrono::duration<double>(
+                              std::chrono::steady_clock::now() - start)
+                              .count();
+  result.value = runExpressions(session, dylib);
+  std::string report;
+  llvm::raw_string_ostream os(report);
+  if (tiered) {
+    tiered->printPromotions(os);
+  }
+  printMemoStats(session, dylib, os);
+  llvm::errs() << os.str();
+  return result;
+}
+
+static bool compileScripts(const std::vector<std::string> &paths,
+                           unsigned jobs) {
+  if (jobs == 0) {
+    jobs = std::max(1U, std::thread::hardware_concurrency());
+  }
+  jobs = std::min<size_t>(jobs, paths.size());
+
+  std::vector<ScriptResult> results(paths.size());
+  std::vector<std::string> errors(paths.size());
+  std::atomic<size_t> nextScript{0};
+  auto worker = [&]() {
+    for (size_t i; (i = nextScript++) < paths.size();) {
+      try {
+        results[i] = compileAndRunScript(paths[i], i);
+      } catch (const std::exception &e) {
+        errors[i] = e.what();
+      }
     }
   };
 
-  currentToken = getToken(getchar);
-  while (true) {
-    switch (currentToken) {
-    case tok_eof:
-      return 0;
-    case ';':
-      currentToken = getToken(getchar);
-    case tok_extern:
-      printf("extern\n");
-      currentToken = getToken(getchar);
-      break;
-    case tok_def:
-      printf("def\n");
-      currentToken = getToken(getchar);
-      break;
-    default:
-      printf("expression: %c\n", (char)currentToken);
-      currentToken = getToken(getchar);
-      break;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> workers;
+  for (unsigned i = 0; i < jobs; i++) {
+    workers.emplace_back(worker);
+  }
+  for (auto &thread : workers) {
+    thread.join();
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  bool ok = true;
+  for (size_t i = 0; i < paths.size(); i++) {
+    if (errors[i].empty()) {
+      std::cout << paths[i] << ": " << results[i].value << " (startup "
+                << results[i].startupSeconds * 1000 << " ms)" << std::endl;
+    } else {
+      std::cerr << paths[i] << ": error: " << errors[i] << std::endl;
+      ok = false;
     }
   }
+  std::cout << "compiled " << paths.size() << " scripts on " << jobs
+            << " threads in " << elapsed.count() << "s" << std::endl;
+  if (auto *cache = TheJIT ? TheJIT->getObjectCache() : nullptr) {
+    std::cout << "object cache: " << cache->getHits() << " hits, "
+              << cache->getMisses() << " misses, " << cache->getWrites()
+              << " writes" << std::endl;
+  }
+  return ok;
 }
 
-static std::unique_ptr<ExpressAST>
-parseBinaryRHS(int expressionPrecedence, std::unique_ptr<ExpressAST> LHS,
-               std::function<char()> getchar) {
-  while (true) {
-    int currentOperatorPrecedence = getTokenPrecedence();
-    if (currentOperatorPrecedence < expressionPrecedence) {
-      // 唯一出口，当当前处理的token不是二元操作符的时候
-      return LHS;
-    }
-
-    int ope = currentToken;
-    getNextToken(getchar);
-    auto RHS = parsePrimary(getchar);
-    if (!RHS) {
-      return nullptr;
-    }
-    int nextOperatorPrecedence = getTokenPrecedence();
-    if (currentOperatorPrecedence < nextOperatorPrecedence) {
-      // a+b*c
-      // 如果当前是+下一个是*,
-      // 则将当前的RHS当作下一个操作的LHS进行处理，得到新的RHS
-      // 为了让1+2+3中，1+2成为一个LHS，需要将Current operator precedence调高1
-      RHS = parseBinaryRHS(currentOperatorPrecedence + 1, std::move(RHS),
-                           getchar);
-    }
-    LHS = std::make_unique<BinaryExprAST>(static_cast<char>(ope),
-                                          std::move(LHS), std::move(RHS));
-  }
-  return nullptr;
+#include <llvm/ExecutionEngine/JITSymbol.h>
+// A line with a ';' outside of a comment completes the pending statements.
+static bool endsStatement(const std::string &line) {
+  size_t semicolon = line.find(';');
+  return semicolon != std::string::npos && semicolon < line.find('#');
 }
 
-static std::unique_ptr<ExpressAST>
-parseExpression(std::function<char()> getchar) {
-  auto LHS = parsePrimary(getchar);
-  if (!LHS) {
-    return nullptr;
+struct ReplStats {
+  uint64_t statements = 0;
+  uint64_t expressions = 0;
+  double totalSeconds = 0;
+  double maxSeconds = 0;
+};
+
+// Compile one statement of the REPL. A def goes into a module of its own
+// that stays in the JIT, or in the code cache if there is one; a top-level
+// expression goes into a throwaway module under its own ResourceTracker,
+// which is removed once it has run.
+static void evaluateStatement(CompilerSession &session,
+                              llvm::orc::JITDylib &dylib,
+                              llvm::orc::CodeCache *cache, ReplStats &stats) {
+  switch (session.currentToken) {
+  case Token::tok_def: {
+    // A def that fails, up to the JIT refusing its module (say, as a
+    // duplicate definition), leaves neither its operator nor its prototype,
+    // purity or retained body behind: the parser registers the operator
+    // before the body is parsed, codegen the prototype before the body is
+    // compiled, and nextModule() keeps the body before the JIT sees it.
+    PrecedenceParser operators = session.precedenceParser;
+    FunctionAST *function = nullptr;
+    PrototypeAST *previous = nullptr;
+    llvm::Optional<bool> previousPurity;
+    size_t memoized = session.MemoizedFunctions.size();
+    bool handedOver = false;
+    try {
+      function = parseFunction(session);
+      if (!function) {
+        throw std::runtime_error("invalid function definition");
+      }
+      Symbol name = function->getProto()->getSymbol();
+      previous = session.FunctionProtos.lookup(name);
+      if (const bool *pure = session.PureFunctions.find(name)) {
+        previousPurity = *pure;
+      }
+      if (!function->codegen(session)) {
+        throw std::runtime_error("invalid function definition");
+      }
+      llvm::orc::ThreadSafeModule module = session.nextModule();
+      handedOver = true;
+      auto err = cache ? cache->addModule(std::move(module))
+                       : TheJIT->addModule(std::move(module),
+                                           dylib.getDefaultResourceTracker());
+      if (err) {
+        throw std::runtime_error(llvm::toString(std::move(err)));
+      }
+    } catch (...) {
+      session.precedenceParser = operators;
+      session.MemoizedFunctions.resize(memoized);
+      if (function) {
+        Symbol name = function->getProto()->getSymbol();
+        if (previous) {
+          session.FunctionProtos.set(name, previous);
+        } else {
+          session.FunctionProtos.erase(name);
+        }
+        if (previousPurity) {
+          session.PureFunctions.set(name, *previousPurity);
+        } else {
+          session.PureFunctions.erase(name);
+        }
+      }
+      if (handedOver) {
+        session.rejectModule();
+      }
+      throw;
+    }
+    break;
+  }
+  case Token::tok_extern: {
+    auto ext = parseExtern(session);
+    session.FunctionProtos.set(ext->getSymbol(), ext);
+    break;
+  }
+  default: {
+    auto function = parseToplevelAST(session);
+    if (!function || !function->codegen(session)) {
+      throw std::runtime_error("invalid expression");
+    }
+    llvm::orc::ThreadSafeModule module = session.nextModule();
+    if (cache) {
+      module.withModuleDo([cache](llvm::Module &M) { cache->touch(M); });
+    }
+    std::cout << runExpressionModule(*TheJIT, dylib, std::move(module))
+              << std::endl;
+    stats.expressions++;
+    if (cache) {
+      if (auto err = cache->enforceBudget()) {
+        throw std::runtime_error(llvm::toString(std::move(err)));
+      }
+    }
+    break;
+  }
   }
-  return parseBinaryRHS(0, std::move(LHS), getchar);
 }
 
-int precedenceParse() {
+// Run every statement in `text`. An error drops the rest of it.
+static void evaluateStatements(CompilerSession &session,
+                               llvm::orc::JITDylib &dylib,
+                               llvm::orc::CodeCache *cache,
+                               std::string_view text, ReplStats &stats) {
+  session.setSource(text);
+  session.getNextToken();
+  while (session.currentToken != Token::tok_eof) {
+    if (session.currentToken == ';') {
+      session.getNextToken();
+      continue;
+    }
+    auto start = std::chrono::steady_clock::now();
+    try {
+      evaluateStatement(session, dylib, cache, stats);
+    } catch (const std::exception &e) {
+      std::cerr << "error: " << e.what() << std::endl;
+      session.discardModule(); // may hold a half-built function
+      session.resetStatementAST();
+      return;
+    }
+    double seconds = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - start)
+                         .count();
+    stats.statements++;
+    stats.totalSeconds += seconds;
+    stats.maxSeconds = std::max(stats.maxSeconds, seconds);
+    session.resetStatementAST();
+  }
+}
 
-  std::stringstream contentStream;
-  contentStream << "a/b-c*d;\n";
-  contentStream << EOF;
-  std::string str = contentStream.str();
-  int pos = 0;
-  int size = str.size();
-
-  auto getchar = [&pos, &str, &size]() {
-    if (pos < size) {
-      char chr = str.at(pos);
-      pos++;
-      return chr;
-    } else {
-      return static_cast<char>(EOF);
+static void runRepl(std::istream &in) {
+  CompilerSession session("", "repl", compileOptions());
+  session.TheModule->setDataLayout(TheJIT->getDataLayout());
+  auto &dylib = TheJIT->getMainJITDylib();
+  std::unique_ptr<llvm::orc::CodeCache> cache;
+  if (CodeCacheBudget) {
+    cache = std::make_unique<llvm::orc::CodeCache>(*TheJIT, dylib,
+                                                   CodeCacheBudget);
+  }
+  ReplStats stats;
+  std::string pending;
+  std::string line;
+  while (std::getline(in, line)) {
+    pending += line;
+    pending += '\n';
+    if (endsStatement(line)) {
+      evaluateStatements(session, dylib, cache.get(), pending, stats);
+      pending.clear();
     }
-  };
-  getNextToken(getchar);
-  auto parsedExpression = parseExpression(getchar);
-  std::cout << parsedExpression->getText() << std::endl;
-  return 0;
+  }
+  evaluateStatements(session, dylib, cache.get(), pending, stats);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::cerr << "repl: " << stats.statements << " statements ("
+            << stats.expressions << " expressions), mean "
+            << (stats.statements
+                    ? stats.totalSeconds / stats.statements * 1e6
+                    : 0.0)
+            << " us, max " << stats.maxSeconds * 1e6 << " us, peak RSS "
+            << usage.ru_maxrss / 1024 << " MB" << std::endl;
+  if (cache) {
+    cache->printStats(llvm::errs());
+  }
 }
 
-int driverParse() {
-  std::stringstream contentStream;
-  std::string sourceCode = R"(
-    def fib(x) 
-      2 * x ;
-    fib(42);
-  )";
-  contentStream << sourceCode;
-  contentStream << static_cast<char>(EOF);
-  std::string str = contentStream.str();
-  int pos = 0;
-  int size = str.size();
-
-  auto getchar = [&pos, &str, &size]() {
-    if (pos < size) {
-      char chr = str.at(pos);
-      pos++;
-      return chr;
-    } else {
-      return static_cast<char>(EOF);
+// Compile and run every script through a StreamingCompiler, one after the
+// other.
+static bool streamScripts(const std::vector<std::string> &paths) {
+  StreamOptions options;
+  options.chunkSize = StreamChunkSize;
+  options.queueDepth = StreamQueueDepth;
+  options.mmap = Mmap;
+  bool ok = true;
+  for (size_t i = 0; i < paths.size(); i++) {
+    const std::string &path = paths[i];
+    auto &dylib = ExitOnErr(
+        TheJIT->createJITDylib(std::to_string(i) + ":" + path));
+    std::unique_ptr<llvm::orc::TieredCompiler> tiered;
+    if (Tiered) {
+      tiered = std::make_unique<llvm::orc::TieredCompiler>(
+          *TheJIT, dylib, OptLevel, TierUpThreshold, Profile.get());
+    }
+    StreamingCompiler compiler(*TheJIT, dylib, compileOptions(), options,
+                               tiered.get());
+    try {
+      compiler.run(path, [&](double value) {
+        std::cout << path << ": " << value << std::endl;
+      });
+    } catch (const std::exception &e) {
+      std::cerr << path << ": error: " << e.what() << std::endl;
+      ok = false;
     }
-  };
-  getNextToken(getchar);
-  driver(getchar);
 
-  return 0;
+    const StreamStats &stats = compiler.getStats();
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    llvm::errs() << llvm::format(
+        "stream: %s: %.1f MB in %.3fs (%.1f MB/s), %llu chunks, %llu defs, "
+        "%llu expressions, %llu modules; busy read %.3fs, parse %.3fs, "
+        "codegen %.3fs, jit %.3fs; peak RSS %ld MB\n",
+        path.c_str(), stats.bytes / 1048576.0, stats.wallSeconds,
+        stats.bytes / 1048576.0 / std::max(stats.wallSeconds, 1e-9),
+        (unsigned long long)stats.chunks,
+        (unsigned long long)stats.definitions,
+        (unsigned long long)stats.expressions,
+        (unsigned long long)stats.modules, stats.readSeconds,
+        stats.parseSeconds, stats.codegenSeconds, stats.jitSeconds,
+        usage.ru_maxrss / 1024);
+    if (tiered) {
+      tiered->printPromotions(llvm::errs());
+    }
+    printMemoStats(compiler.getSession(), dylib, llvm::errs());
+  }
+  return ok;
 }
 
-static llvm::ExitOnError ExitOnErr;
+static std::string withExtension(llvm::StringRef path,
+                                 llvm::StringRef extension) {
+  llvm::SmallString<128> result(path);
+  llvm::sys::path::replace_extension(result, extension);
+  return result.str().str();
+}
 
-void compileAndCallJIT(){
-  TheContext = std::make_unique<llvm::LLVMContext>();
-  TheModule = std::make_unique<llvm::Module>("my cool jit", *TheContext);
-  Builder = std::make_unique<llvm::IRBuilder<>>(*TheContext);
+// --emit-obj, --emit-bc and --emit-lib: write the compiled scripts and their
+// headers instead of running them.
+static bool compileAheadOfTime(const std::vector<std::string> &paths) {
+  if (paths.empty()) {
+    std::cerr << "no scripts to compile" << std::endl;
+    return false;
+  }
+  if (!EmitLib && !OutputFile.empty() && paths.size() > 1) {
+    std::cerr << "-o needs a single script unless with --emit-lib"
+              << std::endl;
+    return false;
+  }
+  try {
+    AOTCompiler compiler(compileOptions());
+    std::vector<llvm::orc::ThreadSafeModule> modules;
+    for (auto &path : paths) {
+      modules.push_back(compiler.compile(path));
+    }
+    if (EmitLib) {
+      std::string output =
+          OutputFile.empty() ? "libkaleidoscope.a" : std::string(OutputFile);
+      std::string header = withExtension(output, "h");
+      compiler.writeLibrary(output, paths, modules);
+      AOTCompiler::writeFile(
+          header, AOTCompiler::makeHeader(header, paths, modules));
+      std::cout << "wrote " << output << " and " << header << std::endl;
+      return true;
+    }
+    for (size_t i = 0; i < paths.size(); i++) {
+      std::string output = !OutputFile.empty()
+                               ? std::string(OutputFile)
+                               : withExtension(paths[i], EmitObj ? "o" : "bc");
+      std::string header = withExtension(output, "h");
+      auto content = EmitObj ? compiler.emitObject(modules[i])
+                             : compiler.emitBitcode(modules[i]);
+      AOTCompiler::writeFile(output,
+                             llvm::StringRef(content.data(), content.size()));
+      AOTCompiler::writeFile(
+          header, AOTCompiler::makeHeader(header, paths[i], modules[i]));
+      std::cout << "wrote " << output << " and " << header << std::endl;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return false;
+  }
+  return true;
+}
 
-  TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create());
-  TheModule->setDataLayout(TheJIT->getDataLayout());
-  driverParse();
-  auto resourceTracker = TheJIT->getMainJITDylib().createResourceTracker();
-  ExitOnErr(TheJIT->addModule(
-      llvm::orc::ThreadSafeModule(std::move(TheModule), std::move(TheContext)),
-      resourceTracker));
-  auto ExprSymbol = ExitOnErr(TheJIT->lookup("__anon_expr"));
-  auto mainPtr = (double (*)())(intptr_t)ExprSymbol.getAddress();
-  int returnVal = mainPtr();
-  std::cout << "jit compiler result: " << returnVal << std::endl;
+static int run() {
+  if (Tiered && Lazy) {
+    std::cerr << "--tiered and --lazy cannot be combined" << std::endl;
+    return 1;
+  }
+  if (EmitObj + EmitBC + EmitLib > 1) {
+    std::cerr << "choose one of --emit-obj, --emit-bc and --emit-lib"
+              << std::endl;
+    return 1;
+  }
+  if (EmitObj || EmitBC || EmitLib) {
+    if (!ProfileGenerate.empty()) {
+      std::cerr << "--profile-generate needs the scripts to run" << std::endl;
+      return 1;
+    }
+    if (Tiered || Repl || Stream || Interpret) {
+      std::cerr << "ahead-of-time compilation does not combine with "
+                   "--tiered, --repl, --stream or --interpret"
+                << std::endl;
+      return 1;
+    }
+    std::vector<std::string> paths(InputFiles.begin(), InputFiles.end());
+    return compileAheadOfTime(paths) ? 0 : 1;
+  }
+  if (Interpret && (Tiered || Repl || Stream)) {
+    std::cerr << "--interpret cannot be combined with --tiered, --repl or "
+                 "--stream"
+              << std::endl;
+    return 1;
+  }
+  if (Repl) {
+    if (Tiered) {
+      std::cerr << "--tiered is not supported with --repl" << std::endl;
+      return 1;
+    }
+    if (CodeCacheBudget && Lazy) {
+      // lazily compiled defs are loaded function by function through stubs
+      // the cache cannot take away
+      std::cerr << "--code-cache-budget cannot be combined with --lazy"
+                << std::endl;
+      return 1;
+    }
+    TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(jitOptions()));
+    runRepl(std::cin);
+    return 0;
+  }
+  if (Stream) {
+    TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(jitOptions()));
+    std::vector<std::string> paths(InputFiles.begin(), InputFiles.end());
+    if (paths.empty()) {
+      paths.push_back("-");
+    }
+    return streamScripts(paths) ? 0 : 1;
+  }
+  if (InputFiles.empty()) {
+    if (Interpret) {
+      interpretBuiltin();
+    } else {
+      compileAndCallJIT();
+    }
+    return 0;
+  }
+  if (!Interpret) {
+    TheJIT = ExitOnErr(llvm::orc::KaleidoscopeJIT::Create(jitOptions()));
+  }
+  return compileScripts(InputFiles, Jobs) ? 0 : 1;
 }
 
-#include <llvm/ExecutionEngine/JITSymbol.h>
-int main(int, char **) {
-  compileAndCallJIT();
-  return 0;
+static bool writeTelemetry() {
+  std::error_code error;
+  llvm::raw_fd_ostream os(TelemetryFile, error, llvm::sys::fs::OF_Text);
+  if (error) {
+    std::cerr << "cannot write " << TelemetryFile << ": " << error.message()
+              << std::endl;
+    return false;
+  }
+  if (TelemetryFormatOpt == TelemetryFormat::Chrome) {
+    Telemetry->writeChromeTrace(os);
+  } else {
+    Telemetry->writeJSON(os);
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  llvm::cl::ParseCommandLineOptions(argc, argv, "kaleidoscope study JIT\n");
+  if (!TelemetryFile.empty()) {
+    Telemetry = std::make_unique<CompileTelemetry>(
+        TelemetryFormatOpt == TelemetryFormat::Chrome);
+  }
+  // tiered compilation always profiles the baseline for tier 1
+  if (!ProfileGenerate.empty() || !ProfileUse.empty() || Tiered) {
+    Profile = std::make_unique<ProfileData>();
+  }
+  try {
+    if (!ProfileUse.empty()) {
+      Profile->read(ProfileUse);
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "error: " << e.what() << std::endl;
+    return 1;
+  }
+  llvm::orc::HostTargetOptions host;
+  host.CPU = CPU;
+  // ahead-of-time output runs elsewhere, on CPUs that may lack the host's
+  // features
+  if (CPU.empty() && (EmitObj || EmitBC || EmitLib)) {
+    host.CPU = llvm::orc::getGenericCPUName();
+  }
+  host.Features = Features;
+  if (CodeModel.getNumOccurrences()) {
+    host.CodeModel = CodeModel;
+  }
+  host.OptLevel = llvm::orc::getCodeGenOptLevel(
+      CodeGenOptLevel < 0 ? unsigned(OptLevel) : unsigned(CodeGenOptLevel));
+  auto target = llvm::orc::createHostTargetMachineBuilder(host);
+  if (!target) {
+    std::cerr << "error: " << llvm::toString(target.takeError()) << std::endl;
+    return 1;
+  }
+  Target = std::move(*target);
+  if (PrintTarget) {
+    llvm::orc::printTarget(*Target, llvm::errs());
+  }
+  int status = run();
+  // compile threads may still be recording until the JIT is gone
+  TheJIT.reset();
+  if (Telemetry && !writeTelemetry()) {
+    return 1;
+  }
+  if (!ProfileUse.empty() && Profile->getLookups() &&
+      !Profile->getAnnotated()) {
+    std::cerr << "warning: no function of this run has counts in "
+              << ProfileUse << "; was it written for other scripts?"
+              << std::endl;
+  }
+  if (!ProfileGenerate.empty()) {
+    try {
+      Profile->write(ProfileGenerate);
+    } catch (const std::exception &e) {
+      std::cerr << "error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  return status;
 }